@@ -3,6 +3,11 @@ from tkinter import ttk, messagebox, scrolledtext
 import socket
 import threading
 import time
+import codec
+
+# 1 = legacy (one message per recv), 2 = length-prefixed frames "<length>\n<payload>",
+# 3 = binary frames with typed payloads, see codec.py
+PROTOCOL_VERSION = codec.PROTOCOL_BINARY
 
 class GameClient:
     def __init__(self):
@@ -12,14 +17,16 @@ class GameClient:
         self.root.geometry("800x600")
         self.root.configure(bg='#2c2c2c')
         self.socket = None
+        self.protocol = 1
         self.connected = False
         self.authenticated = False
         self.player_name = ""
         self.current_lobby = None
         self.is_host = False
         self.lobbies = []
+        self.lobby_list_version = 0
         self.receive_thread = None
-        self.lobby_refresh_job = None
+        self.lobby_subscribed = False
         self.main_frame = tk.Frame(self.root, bg='#2c2c2c')
         self.main_frame.pack(fill=tk.BOTH, expand=True, padx=10, pady=10)
         self.connect_to_server()
@@ -40,10 +47,10 @@ class GameClient:
                         font=('Arial', font_size))
     
     def clear_frame(self):
-        if hasattr(self, 'lobby_refresh_job') and self.lobby_refresh_job:
-            print("[UI] Cancelling lobby refresh job")
-            self.root.after_cancel(self.lobby_refresh_job)
-            self.lobby_refresh_job = None
+        if self.lobby_subscribed:
+            print("[UI] Unsubscribing from lobby list updates")
+            self.send_request(codec.OP_SUBSCRIBE_LOBBIES, 0)
+            self.lobby_subscribed = False
         for widget in self.main_frame.winfo_children():
             widget.destroy()
     
@@ -55,6 +62,7 @@ class GameClient:
             print("[NET] Connecting to server...")
             self.socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
             self.socket.connect(('localhost', 8080))
+            self.protocol = self.negotiate_protocol()
             self.connected = True
             self.receive_thread = threading.Thread(target=self.receive_messages, daemon=True)
             self.receive_thread.start()
@@ -65,6 +73,22 @@ class GameClient:
             messagebox.showerror("Connection Error", f"Failed to connect to server: {e}")
             return False
     
+    def negotiate_protocol(self):
+        # Asked in the legacy format: servers without framing answer with an error and we stay on version 1
+        try:
+            self.socket.settimeout(5)
+            self.socket.send(f"300 {PROTOCOL_VERSION}".encode())
+            reply = self.socket.recv(64).decode().strip('\x00').split('\n')
+            if reply[0] == "B00" and len(reply) > 1:
+                print(f"[NET] Using protocol version {reply[1]}")
+                return int(reply[1])
+        except (socket.timeout, ValueError) as e:
+            print(f"[WARN] Protocol negotiation failed: {e}")
+        finally:
+            self.socket.settimeout(None)
+        print("[NET] Using legacy protocol")
+        return 1
+
     def disconnect_from_server(self):
         if self.socket:
             try:
@@ -75,11 +99,11 @@ class GameClient:
                 print(f"[ERROR] Exception during disconnect: {e}")
             self.socket = None
 
-    def send_message(self, message):
+    def send_request(self, op, *args):
         if self.socket and self.connected:
             try:
-                print(f"[SEND] {message}")
-                self.socket.send(message.encode())
+                print(f"[SEND] {op} {' '.join(str(arg) for arg in args)}")
+                self.socket.sendall(codec.encode_request(self.protocol, op, *args))
                 return True
             except Exception as e:
                 print(f"[ERROR] Failed to send message: {e}")
@@ -91,34 +115,32 @@ class GameClient:
     
     def receive_messages(self):
         print("[THREAD] Starting receive_messages thread")
+        pending = b""
         while self.connected:
             try:
                 if self.socket:
-                    message = self.socket.recv(4096).decode()
-                    if message:
-                        print(f"[RECV] {message.strip()}")
-                        self.handle_server_message(message)
-                    else:
+                    data = self.socket.recv(4096)
+                    if not data:
                         print("[NET] Server closed connection")
                         break
+                    pending += data
+                    frames, pending = codec.split_frames(self.protocol, pending)
+                    for frame in frames:
+                        message = codec.decode(self.protocol, frame)
+                        print(f"[RECV] {message.code} {message.text} {message.fields}")
+                        self.handle_server_message(message)
             except Exception as e:
                 if self.connected:
                     print(f"[ERROR] Receive error: {e}")
                 break
         self.connected = False
         print("[THREAD] receive_messages thread exiting")
-    
-    def handle_server_message(self, message):
-        lines = message.strip().split('\n')
-        if not lines:
-            print("[WARN] Received empty message from server")
-            return
 
-        status_code = lines[0]
+    def handle_server_message(self, message):
+        status_code = message.code
         if self.in_lobby_window():
-            msg_body = '\n'.join(lines[1:]).strip()
-            if msg_body:
-                self.print_lobby_message(msg_body)
+            if message.text:
+                self.print_lobby_message(message.text)
 
         if status_code == "B02":
             print("[AUTH] Login successful")
@@ -131,10 +153,7 @@ class GameClient:
         elif status_code == "A00":
             print("[LOBBY] Lobby created (host)")
             self.is_host = True
-            if len(lines) > 1:
-                self.current_lobby = lines[1].strip()
-            else:
-                self.current_lobby = ""
+            self.current_lobby = message.get('lobby_id', "")
             self.root.after(0, self.show_lobby_host_screen)
         elif status_code == "A01":
             print("[LOBBY] Joined lobby (not host)")
@@ -147,30 +166,38 @@ class GameClient:
             self.root.after(0, self.show_home_screen)
         elif status_code == "A05":
             print("[LOBBY] Received lobbies list")
-            self.parse_lobby_list('\n'.join(lines[1:]))
+            if message.get('version'):
+                self.lobby_list_version = message.get('version')
+            self.lobbies = message.get('lobbies', [])
+            print(f"[LOBBY] Parsed {len(self.lobbies)} lobbies")
+            self.root.after(0, self.refresh_lobby_list)
+        elif status_code == "A14":
+            print("[LOBBY] Lobbies list not modified")
+        elif status_code == "A16":
+            print("[LOBBY] Received lobbies list update")
+            if message.get('version'):
+                self.lobby_list_version = message.get('version')
+            self.apply_lobby_delta(message.get('changed', []), message.get('removed', []))
+        elif status_code == "A17":
+            print(f"[MATCH] Looking for a match, {message.get('waiting')} waiting")
+            self.root.after(0, lambda: messagebox.showinfo("Matchmaking", "Looking for a match, you will join a lobby as soon as enough players are found."))
+        elif status_code == "A18":
+            print("[MATCH] Left matchmaking")
         elif status_code == "A10":
             print("[MATCH] Match started, wait for turn")
             self.root.after(0, self.show_not_your_turn_screen)
         elif status_code == "A11":
             print("[MATCH] Your turn")
-            current_phrase = ""
-            for l in lines:
-                if l.startswith("The current phrase is:"):
-                    current_phrase = l.split("The current phrase is:", 1)[1].strip()
-                elif l.startswith("Start with a phrase"):
-                    current_phrase = "Start with a phrase"
+            current_phrase = message.get('phrase') or "Start with a phrase"
             self.root.after(0, lambda: self.show_your_turn_screen(current_phrase))
         elif status_code == "A13":
             print("[MATCH] Wait for others")
             self.root.after(0, self.show_not_your_turn_screen)
         elif status_code == "A12":
             print("[MATCH] Match terminated, show story")
-            final_story = ""
-            for idx, l in enumerate(lines):
-                if l.startswith("Here is the story of the phrase:"):
-                    final_story = '\n'.join(lines[idx+1:])
-                    break
-            self.root.after(0, lambda: self.show_match_end_screen(final_story))
+            steps = message.get('steps') or []
+            final_phrase = message.get('final') or ""
+            self.root.after(0, lambda: self.show_match_end_screen(steps, final_phrase))
         elif status_code == "A03":
             print("[MATCH] Switch to lobby screen (A03)")
             if self.in_match_window():
@@ -182,43 +209,32 @@ class GameClient:
             print("[QUEUE] Added to queue for lobby")
             messagebox.showinfo("Queue", "You have been added to the queue for this lobby.")
         elif status_code == "Z01":
-            error_msg = '\n'.join(lines[1:]) if len(lines) > 1 else "Bad request"
+            error_msg = message.text or "Bad request"
             print(f"[ERROR] Bad request: {error_msg}")
             self.root.after(0, lambda: messagebox.showerror("Error", error_msg))
         elif status_code == "Z02":
-            error_msg = '\n'.join(lines[1:]) if len(lines) > 1 else "Conflict"
+            error_msg = message.text or "Conflict"
             print(f"[ERROR] Conflict: {error_msg}")
             self.root.after(0, lambda: messagebox.showerror("Error", error_msg))
         elif status_code == "Z03":
-            error_msg = '\n'.join(lines[1:]) if len(lines) > 1 else "Unauthorized"
+            error_msg = message.text or "Unauthorized"
             print(f"[ERROR] Unauthorized: {error_msg}")
             self.root.after(0, lambda: messagebox.showerror("Error", error_msg))
         elif status_code == "Z00":
-            error_msg = '\n'.join(lines[1:]) if len(lines) > 1 else "Server error"
+            error_msg = message.text or "Server error"
             print(f"[ERROR] Server error: {error_msg}")
             self.root.after(0, lambda: messagebox.showerror("Error", error_msg))
         else:
-            if message and not status_code.startswith('Z'):
-                print("[LOBBY] Fallback: parsing as lobby list")
-                self.parse_lobby_list(message)
-    
-    def parse_lobby_list(self, message):
-        self.lobbies = []
-        lines = message.strip().split('\n')
-        for line in lines:
-            if line.strip():
-                parts = line.split()
-                if len(parts) >= 4:
-                    lobby_id = parts[0]
-                    host_name = parts[1]
-                    max_players = parts[2]
-                    current_players = parts[3]
-                    self.lobbies.append({
-                        'id': lobby_id,
-                        'host': host_name,
-                        'players': f"{current_players}/{max_players}"
-                    })
-        print(f"[LOBBY] Parsed {len(self.lobbies)} lobbies")
+            print(f"[WARN] Unhandled message {status_code}")
+
+    def apply_lobby_delta(self, changed, removed):
+        # changed lobbies are added or replaced, removed ones are ids
+        for lobby in changed:
+            self.lobbies = [l for l in self.lobbies if l['id'] != lobby['id']]
+            self.lobbies.append(lobby)
+        for lobby_id in removed:
+            self.lobbies = [l for l in self.lobbies if l['id'] != lobby_id]
+        print(f"[LOBBY] {len(self.lobbies)} lobbies after update")
         self.root.after(0, self.refresh_lobby_list)
     
     def show_login_screen(self):
@@ -277,8 +293,7 @@ class GameClient:
             messagebox.showerror("Error", "Please enter username and password")
             return
         self.player_name = username
-        message = f"202 {username} {password}"
-        self.send_message(message)
+        self.send_request(codec.OP_LOGIN, username, password)
     
     def signup(self):
         if not self.connected:
@@ -291,21 +306,18 @@ class GameClient:
             print("[ERROR] Username or password missing in signup")
             messagebox.showerror("Error", "Please enter username and password")
             return
-        message = f"201 {language} {username} {password}"
-        self.send_message(message)
+        self.send_request(codec.OP_SIGNUP, language, username, password)
     
     def show_home_screen(self):
         print("[UI] Showing home screen")
         self.clear_frame()
         self.authenticated = True
-        if hasattr(self, 'lobby_refresh_job') and self.lobby_refresh_job:
-            self.root.after_cancel(self.lobby_refresh_job)
-            self.lobby_refresh_job = None
         header_frame = tk.Frame(self.main_frame, bg='#2c2c2c')
         header_frame.pack(fill=tk.X, pady=10)
         welcome_label = self.create_styled_label(header_frame, f"Hello {self.player_name}", 16, 'white')
         welcome_label.pack(side=tk.LEFT)
         self.create_styled_button(header_frame, "Create a lobby", self.create_lobby).pack(side=tk.RIGHT)
+        self.create_styled_button(header_frame, "Find a match", self.find_match).pack(side=tk.RIGHT, padx=5)
         lobby_frame = tk.Frame(self.main_frame, bg='#2c2c2c')
         lobby_frame.pack(fill=tk.BOTH, expand=True)
         headers_frame = tk.Frame(lobby_frame, bg='#4a4a4a')
@@ -315,18 +327,10 @@ class GameClient:
         self.create_styled_label(headers_frame, "Players", 10, 'white').pack(side=tk.LEFT, padx=50)
         self.lobby_list_frame = tk.Frame(lobby_frame, bg='#2c2c2c')
         self.lobby_list_frame.pack(fill=tk.BOTH, expand=True)
-        self.send_message("102")
-        self.schedule_lobby_refresh()
-
-    def schedule_lobby_refresh(self):
-        def refresh():
-            if hasattr(self, 'lobby_list_frame') and self.lobby_list_frame.winfo_exists():
-                print("[UI] Refreshing lobby list")
-                self.send_message("102")
-                self.lobby_refresh_job = self.root.after(5000, refresh)
-            else:
-                self.lobby_refresh_job = None
-        self.lobby_refresh_job = self.root.after(5000, refresh)
+        # the server answers with the whole list, then pushes changes until we leave this screen
+        self.lobby_list_version = 0
+        self.send_request(codec.OP_SUBSCRIBE_LOBBIES, 1)
+        self.lobby_subscribed = True
 
     def refresh_lobby_list(self):
         if not hasattr(self, 'lobby_list_frame'):
@@ -359,17 +363,20 @@ class GameClient:
             messagebox.showerror("Error", "You must be logged in to create a lobby.")
             return
         print("[LOBBY] Creating lobby")
-        message = "100"
-        self.send_message(message)
+        self.send_request(codec.OP_CREATE_LOBBY)
         self.is_host = True
         self.current_lobby = ""
         self.show_lobby_host_screen()
     
+    def find_match(self):
+        # the server picks or creates a lobby in our language and starts the match when it is full
+        print("[MATCH] Looking for a match")
+        self.send_request(codec.OP_FIND_MATCH, 4)
+
     def join_lobby(self, lobby_id):
         print(f"[LOBBY] Joining lobby {lobby_id}")
         self.current_lobby = lobby_id
-        message = f"101 {lobby_id}"
-        self.send_message(message)
+        self.send_request(codec.OP_JOIN_LOBBY, lobby_id)
         self.show_lobby_screen()
     
     def show_lobby_host_screen(self):
@@ -443,7 +450,7 @@ class GameClient:
         wait_frame.pack(expand=True)
         self.create_styled_label(wait_frame, "Wait for the other players to finish their turn", 14, 'white').pack()
 
-    def show_match_end_screen(self, final_story):
+    def show_match_end_screen(self, steps, final_phrase):
         print("[UI] Showing match end screen")
         self.clear_frame()
         header_frame = tk.Frame(self.main_frame, bg='#2c2c2c')
@@ -457,16 +464,9 @@ class GameClient:
         self.create_styled_label(results_frame, "Match Completed!", 16, '#ffd700').pack(pady=10)
         self.create_styled_label(results_frame, "Here is the story of the phrase:", 12, 'white').pack(pady=5)
 
-        story_part = final_story
-        final_phrase = ""
-        if "=>" in final_story:
-            story_part, final_phrase = final_story.rsplit("=>", 1)
-            final_phrase = final_phrase.strip()
-            story_part = story_part.strip()
 
         timeline_frame = tk.Frame(results_frame, bg='#2c2c2c')
         timeline_frame.pack(fill=tk.BOTH, expand=True, pady=10)
-        steps = [part.strip() for part in story_part.strip().split('->') if part.strip()]
         colors = ['#f5f5f5', '#e3f2fd']
         border_colors = ['#ffd700', '#2196f3']
         for idx, phrase in enumerate(steps):
@@ -555,17 +555,15 @@ class GameClient:
                     print("[ERROR] Phrase too long (max 99 characters)")
                     messagebox.showerror("Error", "Phrase too long (max 99 characters)")
                     return
-                message = f"111 {length:02d} {phrase}"
                 print(f"[SEND] Phrase: {phrase}")
-                self.send_message(message)
+                self.send_request(codec.OP_SPEAK, phrase)
                 self.phrase_entry.delete(0, tk.END)
     
     def start_match(self, force_clockwise=False):
         print("[MATCH] Host starting match")
         def send_with_direction(direction):
-            message = f"110 {direction}"
             print(f"[MATCH] Sending start match with direction {direction}")
-            self.send_message(message)
+            self.send_request(codec.OP_START_MATCH, direction)
         if not self.is_host:
             print("[ERROR] Only the host can start the match.")
             messagebox.showerror("Error", "Only the host can start the match.")
@@ -594,8 +592,7 @@ class GameClient:
 
     def leave_lobby(self):
         print("[LOBBY] Leaving lobby")
-        message = "103"
-        self.send_message(message)
+        self.send_request(codec.OP_LEAVE_LOBBY)
         self.root.after(0, self.show_home_screen)
     
     def on_closing(self):
@@ -0,0 +1,266 @@
+import struct
+import uuid
+
+# Wire codecs of the game protocol. Versions 1 and 2 carry text, "<code>\n<text>",
+# version 2 behind a "<length>\n" header. Version 3 is binary: a u16 code and the
+# u32 payload length, big-endian, then a typed payload. Requests carry their
+# opcode as code, responses "A05" as 0x4105. Strings are a u8 or u16 length and
+# the bytes, lobby ids the 16 raw bytes of the UUID.
+
+PROTOCOL_LEGACY = 1
+PROTOCOL_FRAMED = 2
+PROTOCOL_BINARY = 3
+
+HEADER = struct.Struct(">HI")
+
+OP_CREATE_LOBBY = 100
+OP_JOIN_LOBBY = 101
+OP_LEAVE_LOBBY = 103
+OP_SUBSCRIBE_LOBBIES = 105
+OP_FIND_MATCH = 106
+OP_START_MATCH = 110
+OP_SPEAK = 111
+OP_SIGNUP = 201
+OP_LOGIN = 202
+
+# The text the server sends with each status in versions 1 and 2; the binary
+# protocol leaves it out, errors aside
+STATUS_TEXT = {
+    "A01": "Welcome to the lobby",
+    "A02": "The host left, leaving the lobby",
+    "A03": "A player left the lobby",
+    "A04": "The lobby is full, you are in a queue now",
+    "A06": "You left the queue",
+    "A07": "The match is already started, you are in a queue now",
+    "A08": "A player joined the lobby",
+    "A13": "Wait for the other players to finish",
+    "A18": "You left matchmaking",
+    "B01": "Signup successful!",
+}
+
+
+class Message:
+    """A decoded server message: its status code, the text shown to the player and the typed fields."""
+
+    def __init__(self, code, text="", **fields):
+        self.code = code
+        self.text = text
+        self.fields = fields
+
+    def get(self, name, default=None):
+        return self.fields.get(name, default)
+
+
+def str8(text):
+    data = text.encode()[:255]
+    return bytes([len(data)]) + data
+
+
+def encode_request(protocol, op, *args):
+    """The bytes of request op with its arguments, in the format of protocol."""
+    if protocol == PROTOCOL_BINARY:
+        if op == OP_SIGNUP:
+            language, username, password = args
+            payload = language.encode()[:2].ljust(2, b"\0") + str8(username) + str8(password)
+        elif op == OP_LOGIN:
+            payload = str8(args[0]) + str8(args[1])
+        elif op == OP_JOIN_LOBBY:
+            payload = uuid.UUID(args[0]).bytes
+        elif op == OP_SPEAK:
+            payload = str8(args[0])
+        elif op in (OP_SUBSCRIBE_LOBBIES, OP_FIND_MATCH, OP_START_MATCH):
+            payload = bytes([int(args[0])])
+        else:
+            payload = b""
+        return HEADER.pack(op, len(payload)) + payload
+    if op == OP_SPEAK:
+        text = f"{op} {len(args[0]):02d} {args[0]}"
+    else:
+        text = " ".join([str(op)] + [str(arg) for arg in args])
+    data = text.encode()
+    if protocol >= PROTOCOL_FRAMED:
+        data = f"{len(data)}\n".encode() + data
+    return data
+
+
+def split_frames(protocol, data):
+    """The whole frames at the start of data and the bytes left over."""
+    if protocol < PROTOCOL_FRAMED:
+        return [data], b""
+    frames = []
+    if protocol == PROTOCOL_BINARY:
+        while len(data) >= HEADER.size:
+            _, length = HEADER.unpack_from(data)
+            if len(data) < HEADER.size + length:
+                break
+            frames.append(data[:HEADER.size + length])
+            data = data[HEADER.size + length:]
+        return frames, data
+    while b"\n" in data:
+        header, rest = data.split(b"\n", 1)
+        length = int(header)
+        if len(rest) < length:
+            break
+        frames.append(rest[:length])
+        data = rest[length:]
+    return frames, data
+
+
+def decode(protocol, frame):
+    """The Message in a frame split off by split_frames."""
+    if protocol == PROTOCOL_BINARY:
+        return decode_binary(frame)
+    return decode_text(frame.decode().strip('\x00'))
+
+
+# Text
+
+def parse_lobby_line(line):
+    parts = line.split()
+    if len(parts) < 4:
+        return None
+    return {'id': parts[0], 'host': parts[1], 'players': f"{parts[3]}/{parts[2]}"}
+
+
+def parse_lobby_lines(lines):
+    return [lobby for lobby in (parse_lobby_line(line) for line in lines if line.strip()) if lobby]
+
+
+def decode_text(message):
+    lines = message.strip().split('\n')
+    code, _, arg = lines[0].partition(' ')
+    body = lines[1:]
+    text = '\n'.join(body).strip()
+    version = int(arg) if arg.isdigit() else None
+    if code == "A00":
+        return Message(code, text, lobby_id=body[0].strip() if body else "")
+    if code == "A05":
+        return Message(code, "", version=version, lobbies=parse_lobby_lines(body))
+    if code == "A14":
+        return Message(code, "", version=version)
+    if code == "A16":
+        # "+<lobby line>" adds or replaces a lobby, "-<id>" removes one
+        changed = parse_lobby_lines(line[1:] for line in body if line.startswith('+'))
+        removed = [line[1:].strip() for line in body if line.startswith('-')]
+        return Message(code, "", version=version, changed=changed, removed=removed)
+    if code == "A17":
+        return Message(code, text, waiting=int(arg) if arg.isdigit() else 0)
+    if code == "A11":
+        phrase = None
+        for line in body:
+            if line.startswith("The current phrase is:"):
+                phrase = line.split("The current phrase is:", 1)[1].strip()
+        return Message(code, text, phrase=phrase)
+    if code == "A12":
+        story = None
+        for idx, line in enumerate(body):
+            if line.startswith("Here is the story of the phrase:"):
+                story = '\n'.join(body[idx + 1:])
+                break
+        if story is None:
+            return Message(code, text, steps=None, final=None)
+        final = None
+        if "=>" in story:
+            story, final = story.rsplit("=>", 1)
+            final = final.strip()
+        steps = [part.strip() for part in story.strip().split('->') if part.strip()]
+        return Message(code, "The match is terminated", steps=steps, final=final)
+    if code == "B00":
+        return Message(code, text, version=int(body[0]) if body and body[0].strip().isdigit() else None)
+    if code in ("A01", "A02", "A03", "A04", "A06", "A07", "A08", "A10", "A13", "A18", "B01", "B02") or code.startswith('Z'):
+        return Message(code, text)
+    # servers before the status codes sent the bare list
+    return Message("A05", "", version=None, lobbies=parse_lobby_lines(lines))
+
+
+# Binary
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def take(self, n):
+        chunk = self.data[self.pos:self.pos + n]
+        if len(chunk) < n:
+            raise ValueError("truncated message")
+        self.pos += n
+        return chunk
+
+    def u8(self):
+        return self.take(1)[0]
+
+    def u16(self):
+        return struct.unpack(">H", self.take(2))[0]
+
+    def u32(self):
+        return struct.unpack(">I", self.take(4))[0]
+
+    def u64(self):
+        return struct.unpack(">Q", self.take(8))[0]
+
+    def str8(self):
+        return self.take(self.u8()).decode()
+
+    def str16(self):
+        return self.take(self.u16()).decode()
+
+    def uuid(self):
+        return str(uuid.UUID(bytes=self.take(16)))
+
+    def rest(self):
+        return self.take(len(self.data) - self.pos).decode()
+
+    def remaining(self):
+        return len(self.data) - self.pos
+
+
+def read_lobbies(reader, count=None):
+    # id, u8 max players, u8 players, str8 host
+    lobbies = []
+    while reader.remaining() > 0 and (count is None or len(lobbies) < count):
+        lobby_id = reader.uuid()
+        max_players = reader.u8()
+        players = reader.u8()
+        lobbies.append({'id': lobby_id, 'host': reader.str8(), 'players': f"{players}/{max_players}"})
+    return lobbies
+
+
+def decode_binary(frame):
+    raw, length = HEADER.unpack_from(frame)
+    code = f"{chr(raw >> 8)}{raw & 0xff:02d}"
+    reader = Reader(frame[HEADER.size:HEADER.size + length])
+    if code == "A00":
+        return Message(code, "", lobby_id=reader.uuid())
+    if code == "A05":
+        version = reader.u32()
+        return Message(code, "", version=version or None, lobbies=read_lobbies(reader))
+    if code == "A14":
+        return Message(code, "", version=reader.u32())
+    if code == "A15":
+        return Message(code, "", cursor=reader.u64(), lobbies=read_lobbies(reader))
+    if code == "A16":
+        version = reader.u32()
+        changed = read_lobbies(reader, reader.u16())
+        removed = []
+        while reader.remaining() > 0:
+            removed.append(reader.uuid())
+        return Message(code, "", version=version, changed=changed, removed=removed)
+    if code == "A17":
+        return Message(code, "", waiting=reader.u32())
+    if code == "A11":
+        # the phrase so far, empty on the first turn
+        return Message(code, "", phrase=reader.rest() or None)
+    if code == "A12":
+        # no payload when the match ended unfinished
+        if reader.remaining() == 0:
+            return Message(code, "The match is terminated", steps=None, final=None)
+        steps = [reader.str16() for _ in range(reader.u8())]
+        return Message(code, "The match is terminated", steps=steps, final=reader.rest() or None)
+    if code == "B00":
+        return Message(code, "", version=reader.u16())
+    if code == "B02":
+        return Message(code, "", username=reader.rest())
+    if code.startswith('Z'):
+        return Message(code, reader.rest())
+    return Message(code, STATUS_TEXT.get(code, ""))
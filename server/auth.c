@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include <glib-2.0/glib.h>
+#include "auth.h"
+#include "db.h"
+#include "logger.h"
+
+#define HASH_PREFIX "pbkdf2_sha256"
+#define SALT_LEN 16
+#define KEY_LEN 32
+#define MAX_STORED 160
+#define LATENCY_SAMPLES 1024
+#define STATS_EVERY 100
+
+typedef struct {
+    bool signup;
+    char username[32];
+    char password[32];
+    char language[3];
+    auth_cb cb;
+    void* userdata;
+    gint64 queued_at;
+} AuthJob;
+
+static GAsyncQueue* jobs = NULL;
+static int hash_iterations = 100000;
+static AuthStats stats = {0};
+static gint64 latencies[LATENCY_SAMPLES]; // ring of the last completions, microseconds
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* ** HASHING ** */
+
+// PBKDF2-HMAC-SHA256 (RFC 8018) for a single 32 byte block
+static void pbkdf2_sha256(const char* password, const guint8* salt, gsize salt_len, int iterations, guint8* out) {
+    GHmac* keyed = g_hmac_new(G_CHECKSUM_SHA256, (const guint8*) password, strlen(password));
+    guint8 u[KEY_LEN];
+    gsize len = sizeof(u);
+    const guint8 block[4] = {0, 0, 0, 1};
+    GHmac* h = g_hmac_copy(keyed);
+    g_hmac_update(h, salt, salt_len);
+    g_hmac_update(h, block, sizeof(block));
+    g_hmac_get_digest(h, u, &len);
+    g_hmac_unref(h);
+    memcpy(out, u, KEY_LEN);
+    for (int i = 1; i < iterations; i++) {
+        h = g_hmac_copy(keyed);
+        g_hmac_update(h, u, sizeof(u));
+        len = sizeof(u);
+        g_hmac_get_digest(h, u, &len);
+        g_hmac_unref(h);
+        for (int j = 0; j < KEY_LEN; j++) {
+            out[j] ^= u[j];
+        }
+    }
+    g_hmac_unref(keyed);
+}
+
+static bool hash_password(const char* password, char* out, size_t out_size) {
+    guint8 salt[SALT_LEN], key[KEY_LEN];
+    if (getrandom(salt, sizeof(salt), 0) != sizeof(salt)) {
+        return false;
+    }
+    pbkdf2_sha256(password, salt, sizeof(salt), hash_iterations, key);
+    gchar* salt64 = g_base64_encode(salt, sizeof(salt));
+    gchar* key64 = g_base64_encode(key, sizeof(key));
+    snprintf(out, out_size, HASH_PREFIX "$%d$%s$%s", hash_iterations, salt64, key64);
+    g_free(salt64);
+    g_free(key64);
+    return true;
+}
+
+static bool equal_constant_time(const guint8* a, const guint8* b, gsize len) {
+    guint8 diff = 0;
+    for (gsize i = 0; i < len; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+// Checks password against a stored value; *plaintext is set for rows still to migrate
+static bool verify_password(const char* password, const char* stored, bool* plaintext) {
+    *plaintext = !g_str_has_prefix(stored, HASH_PREFIX "$");
+    if (*plaintext) {
+        size_t len = strlen(password);
+        return len == strlen(stored) && equal_constant_time((const guint8*) password, (const guint8*) stored, len);
+    }
+    gchar** parts = g_strsplit(stored, "$", 4);
+    bool ok = false;
+    if (g_strv_length(parts) == 4) {
+        int iterations = atoi(parts[1]);
+        gsize salt_len, key_len;
+        guint8* salt = g_base64_decode(parts[2], &salt_len);
+        guint8* key = g_base64_decode(parts[3], &key_len);
+        if (iterations > 0 && key_len == KEY_LEN) {
+            guint8 computed[KEY_LEN];
+            pbkdf2_sha256(password, salt, salt_len, iterations, computed);
+            ok = equal_constant_time(computed, key, KEY_LEN);
+        }
+        g_free(salt);
+        g_free(key);
+    }
+    g_strfreev(parts);
+    return ok;
+}
+
+/* ** WORKERS ** */
+
+static int latency_cmp(const void* a, const void* b) {
+    gint64 x = *(const gint64*) a, y = *(const gint64*) b;
+    return (x > y) - (x < y);
+}
+
+// Call with stats_mutex held
+static void stats_percentiles(void) {
+    int n = stats.completed < LATENCY_SAMPLES ? (int) stats.completed : LATENCY_SAMPLES;
+    if (n == 0) return;
+    gint64 sorted[LATENCY_SAMPLES];
+    memcpy(sorted, latencies, n * sizeof(gint64));
+    qsort(sorted, n, sizeof(gint64), latency_cmp);
+    stats.p50_ms = sorted[n / 2] / 1000.0;
+    stats.p99_ms = sorted[(n * 99) / 100] / 1000.0;
+}
+
+static void auth_record(AuthJob* job, bool migrated) {
+    pthread_mutex_lock(&stats_mutex);
+    latencies[stats.completed % LATENCY_SAMPLES] = g_get_monotonic_time() - job->queued_at;
+    stats.completed++;
+    stats.queued--;
+    if (migrated) stats.migrated++;
+    if (stats.completed % STATS_EVERY == 0) {
+        stats_percentiles();
+        LOG_INFO("auth.stats", NULL, NULL, "%lu done, %lu rejected, %lu migrated, p50 %.1f ms, p99 %.1f ms",
+                 stats.completed, stats.rejected, stats.migrated, stats.p50_ms, stats.p99_ms);
+    }
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+static void auth_run(AuthJob* job) {
+    char uuid[37] = {0}, language[3] = {0};
+    char stored[MAX_STORED];
+    bool migrated = false;
+    int result;
+    if (job->signup) {
+        if (!hash_password(job->password, stored, sizeof(stored))) {
+            result = AUTH_ERROR;
+        } else {
+            int res = db_signup(job->username, stored, job->language, uuid);
+            result = res == 0 ? AUTH_OK : res == 1 ? AUTH_WRONG_PASSWORD : AUTH_ERROR;
+            strcpy(language, job->language);
+        }
+    } else if (db_find_user(job->username, uuid, stored, sizeof(stored), language) != 0) {
+        result = AUTH_NOT_FOUND;
+    } else {
+        bool plaintext;
+        result = verify_password(job->password, stored, &plaintext) ? AUTH_OK : AUTH_WRONG_PASSWORD;
+        if (result == AUTH_OK && plaintext && hash_password(job->password, stored, sizeof(stored))) {
+            migrated = db_set_password(job->username, stored) == 0;
+            if (migrated) {
+                LOG_INFO("auth.migrate", NULL, job->username, "Migrated the password to " HASH_PREFIX);
+            }
+        }
+    }
+    // wipe the password before anything else can see this memory
+    memset(job->password, 0, sizeof(job->password));
+    auth_record(job, migrated);
+    job->cb(result, uuid, language, job->userdata);
+}
+
+static void* auth_worker(void* arg) {
+    (void) arg;
+    while (1) {
+        AuthJob* job = g_async_queue_pop(jobs);
+        auth_run(job);
+        g_free(job);
+    }
+    return NULL;
+}
+
+int auth_start(int workers, int queue_capacity, int iterations) {
+    if (workers < 1) workers = 1;
+    if (queue_capacity < 1) queue_capacity = 1;
+    if (iterations > 0) hash_iterations = iterations;
+    jobs = g_async_queue_new();
+    stats.workers = workers;
+    stats.capacity = queue_capacity;
+    for (int i = 0; i < workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, auth_worker, NULL) != 0) {
+            fprintf(stderr, "failed to start auth worker %d\n", i);
+            return 1;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+static bool auth_submit(AuthJob* job) {
+    pthread_mutex_lock(&stats_mutex);
+    bool full = stats.queued >= stats.capacity;
+    if (full) {
+        stats.rejected++;
+    } else {
+        stats.queued++;
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    if (full) {
+        g_free(job);
+        return false;
+    }
+    job->queued_at = g_get_monotonic_time();
+    g_async_queue_push(jobs, job);
+    return true;
+}
+
+bool auth_login(const char* username, const char* password, auth_cb cb, void* userdata) {
+    AuthJob* job = g_new0(AuthJob, 1);
+    g_strlcpy(job->username, username, sizeof(job->username));
+    g_strlcpy(job->password, password, sizeof(job->password));
+    job->cb = cb;
+    job->userdata = userdata;
+    return auth_submit(job);
+}
+
+bool auth_signup(const char* username, const char* password, const char* language, auth_cb cb, void* userdata) {
+    AuthJob* job = g_new0(AuthJob, 1);
+    job->signup = true;
+    g_strlcpy(job->username, username, sizeof(job->username));
+    g_strlcpy(job->password, password, sizeof(job->password));
+    g_strlcpy(job->language, language, sizeof(job->language));
+    job->cb = cb;
+    job->userdata = userdata;
+    return auth_submit(job);
+}
+
+void auth_stats(AuthStats* out) {
+    pthread_mutex_lock(&stats_mutex);
+    stats_percentiles();
+    *out = stats;
+    pthread_mutex_unlock(&stats_mutex);
+}
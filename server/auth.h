@@ -0,0 +1,38 @@
+#ifndef AUTH_H
+#define AUTH_H
+
+#include <stdbool.h>
+
+// Password hashing and verification run on a bounded pool of auth workers,
+// away from the connection threads. Passwords are stored as
+// pbkdf2_sha256$<iterations>$<salt>$<hash> (base64); plaintext rows left by
+// older servers are rehashed on their next successful login.
+
+#define AUTH_OK 0
+#define AUTH_WRONG_PASSWORD 1 // also a taken username on signup
+#define AUTH_NOT_FOUND 2
+#define AUTH_ERROR 3
+
+typedef struct {
+    int workers;
+    int queued;
+    int capacity;
+    unsigned long completed;
+    unsigned long rejected;
+    unsigned long migrated;
+    double p50_ms; // over the last completed requests, queueing included
+    double p99_ms;
+} AuthStats;
+
+// Called on an auth worker thread; uuid and language are set on AUTH_OK.
+typedef void (*auth_cb)(int result, const char* uuid, const char* language, void* userdata);
+
+int auth_start(int workers, int queue_capacity, int iterations);
+
+// Both return false without queueing when the queue is full.
+bool auth_login(const char* username, const char* password, auth_cb cb, void* userdata);
+bool auth_signup(const char* username, const char* password, const char* language, auth_cb cb, void* userdata);
+
+void auth_stats(AuthStats* stats);
+
+#endif
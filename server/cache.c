@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <glib-2.0/glib.h>
+#include "cache.h"
+
+typedef struct {
+    char *key;
+    char *value;
+    size_t bytes;
+    GList link; // position in the shard LRU list, head is the most recent
+} CacheEntry;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    GHashTable *entries; // key -> CacheEntry
+    GQueue lru;
+    size_t bytes;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+} CacheShard;
+
+static CacheShard *shards = NULL;
+static int shard_count = 0;
+static size_t shard_budget = 0;
+
+static void entry_free(gpointer data) {
+    CacheEntry *entry = (CacheEntry *) data;
+    g_free(entry->key);
+    g_free(entry->value);
+    g_free(entry);
+}
+
+void cache_init(size_t budget, int count) {
+    if (count < 1) count = 1;
+    shards = g_new0(CacheShard, count);
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_init(&shards[i].mutex, NULL);
+        shards[i].entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, entry_free);
+        g_queue_init(&shards[i].lru);
+    }
+    shard_count = count;
+    shard_budget = budget / count;
+}
+
+char *cache_key(const char *text, const char *source, const char *target) {
+    return g_strdup_printf("%s|%s|%s", source, target, text);
+}
+
+static CacheShard *shard_for(const char *key) {
+    return &shards[g_str_hash(key) % shard_count];
+}
+
+bool cache_get(const char *text, const char *source, const char *target, char *out, size_t out_size) {
+    if (shard_count == 0) return false;
+    char *key = cache_key(text, source, target);
+    CacheShard *shard = shard_for(key);
+    pthread_mutex_lock(&shard->mutex);
+    CacheEntry *entry = g_hash_table_lookup(shard->entries, key);
+    if (entry) {
+        g_queue_unlink(&shard->lru, &entry->link);
+        g_queue_push_head_link(&shard->lru, &entry->link);
+        g_strlcpy(out, entry->value, out_size);
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    g_free(key);
+    return entry != NULL;
+}
+
+void cache_put(const char *text, const char *source, const char *target, const char *translated) {
+    if (shard_count == 0) return;
+    CacheEntry *entry = g_new0(CacheEntry, 1);
+    entry->key = cache_key(text, source, target);
+    entry->value = g_strdup(translated);
+    entry->bytes = sizeof(CacheEntry) + strlen(entry->key) + strlen(entry->value) + 2;
+    entry->link.data = entry;
+    if (entry->bytes > shard_budget) {
+        entry_free(entry);
+        return;
+    }
+
+    CacheShard *shard = shard_for(entry->key);
+    pthread_mutex_lock(&shard->mutex);
+    CacheEntry *old = g_hash_table_lookup(shard->entries, entry->key);
+    if (old) {
+        g_queue_unlink(&shard->lru, &old->link);
+        shard->bytes -= old->bytes;
+        g_hash_table_remove(shard->entries, old->key);
+    }
+    g_hash_table_insert(shard->entries, entry->key, entry);
+    g_queue_push_head_link(&shard->lru, &entry->link);
+    shard->bytes += entry->bytes;
+    while (shard->bytes > shard_budget) {
+        GList *tail = g_queue_pop_tail_link(&shard->lru);
+        CacheEntry *victim = (CacheEntry *) tail->data;
+        shard->bytes -= victim->bytes;
+        shard->evictions++;
+        g_hash_table_remove(shard->entries, victim->key);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void cache_stats(CacheStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->budget = shard_budget * shard_count;
+    for (int i = 0; i < shard_count; i++) {
+        pthread_mutex_lock(&shards[i].mutex);
+        stats->hits += shards[i].hits;
+        stats->misses += shards[i].misses;
+        stats->evictions += shards[i].evictions;
+        stats->entries += g_hash_table_size(shards[i].entries);
+        stats->bytes += shards[i].bytes;
+        pthread_mutex_unlock(&shards[i].mutex);
+    }
+}
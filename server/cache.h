@@ -0,0 +1,32 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Translation cache keyed by (text, source, target). Entries are spread over
+// independently locked shards, each one an LRU list trimmed to its share of
+// the memory budget.
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long entries;
+    size_t bytes;
+    size_t budget;
+} CacheStats;
+
+void cache_init(size_t budget, int shards);
+
+// Copies the cached translation into out, false on a miss.
+bool cache_get(const char *text, const char *source, const char *target, char *out, size_t out_size);
+
+void cache_put(const char *text, const char *source, const char *target, const char *translated);
+
+void cache_stats(CacheStats *stats);
+
+// The lookup key used by the cache, also handy to identify identical requests. Free with g_free.
+char *cache_key(const char *text, const char *source, const char *target);
+
+#endif
@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <glib-2.0/glib.h>
+#include "cache.h"
+#include "cache_store.h"
+#include "logger.h"
+
+#define FLUSH_INTERVAL_MS 500
+#define FLUSH_BATCH 256
+#define MAX_PENDING 10000
+
+typedef struct {
+    char *text;
+    char source[8];
+    char target[8];
+    char *translated; // NULL for a hit
+    int hits;
+} PendingWrite;
+
+// The writer thread owns store, lookups and the preload go through reader. In
+// WAL mode the reader sees the last commit while a batch is being written, so
+// lookups never wait for the writer.
+static sqlite3 *store = NULL;
+static sqlite3_stmt *upsert_stmt = NULL;
+static sqlite3_stmt *hit_stmt = NULL;
+static sqlite3 *reader = NULL;
+static sqlite3_stmt *select_stmt = NULL;
+static pthread_mutex_t read_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// key -> PendingWrite, repeated puts and hits of one key collapse into one row
+static GHashTable *pending = NULL;
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long dropped = 0;
+
+static void pending_free(gpointer data) {
+    PendingWrite *w = (PendingWrite *) data;
+    g_free(w->text);
+    g_free(w->translated);
+    g_free(w);
+}
+
+static void store_flush(GHashTable *batch) {
+    if (sqlite3_exec(store, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK) {
+        LOG_ERROR("store.flush_failed", NULL, NULL, "Dropped %u translation store writes: %s",
+                  g_hash_table_size(batch), sqlite3_errmsg(store));
+        return;
+    }
+    int failed = 0;
+    char error[128] = "";
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, batch);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        PendingWrite *w = (PendingWrite *) value;
+        sqlite3_stmt *stmt = w->translated ? upsert_stmt : hit_stmt;
+        if (w->translated) {
+            sqlite3_bind_text(stmt, 1, w->source, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, w->target, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 3, w->text, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 4, w->translated, -1, SQLITE_STATIC);
+            sqlite3_bind_int(stmt, 5, w->hits);
+        } else {
+            sqlite3_bind_int(stmt, 1, w->hits);
+            sqlite3_bind_text(stmt, 2, w->source, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 3, w->target, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 4, w->text, -1, SQLITE_STATIC);
+        }
+        if (sqlite3_step(stmt) != SQLITE_DONE && failed++ == 0) {
+            g_strlcpy(error, sqlite3_errmsg(store), sizeof(error));
+        }
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }
+    if (failed > 0) {
+        LOG_ERROR("store.write_failed", NULL, NULL, "%d of %u translation store writes failed: %s",
+                  failed, g_hash_table_size(batch), error);
+    }
+    if (sqlite3_exec(store, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+        LOG_ERROR("store.flush_failed", NULL, NULL, "Dropped %u translation store writes, commit failed: %s",
+                  g_hash_table_size(batch), sqlite3_errmsg(store));
+        sqlite3_exec(store, "ROLLBACK;", NULL, NULL, NULL);
+    }
+}
+
+static void *store_writer(void *arg) {
+    (void) arg;
+    while (1) {
+        pthread_mutex_lock(&pending_mutex);
+        if (g_hash_table_size(pending) < FLUSH_BATCH) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += FLUSH_INTERVAL_MS * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&pending_cond, &pending_mutex, &deadline);
+        }
+        GHashTable *batch = NULL;
+        if (g_hash_table_size(pending) > 0) {
+            batch = pending;
+            pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, pending_free);
+        }
+        pthread_mutex_unlock(&pending_mutex);
+        if (batch) {
+            store_flush(batch);
+            g_hash_table_destroy(batch);
+        }
+    }
+    return NULL;
+}
+
+// Undoes a partial open, the server then caches in memory only
+static void store_close(void) {
+    sqlite3_finalize(upsert_stmt);
+    sqlite3_finalize(hit_stmt);
+    sqlite3_finalize(select_stmt);
+    sqlite3_close(store);
+    sqlite3_close(reader);
+    upsert_stmt = hit_stmt = select_stmt = NULL;
+    store = reader = NULL;
+}
+
+int cache_store_open(const char *path) {
+    if (sqlite3_open(path, &store) != SQLITE_OK) {
+        LOG_ERROR("store.open_failed", NULL, NULL, "Can't open translation store: %s", sqlite3_errmsg(store));
+        store_close();
+        return 1;
+    }
+    const char *sql = "PRAGMA journal_mode = WAL;"
+                      "PRAGMA synchronous = NORMAL;"
+                      "CREATE TABLE IF NOT EXISTS translations ("
+                      "source TEXT NOT NULL,"
+                      "target TEXT NOT NULL,"
+                      "text TEXT NOT NULL,"
+                      "translated TEXT NOT NULL,"
+                      "hits INTEGER NOT NULL DEFAULT 1,"
+                      "PRIMARY KEY (source, target, text));"
+                      "CREATE INDEX IF NOT EXISTS translations_hits ON translations (hits);";
+    char *err = NULL;
+    if (sqlite3_exec(store, sql, NULL, NULL, &err) != SQLITE_OK) {
+        LOG_ERROR("store.open_failed", NULL, NULL, "Translation store: %s", err);
+        sqlite3_free(err);
+        store_close();
+        return 1;
+    }
+    const char *upsert_sql =
+        "INSERT INTO translations (source, target, text, translated, hits) VALUES (?, ?, ?, ?, ?) "
+        "ON CONFLICT(source, target, text) DO UPDATE SET translated = excluded.translated, hits = hits + excluded.hits;";
+    const char *hit_sql =
+        "UPDATE translations SET hits = hits + ? WHERE source = ? AND target = ? AND text = ?;";
+    if (sqlite3_prepare_v2(store, upsert_sql, -1, &upsert_stmt, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(store, hit_sql, -1, &hit_stmt, NULL) != SQLITE_OK) {
+        LOG_ERROR("store.open_failed", NULL, NULL, "Translation store: %s", sqlite3_errmsg(store));
+        store_close();
+        return 1;
+    }
+    const char *select_sql = "SELECT translated FROM translations WHERE source = ? AND target = ? AND text = ?;";
+    if (sqlite3_open_v2(path, &reader, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(reader, select_sql, -1, &select_stmt, NULL) != SQLITE_OK) {
+        LOG_ERROR("store.open_failed", NULL, NULL, "Can't open translation store for reading: %s", sqlite3_errmsg(reader));
+        store_close();
+        return 1;
+    }
+    pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, pending_free);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, store_writer, NULL) != 0) {
+        store_close();
+        return 1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+int cache_store_preload(int limit) {
+    if (!reader) return 0;
+    // the hottest rows come last so they end up at the head of the LRU lists
+    const char *sql = "SELECT text, source, target, translated FROM "
+                      "(SELECT * FROM translations ORDER BY hits DESC LIMIT ?) ORDER BY hits ASC;";
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(reader, sql, -1, &stmt, NULL) != SQLITE_OK) return 0;
+    sqlite3_bind_int(stmt, 1, limit);
+    int loaded = 0;
+    pthread_mutex_lock(&read_mutex);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        cache_put((const char *) sqlite3_column_text(stmt, 0),
+                  (const char *) sqlite3_column_text(stmt, 1),
+                  (const char *) sqlite3_column_text(stmt, 2),
+                  (const char *) sqlite3_column_text(stmt, 3));
+        loaded++;
+    }
+    pthread_mutex_unlock(&read_mutex);
+    sqlite3_finalize(stmt);
+    return loaded;
+}
+
+bool cache_store_is_open(void) {
+    return reader != NULL;
+}
+
+bool cache_store_get(const char *text, const char *source, const char *target, char *out, size_t out_size) {
+    if (!reader) return false;
+    bool found = false;
+    pthread_mutex_lock(&read_mutex);
+    sqlite3_bind_text(select_stmt, 1, source, -1, SQLITE_STATIC);
+    sqlite3_bind_text(select_stmt, 2, target, -1, SQLITE_STATIC);
+    sqlite3_bind_text(select_stmt, 3, text, -1, SQLITE_STATIC);
+    if (sqlite3_step(select_stmt) == SQLITE_ROW) {
+        g_strlcpy(out, (const char *) sqlite3_column_text(select_stmt, 0), out_size);
+        found = true;
+    }
+    sqlite3_reset(select_stmt);
+    sqlite3_clear_bindings(select_stmt);
+    pthread_mutex_unlock(&read_mutex);
+    return found;
+}
+
+static void store_enqueue(const char *text, const char *source, const char *target, const char *translated) {
+    if (!store) return;
+    char *key = cache_key(text, source, target);
+    pthread_mutex_lock(&pending_mutex);
+    PendingWrite *w = g_hash_table_lookup(pending, key);
+    if (w) {
+        w->hits++;
+        if (translated) {
+            g_free(w->translated);
+            w->translated = g_strdup(translated);
+        }
+        g_free(key);
+    } else if (g_hash_table_size(pending) >= MAX_PENDING) {
+        // the store is best effort, a flood must not grow memory without bound
+        dropped++;
+        g_free(key);
+    } else {
+        w = g_new0(PendingWrite, 1);
+        w->text = g_strdup(text);
+        g_strlcpy(w->source, source, sizeof(w->source));
+        g_strlcpy(w->target, target, sizeof(w->target));
+        w->translated = g_strdup(translated);
+        w->hits = 1;
+        g_hash_table_insert(pending, key, w);
+        if (g_hash_table_size(pending) >= FLUSH_BATCH) {
+            pthread_cond_signal(&pending_cond);
+        }
+    }
+    pthread_mutex_unlock(&pending_mutex);
+}
+
+void cache_store_put(const char *text, const char *source, const char *target, const char *translated) {
+    store_enqueue(text, source, target, translated);
+}
+
+void cache_store_hit(const char *text, const char *source, const char *target) {
+    store_enqueue(text, source, target, NULL);
+}
+
+void cache_store_stats(CacheStoreStats *stats) {
+    pthread_mutex_lock(&pending_mutex);
+    stats->pending = pending ? g_hash_table_size(pending) : 0;
+    stats->dropped = dropped;
+    pthread_mutex_unlock(&pending_mutex);
+}
@@ -0,0 +1,37 @@
+#ifndef CACHE_STORE_H
+#define CACHE_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Second level of the translation cache, kept in SQLite so warm translations
+// survive restarts. Writes are queued and flushed in batches by a background
+// thread, so callers never wait on an insert. Lookups use a connection of
+// their own and never wait for a batch.
+
+typedef struct {
+    unsigned long pending; // writes and hits waiting for the next batch
+    unsigned long dropped; // writes and hits lost because the queue was full
+} CacheStoreStats;
+
+// Opens (or creates) the store at path and starts the writer thread.
+int cache_store_open(const char *path);
+
+// Loads up to limit of the most used translations into the memory cache.
+int cache_store_preload(int limit);
+
+bool cache_store_is_open(void);
+
+// Looks a translation up on disk, false when missing or the store is closed.
+bool cache_store_get(const char *text, const char *source, const char *target, char *out, size_t out_size);
+
+// Queues a translation fetched from the backend for the next batch.
+void cache_store_put(const char *text, const char *source, const char *target, const char *translated);
+
+// Queues a hit, used to rank the entries worth preloading. Only bumps the
+// counter of a stored translation, the text is not written again.
+void cache_store_hit(const char *text, const char *source, const char *target);
+
+void cache_store_stats(CacheStoreStats *stats);
+
+#endif
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <uuid/uuid.h>
+#include <sqlite3.h>
+#include <glib-2.0/glib.h>
+#include "db.h"
+#include "logger.h"
+#include "metrics.h"
+
+#define BUSY_TIMEOUT_MS 5000
+
+typedef struct {
+    sqlite3* db;
+    sqlite3_stmt* signup;
+    sqlite3_stmt* login;
+    sqlite3_stmt* set_password;
+} DbConnection;
+
+static DbConnection* pool = NULL;
+static GQueue pool_free = G_QUEUE_INIT;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static DbStats stats = {0};
+static int login_metric = -1;
+static int signup_metric = -1;
+
+static int db_open(DbConnection* c, const char* path) {
+    // every connection is used by one thread at a time, the pool does the locking
+    int rc = sqlite3_open_v2(path, &c->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL);
+    if (rc) {
+        LOG_ERROR("db.open_failed", NULL, NULL, "Can't open DB: %s", sqlite3_errmsg(c->db));
+        return 1;
+    }
+    sqlite3_busy_timeout(c->db, BUSY_TIMEOUT_MS);
+    const char* sql = "PRAGMA journal_mode = WAL;"
+                      "PRAGMA synchronous = NORMAL;"
+                      "PRAGMA cache_size = -8000;"
+                      "PRAGMA temp_store = MEMORY;"
+                      "CREATE TABLE IF NOT EXISTS users ("
+                      "uuid TEXT PRIMARY KEY,"
+                      "username TEXT UNIQUE NOT NULL,"
+                      "password TEXT NOT NULL,"
+                      "language TEXT NOT NULL);";
+    char* err = NULL;
+    rc = sqlite3_exec(c->db, sql, 0, 0, &err);
+    if (rc != SQLITE_OK) {
+        LOG_ERROR("db.open_failed", NULL, NULL, "SQL error: %s", err);
+        sqlite3_free(err);
+        return 1;
+    }
+    const char* signup_sql = "INSERT INTO users (uuid, username, password, language) VALUES (?, ?, ?, ?);";
+    const char* login_sql = "SELECT uuid, password, language FROM users WHERE username = ?;";
+    const char* set_password_sql = "UPDATE users SET password = ? WHERE username = ?;";
+    if (sqlite3_prepare_v3(c->db, signup_sql, -1, SQLITE_PREPARE_PERSISTENT, &c->signup, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v3(c->db, login_sql, -1, SQLITE_PREPARE_PERSISTENT, &c->login, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v3(c->db, set_password_sql, -1, SQLITE_PREPARE_PERSISTENT, &c->set_password, NULL) != SQLITE_OK) {
+        LOG_ERROR("db.open_failed", NULL, NULL, "SQL error: %s", sqlite3_errmsg(c->db));
+        return 1;
+    }
+    return 0;
+}
+
+int db_init(const char* path, int connections) {
+    if (connections < 1) connections = 1;
+    pool = calloc(connections, sizeof(DbConnection));
+    for (int i = 0; i < connections; i++) {
+        if (db_open(&pool[i], path) != 0) {
+            return 1;
+        }
+        g_queue_push_tail(&pool_free, &pool[i]);
+    }
+    stats.size = connections;
+    const char* help = "Time of a user query, waiting for a connection included";
+    login_metric = metrics_histogram("telephone_db_duration_seconds", help, "op=\"login\"");
+    signup_metric = metrics_histogram("telephone_db_duration_seconds", help, "op=\"signup\"");
+    LOG_INFO("db.init", NULL, NULL, "Database initialized successfully (%d connections)", connections);
+    return 0;
+}
+
+static DbConnection* db_borrow(void) {
+    pthread_mutex_lock(&pool_mutex);
+    if (g_queue_is_empty(&pool_free)) {
+        stats.waits++;
+    }
+    while (g_queue_is_empty(&pool_free)) {
+        pthread_cond_wait(&pool_cond, &pool_mutex);
+    }
+    DbConnection* c = g_queue_pop_head(&pool_free);
+    stats.in_use++;
+    stats.queries++;
+    pthread_mutex_unlock(&pool_mutex);
+    return c;
+}
+
+static void db_return(DbConnection* c, sqlite3_stmt* stmt) {
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    pthread_mutex_lock(&pool_mutex);
+    g_queue_push_tail(&pool_free, c);
+    stats.in_use--;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+int db_signup(const char* username, const char* password, const char* language, char* out_uuid) {
+    gint64 started = g_get_monotonic_time();
+    uuid_t id;
+    uuid_generate_random(id);
+    uuid_unparse(id, out_uuid);
+    DbConnection* c = db_borrow();
+    sqlite3_stmt* stmt = c->signup;
+    sqlite3_bind_text(stmt, 1, out_uuid, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, username, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, password, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, language, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    db_return(c, stmt);
+    metrics_observe(signup_metric, g_get_monotonic_time() - started);
+    if (rc == SQLITE_DONE) return 0;
+    if (rc == SQLITE_CONSTRAINT) return 1; // already exists
+    return 2;
+}
+
+int db_find_user(const char* username, char* out_uuid, char* out_password, size_t password_size, char* out_language) {
+    gint64 started = g_get_monotonic_time();
+    DbConnection* c = db_borrow();
+    sqlite3_stmt* stmt = c->login;
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    int res = 2; // not found
+    if (rc == SQLITE_ROW) {
+        const char* db_uuid = (const char*)sqlite3_column_text(stmt, 0);
+        const char* db_pass = (const char*)sqlite3_column_text(stmt, 1);
+        const char* db_lang = (const char*)sqlite3_column_text(stmt, 2);
+        strncpy(out_uuid, db_uuid, 36);
+        out_uuid[36] = '\0';
+        g_strlcpy(out_password, db_pass, password_size);
+        strncpy(out_language, db_lang, 2);
+        out_language[2] = '\0';
+        res = 0;
+    }
+    db_return(c, stmt);
+    metrics_observe(login_metric, g_get_monotonic_time() - started);
+    return res;
+}
+
+int db_set_password(const char* username, const char* password) {
+    DbConnection* c = db_borrow();
+    sqlite3_stmt* stmt = c->set_password;
+    sqlite3_bind_text(stmt, 1, password, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, username, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    db_return(c, stmt);
+    return rc == SQLITE_DONE ? 0 : 1;
+}
+
+void db_stats(DbStats* out) {
+    pthread_mutex_lock(&pool_mutex);
+    *out = stats;
+    pthread_mutex_unlock(&pool_mutex);
+}
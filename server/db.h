@@ -0,0 +1,32 @@
+#ifndef DB_H
+#define DB_H
+
+#include <stddef.h>
+
+// User storage. A small pool of SQLite connections in WAL mode, each with its
+// statements compiled once at startup, so concurrent logins and signups only
+// serialize on the write lock SQLite itself needs.
+
+typedef struct {
+    int size;
+    int in_use;
+    unsigned long queries;
+    unsigned long waits;
+} DbStats;
+
+// Opens connections connections to path and creates the schema.
+int db_init(const char* path, int connections);
+
+// 0 on success, 1 if the username is taken, 2 on a database error.
+int db_signup(const char* username, const char* password, const char* language, char* out_uuid);
+
+// Reads the stored password (a hash, or plaintext for rows older than auth.c).
+// 0 on success, 2 if the user does not exist.
+int db_find_user(const char* username, char* out_uuid, char* out_password, size_t password_size, char* out_language);
+
+// 0 on success.
+int db_set_password(const char* username, const char* password);
+
+void db_stats(DbStats* stats);
+
+#endif
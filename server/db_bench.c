@@ -0,0 +1,68 @@
+// Login/signup throughput benchmark for db.c
+// Usage: ./db_bench.out [threads] [users] [connections]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <glib-2.0/glib.h>
+#include "db.h"
+
+#define BENCH_DB "db_bench.db"
+
+typedef struct {
+    int first;
+    int count;
+    bool login;
+    int failures;
+} BenchSlice;
+
+static void *bench_worker(void *arg) {
+    BenchSlice *slice = (BenchSlice *) arg;
+    char username[32], uuid[37], lang[3], password[128];
+    for (int i = slice->first; i < slice->first + slice->count; i++) {
+        snprintf(username, sizeof(username), "bench%d", i);
+        int res = slice->login ? db_find_user(username, uuid, password, sizeof(password), lang)
+                               : db_signup(username, "password", "en", uuid);
+        if (res != 0) slice->failures++;
+    }
+    return NULL;
+}
+
+static void bench_phase(const char *name, int threads, int users, bool login) {
+    pthread_t tids[threads];
+    BenchSlice slices[threads];
+    gint64 start = g_get_monotonic_time();
+    for (int i = 0; i < threads; i++) {
+        slices[i].first = i * (users / threads);
+        slices[i].count = i == threads - 1 ? users - slices[i].first : users / threads;
+        slices[i].login = login;
+        slices[i].failures = 0;
+        pthread_create(&tids[i], NULL, bench_worker, &slices[i]);
+    }
+    int failures = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        failures += slices[i].failures;
+    }
+    double seconds = (g_get_monotonic_time() - start) / 1e6;
+    printf("%-7s %d ops in %.2fs: %.0f ops/s, %d failures\n", name, users, seconds, users / seconds, failures);
+}
+
+int main(int argc, char *argv[]) {
+    int threads = argc > 1 ? atoi(argv[1]) : 8;
+    int users = argc > 2 ? atoi(argv[2]) : 20000;
+    int connections = argc > 3 ? atoi(argv[3]) : 4;
+    if (threads < 1) threads = 1;
+    unlink(BENCH_DB);
+    unlink(BENCH_DB "-wal");
+    unlink(BENCH_DB "-shm");
+    if (db_init(BENCH_DB, connections) != 0) return 1;
+    printf("%d threads, %d connections\n", threads, connections);
+    bench_phase("signup", threads, users, false);
+    bench_phase("login", threads, users, true);
+    DbStats stats;
+    db_stats(&stats);
+    printf("%lu queries, %lu waited for a connection\n", stats.queries, stats.waits);
+    return 0;
+}
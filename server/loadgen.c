@@ -0,0 +1,425 @@
+// Load generator: groups of players arrive at the server, sign up, log in,
+// gather in a lobby and play complete matches, while every operation's latency
+// is recorded. Run it against a server started with a high MAX_LOBBIES and, for
+// repeatable numbers, TRANSLATOR_URL pointing at mock_translate.out. Players
+// use the framed protocol, or the binary one with -b.
+// Usage: ./loadgen.out [-h host] [-p port] [-n players] [-g group] [-r players/s]
+//                      [-t think ms] [-m matches] [-l en,it,...] [-w timeout ms] [-b]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <glib-2.0/glib.h>
+#include "wire.h"
+
+#define MAX_GROUP 10 // MAX_PLAYERS of the server
+#define MAX_FRAME 4096
+#define AUTH_RETRIES 50 // the server answers Z00 while its auth queue is full
+
+typedef enum {
+    OP_SIGNUP,
+    OP_LOGIN,
+    OP_CREATE,
+    OP_JOIN,
+    OP_START,
+    OP_TURN,
+    OP_END,
+    OP_COUNT
+} LoadOp;
+
+static const char* op_names[] = {
+    "signup", // 201 until B01
+    "login",  // 202 until B02
+    "create", // 100 until A00
+    "join",   // 101 until A01
+    "start",  // 110 until the host's A11
+    "turn",   // 111 until the next speaker's A11, translation included
+    "end",    // last 111 until every player has A12, final translations included
+};
+
+typedef struct {
+    GArray* samples; // of gint64 microseconds
+    unsigned long errors;
+} OpStats;
+
+typedef struct {
+    int fd;
+    char name[32];
+    char buffer[MAX_FRAME * 2];
+    int len;
+} Client;
+
+static struct {
+    const char* host;
+    int port;
+    int players;
+    int group;
+    double rate;
+    int think_ms;
+    int matches;
+    char **languages;
+    int timeout_ms;
+    bool binary;
+} config = {"127.0.0.1", 8080, 1000, 4, 50.0, 200, 1, NULL, 10000, false};
+
+static OpStats stats[OP_COUNT];
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long matches_played = 0;
+static unsigned long auth_retries = 0;
+static unsigned long bytes_received = 0;
+static int run_tag;
+
+static void record(LoadOp op, gint64 started, bool ok) {
+    gint64 elapsed = g_get_monotonic_time() - started;
+    pthread_mutex_lock(&stats_mutex);
+    if (ok) {
+        g_array_append_val(stats[op].samples, elapsed);
+    } else {
+        stats[op].errors++;
+    }
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+/* ** PROTOCOL ** */
+
+static bool client_connect(Client* c) {
+    c->fd = -1;
+    c->len = 0;
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host, &addr.sin_addr) != 1) return false;
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0) return false;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval timeout = {config.timeout_ms / 1000, (config.timeout_ms % 1000) * 1000};
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(c->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    // switch to framed or binary messages; the answer still comes unframed
+    const char* hello = config.binary ? "300 3" : "300 2";
+    char reply[64];
+    if (send(c->fd, hello, strlen(hello), MSG_NOSIGNAL) < 0) return false;
+    ssize_t n = recv(c->fd, reply, sizeof(reply) - 1, 0);
+    return n >= 3 && strncmp(reply, "B00", 3) == 0;
+}
+
+static void client_close(Client* c) {
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+}
+
+static bool client_send(Client* c, const char* fmt, ...) {
+    char payload[MAX_FRAME], frame[MAX_FRAME + 16];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(payload, sizeof(payload), fmt, args);
+    va_end(args);
+    int total = snprintf(frame, sizeof(frame), "%d\n%s", len, payload);
+    return send(c->fd, frame, total, MSG_NOSIGNAL) == total;
+}
+
+// Takes over a request built with wire_begin
+static bool client_send_binary(Client* c, GString* request) {
+    GBytes* frame = wire_end(request, 0);
+    gsize len;
+    const void* data = g_bytes_get_data(frame, &len);
+    bool ok = send(c->fd, data, len, MSG_NOSIGNAL) == (ssize_t) len;
+    g_bytes_unref(frame);
+    return ok;
+}
+
+// The next whole frame in the buffer: its code as text ("A01", 8 bytes) and payload
+static bool client_frame(Client* c, char* code, char** payload, int* len, int* size) {
+    if (config.binary) {
+        if (c->len < WIRE_HEADER) return false;
+        guint16 binary_code;
+        guint32 binary_len;
+        wire_header_read(c->buffer, &binary_code, &binary_len);
+        *len = binary_len;
+        *size = WIRE_HEADER + binary_len;
+        if (*size > (int) sizeof(c->buffer)) *size = -1;
+        snprintf(code, 8, "%c%02d", binary_code >> 8, binary_code & 0xff);
+        *payload = c->buffer + WIRE_HEADER;
+        return *size < 0 || c->len >= *size;
+    }
+    char* newline = memchr(c->buffer, '\n', c->len);
+    if (!newline) return false;
+    int header = newline - c->buffer + 1;
+    *len = atoi(c->buffer);
+    *size = *len < 0 || header + *len > (int) sizeof(c->buffer) ? -1 : header + *len;
+    *payload = c->buffer + header;
+    g_strlcpy(code, *len >= 3 ? *payload : "", 4);
+    return *size < 0 || c->len >= *size;
+}
+
+// Reads frames until one starts with any of the codes (e.g. "A01A04"), skipping
+// broadcasts meant for other moments. Returns the index of the code, -1 for a
+// Z error, -2 on timeout or a closed socket. out gets the payload when given,
+// with the code in front on the framed protocol.
+static int client_expect(Client* c, const char* codes, char* out, size_t out_size) {
+    while (1) {
+        char code[8];
+        char* payload;
+        int len, size;
+        if (client_frame(c, code, &payload, &len, &size)) {
+            if (size < 0) return -2;
+            int found = -3;
+            if (code[0] == 'Z') {
+                found = -1;
+            } else {
+                for (int i = 0; codes[i * 3] && found == -3; i++) {
+                    if (strncmp(code, codes + i * 3, 3) == 0) found = i;
+                }
+            }
+            if (found != -3 && out) {
+                // the error code on the binary protocol, where the payload is the text
+                const char* from = config.binary && found == -1 ? code : payload;
+                int copy = MIN(config.binary && found == -1 ? 3 : len, (int) out_size - 1);
+                memcpy(out, from, copy);
+                out[copy] = '\0';
+            }
+            memmove(c->buffer, c->buffer + size, c->len - size);
+            c->len -= size;
+            if (found != -3) return found;
+            continue;
+        }
+        ssize_t n = recv(c->fd, c->buffer + c->len, sizeof(c->buffer) - c->len, 0);
+        if (n <= 0) return -2;
+        c->len += n;
+        __atomic_add_fetch(&bytes_received, n, __ATOMIC_RELAXED);
+    }
+}
+
+/* ** PLAYERS ** */
+
+static bool auth(Client* c, LoadOp op, const char* language) {
+    gint64 started = g_get_monotonic_time();
+    for (int attempt = 0; attempt < AUTH_RETRIES; attempt++) {
+        char reply[64];
+        bool sent;
+        if (config.binary) {
+            GString* request = wire_begin(op == OP_SIGNUP ? 201 : 202, 32);
+            if (op == OP_SIGNUP) g_string_append_len(request, language, 2);
+            wire_put_str8(request, c->name);
+            wire_put_str8(request, "pw");
+            sent = client_send_binary(c, request);
+        } else {
+            sent = op == OP_SIGNUP ? client_send(c, "201 %s %s pw", language, c->name)
+                                   : client_send(c, "202 %s pw", c->name);
+        }
+        if (!sent) break;
+        int res = client_expect(c, op == OP_SIGNUP ? "B01" : "B02", reply, sizeof(reply));
+        if (res == 0) {
+            record(op, started, true);
+            return true;
+        }
+        if (res != -1 || strncmp(reply, "Z00", 3) != 0) break;
+        __atomic_add_fetch(&auth_retries, 1, __ATOMIC_RELAXED);
+        usleep(20000 * (attempt + 1));
+    }
+    record(op, started, false);
+    return false;
+}
+
+static void think(void) {
+    if (config.think_ms <= 0) return;
+    // uniform between half and one and a half of the mean
+    usleep((config.think_ms / 2 + g_random_int_range(0, config.think_ms + 1)) * 1000);
+}
+
+static bool play_match(Client* players, int count) {
+    gint64 started = g_get_monotonic_time();
+    GString* start = config.binary ? wire_begin(110, 1) : NULL;
+    if (start) wire_put_u8(start, 1);
+    bool sent = start ? client_send_binary(&players[0], start) : client_send(&players[0], "110 1");
+    if (!sent || client_expect(&players[0], "A11", NULL, 0) != 0) {
+        record(OP_START, started, false);
+        return false;
+    }
+    record(OP_START, started, true);
+    // clockwise, the turn goes around in joining order
+    for (int turn = 0; turn < count; turn++) {
+        think();
+        char word[16];
+        snprintf(word, sizeof(word), "w%d", turn);
+        started = g_get_monotonic_time();
+        if (config.binary) {
+            GString* speak = wire_begin(111, 16);
+            wire_put_str8(speak, word);
+            sent = client_send_binary(&players[turn], speak);
+        } else {
+            sent = client_send(&players[turn], "111 %02d %s", (int) strlen(word), word);
+        }
+        if (!sent) return false;
+        if (turn < count - 1) {
+            bool ok = client_expect(&players[turn + 1], "A11", NULL, 0) == 0;
+            record(OP_TURN, started, ok);
+            if (!ok) return false;
+        } else {
+            bool ok = true;
+            for (int i = 0; i < count && ok; i++) {
+                ok = client_expect(&players[i], "A12", NULL, 0) == 0;
+            }
+            record(OP_END, started, ok);
+            if (!ok) return false;
+        }
+    }
+    __atomic_add_fetch(&matches_played, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static void* group_run(void* arg) {
+    int first = GPOINTER_TO_INT(arg);
+    int count = MIN(config.group, config.players - first);
+    Client players[MAX_GROUP];
+    int languages = g_strv_length(config.languages);
+    int ready = 0;
+    for (; ready < count; ready++) {
+        Client* c = &players[ready];
+        snprintf(c->name, sizeof(c->name), "lg%d%d", run_tag, first + ready);
+        const char* language = config.languages[(first + ready) % languages];
+        if (!client_connect(c) || !auth(c, OP_SIGNUP, language) || !auth(c, OP_LOGIN, language)) {
+            ready++;
+            goto done;
+        }
+    }
+    char reply[128];
+    gint64 started = g_get_monotonic_time();
+    bool sent = config.binary ? client_send_binary(&players[0], wire_begin(100, 0)) : client_send(&players[0], "100");
+    if (!sent || client_expect(&players[0], "A00", reply, sizeof(reply)) != 0) {
+        record(OP_CREATE, started, false);
+        goto done;
+    }
+    record(OP_CREATE, started, true);
+    char lobby[40];
+    if (config.binary) {
+        WireReader id;
+        wire_reader_init(&id, reply, 16);
+        wire_get_uuid(&id, lobby);
+    } else {
+        g_strlcpy(lobby, g_strstrip(reply + 4), sizeof(lobby));
+    }
+    for (int i = 1; i < count; i++) {
+        started = g_get_monotonic_time();
+        if (config.binary) {
+            GString* join = wire_begin(101, 16);
+            wire_put_uuid(join, lobby);
+            sent = client_send_binary(&players[i], join);
+        } else {
+            sent = client_send(&players[i], "101 %s", lobby);
+        }
+        // A04/A07 mean queued, which a fresh lobby should never do
+        bool ok = sent && client_expect(&players[i], "A01A04A07", NULL, 0) == 0;
+        record(OP_JOIN, started, ok);
+        if (!ok) goto done;
+    }
+    // a last group too small to start only joins
+    if (count >= 4) {
+        for (int m = 0; m < config.matches && play_match(players, count); m++);
+    }
+done:
+    for (int i = 0; i < ready; i++) {
+        client_close(&players[i]);
+    }
+    return NULL;
+}
+
+/* ** REPORT ** */
+
+static gint compare_samples(gconstpointer a, gconstpointer b) {
+    gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(GArray* sorted, double p) {
+    if (sorted->len == 0) return 0;
+    guint i = (guint) ceil(p * sorted->len) - 1;
+    if (i >= sorted->len) i = sorted->len - 1;
+    return g_array_index(sorted, gint64, i) / 1000.0;
+}
+
+static void report(double seconds) {
+    printf("%d players, %lu matches in %.2fs (%.1f matches/s), %lu auth retries, %lu bytes received\n",
+           config.players, matches_played, seconds, matches_played / seconds, auth_retries, bytes_received);
+    printf("%-7s %8s %7s %9s %9s %9s %9s %9s\n", "op", "count", "errors", "ops/s", "p50 ms", "p99 ms", "p999 ms", "max ms");
+    for (int op = 0; op < OP_COUNT; op++) {
+        GArray* samples = stats[op].samples;
+        g_array_sort(samples, compare_samples);
+        printf("%-7s %8u %7lu %9.1f %9.2f %9.2f %9.2f %9.2f\n", op_names[op], samples->len, stats[op].errors,
+               samples->len / seconds, percentile_ms(samples, 0.50), percentile_ms(samples, 0.99),
+               percentile_ms(samples, 0.999), percentile_ms(samples, 1.0));
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const char* languages = "en,it,fr,de,es";
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:n:g:r:t:m:l:w:b")) != -1) {
+        switch (opt) {
+            case 'h': config.host = optarg; break;
+            case 'p': config.port = atoi(optarg); break;
+            case 'n': config.players = atoi(optarg); break;
+            case 'g': config.group = atoi(optarg); break;
+            case 'r': config.rate = atof(optarg); break;
+            case 't': config.think_ms = atoi(optarg); break;
+            case 'm': config.matches = atoi(optarg); break;
+            case 'l': languages = optarg; break;
+            case 'w': config.timeout_ms = atoi(optarg); break;
+            case 'b': config.binary = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-h host] [-p port] [-n players] [-g group] [-r players/s] "
+                                "[-t think ms] [-m matches] [-l en,it,...] [-w timeout ms] [-b]\n", argv[0]);
+                return 1;
+        }
+    }
+    config.group = CLAMP(config.group, 4, MAX_GROUP);
+    if (config.players < 1 || config.rate <= 0) {
+        fprintf(stderr, "players and rate must be positive\n");
+        return 1;
+    }
+    config.languages = g_strsplit(languages, ",", -1);
+    if (!config.languages[0]) {
+        fprintf(stderr, "no languages given\n");
+        return 1;
+    }
+    for (int op = 0; op < OP_COUNT; op++) {
+        stats[op].samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+    }
+    run_tag = g_random_int_range(0, 100000);
+
+    int groups = (config.players + config.group - 1) / config.group;
+    pthread_t* tids = g_new(pthread_t, groups);
+    gint64 started = g_get_monotonic_time();
+    for (int i = 0; i < groups; i++) {
+        // Poisson arrivals of groups, players arrive config.rate per second on average
+        double gap = -log(1.0 - g_random_double()) * config.group / config.rate;
+        usleep((useconds_t) (gap * 1e6));
+        if (pthread_create(&tids[i], NULL, group_run, GINT_TO_POINTER(i * config.group)) != 0) {
+            fprintf(stderr, "failed to start group %d\n", i);
+            groups = i;
+            break;
+        }
+    }
+    for (int i = 0; i < groups; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    report((g_get_monotonic_time() - started) / 1e6);
+    g_free(tids);
+    g_strfreev(config.languages);
+    return 0;
+}
@@ -0,0 +1,33 @@
+#include <string.h>
+#include "lobby_id.h"
+
+void lobby_id_generate(LobbyId* id) {
+    uuid_generate_random(id->bytes);
+}
+
+bool lobby_id_parse(const char* text, LobbyId* id) {
+    if (uuid_parse(text, id->bytes) == 0) return true;
+    uuid_clear(id->bytes);
+    return false;
+}
+
+LobbyIdText lobby_id_text(const LobbyId* id) {
+    LobbyIdText text;
+    uuid_unparse(id->bytes, text.str);
+    return text;
+}
+
+bool lobby_id_is_null(const LobbyId* id) {
+    return uuid_is_null(id->bytes);
+}
+
+guint lobby_id_hash(gconstpointer id) {
+    // random bytes, any four of them hash well
+    guint hash;
+    memcpy(&hash, ((const LobbyId*) id)->bytes, sizeof(hash));
+    return hash;
+}
+
+gboolean lobby_id_equal(gconstpointer a, gconstpointer b) {
+    return memcmp(((const LobbyId*) a)->bytes, ((const LobbyId*) b)->bytes, sizeof(uuid_t)) == 0;
+}
@@ -0,0 +1,36 @@
+#ifndef LOBBY_ID_H
+#define LOBBY_ID_H
+
+#include <stdbool.h>
+#include <uuid/uuid.h>
+#include <glib-2.0/glib.h>
+
+// Lobby ids are random UUIDs, kept and compared as their 16 raw bytes. The
+// binary protocol sends those bytes as they are; the textual form is made only
+// where text goes out, the text protocols, logs and traces, and parsed only
+// where it comes in. The zero id names no lobby.
+
+typedef struct {
+    uuid_t bytes;
+} LobbyId;
+
+// The textual form, 36 characters; lobby_id_text(&id).str lives until the end
+// of the expression that made it, long enough for a printf argument
+typedef struct {
+    char str[37];
+} LobbyIdText;
+
+void lobby_id_generate(LobbyId* id);
+
+// The zero id when text is not a UUID
+bool lobby_id_parse(const char* text, LobbyId* id);
+
+LobbyIdText lobby_id_text(const LobbyId* id);
+
+bool lobby_id_is_null(const LobbyId* id);
+
+// For hash tables keyed by LobbyId*
+guint lobby_id_hash(gconstpointer id);
+gboolean lobby_id_equal(gconstpointer a, gconstpointer b);
+
+#endif
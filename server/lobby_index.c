@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <glib-2.0/glib.h>
+#include "lobby_index.h"
+#include "wire.h"
+
+#define FILTER_FREE 1
+#define FILTER_NOT_RUNNING 2
+#define MASKS 4
+#define QUEUE_LEVELS 3
+#define SEQUENCES (MASKS * QUEUE_LEVELS * 2) // every mask and level for any language and for the host's
+#define SCAN_MAX 256 // rows a page skips over before it returns early with a cursor
+
+// The longest queue a lobby of each level has, -1 for any
+static const int queue_bounds[QUEUE_LEVELS] = {-1, 0, 2};
+
+typedef struct {
+    LobbySummary summary;
+    guint64 serial; // creation order, the cursor
+    GSequenceIter* iters[SEQUENCES];
+} IndexEntry;
+
+static GHashTable* entries = NULL;   // LobbyId -> IndexEntry
+static GHashTable* sequences = NULL; // "<language>|<mask>|<level>" -> GSequence of IndexEntry
+static guint64 next_serial = 1;
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static gint entry_cmp(gconstpointer a, gconstpointer b, gpointer unused) {
+    guint64 x = ((const IndexEntry*) a)->serial, y = ((const IndexEntry*) b)->serial;
+    return (x > y) - (x < y);
+}
+
+static void entry_free(gpointer data) {
+    IndexEntry* entry = (IndexEntry*) data;
+    for (int i = 0; i < SEQUENCES; i++) {
+        if (entry->iters[i]) g_sequence_remove(entry->iters[i]);
+    }
+    g_free(entry);
+}
+
+void lobby_index_init(void) {
+    entries = g_hash_table_new_full(lobby_id_hash, lobby_id_equal, NULL, entry_free);
+    sequences = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_sequence_free);
+}
+
+static int summary_mask(const LobbySummary* s) {
+    int mask = 0;
+    if (s->players < s->max_players) mask |= FILTER_FREE;
+    if (!s->running) mask |= FILTER_NOT_RUNNING;
+    return mask;
+}
+
+static bool queue_level_member(const LobbySummary* s, int level) {
+    return queue_bounds[level] < 0 || s->queued <= queue_bounds[level];
+}
+
+// The level with the tightest bound that still admits every lobby queueing at most max_queued
+static int queue_level_for(int max_queued) {
+    int level = 0;
+    for (int i = 1; i < QUEUE_LEVELS; i++) {
+        if (max_queued >= 0 && queue_bounds[i] >= max_queued && (level == 0 || queue_bounds[i] < queue_bounds[level])) level = i;
+    }
+    return level;
+}
+
+static GSequence* sequence_for(const char* language, int mask, int level, bool create) {
+    char key[16];
+    snprintf(key, sizeof(key), "%s|%d|%d", language, mask, level);
+    GSequence* seq = g_hash_table_lookup(sequences, key);
+    if (!seq && create) {
+        seq = g_sequence_new(NULL);
+        g_hash_table_insert(sequences, g_strdup(key), seq);
+    }
+    return seq;
+}
+
+// Slot i of an entry: masks 0..3 of every queue level for any language, then
+// the same for its language. A lobby belongs to the sequence of every mask
+// whose bits it satisfies, at every level its queue fits in.
+static void entry_link(IndexEntry* entry) {
+    int mask = summary_mask(&entry->summary);
+    for (int i = 0; i < SEQUENCES; i++) {
+        int want = i % MASKS;
+        int level = i / MASKS % QUEUE_LEVELS;
+        bool member = (want & mask) == want && queue_level_member(&entry->summary, level);
+        if (member && !entry->iters[i]) {
+            bool any_language = i < MASKS * QUEUE_LEVELS;
+            GSequence* seq = sequence_for(any_language ? "" : entry->summary.language, want, level, true);
+            entry->iters[i] = g_sequence_insert_sorted(seq, entry, entry_cmp, NULL);
+        } else if (!member && entry->iters[i]) {
+            g_sequence_remove(entry->iters[i]);
+            entry->iters[i] = NULL;
+        }
+    }
+}
+
+void lobby_index_put(const LobbySummary* summary) {
+    pthread_rwlock_wrlock(&index_lock);
+    IndexEntry* entry = g_hash_table_lookup(entries, &(summary->id));
+    if (!entry) {
+        entry = g_new0(IndexEntry, 1);
+        entry->serial = next_serial++;
+        entry->summary = *summary;
+        g_hash_table_insert(entries, &(entry->summary.id), entry);
+    } else {
+        entry->summary = *summary;
+    }
+    entry_link(entry);
+    pthread_rwlock_unlock(&index_lock);
+}
+
+void lobby_index_remove(const LobbyId* id) {
+    pthread_rwlock_wrlock(&index_lock);
+    g_hash_table_remove(entries, id);
+    pthread_rwlock_unlock(&index_lock);
+}
+
+guint64 lobby_index_query(const LobbyFilter* filter, guint64 cursor, int limit, bool binary, GString* out) {
+    int mask = (filter->free_slots ? FILTER_FREE : 0) | (filter->not_running ? FILTER_NOT_RUNNING : 0);
+    int level = queue_level_for(filter->max_queued);
+    guint64 next = 0;
+    pthread_rwlock_rdlock(&index_lock);
+    GSequence* seq = sequence_for(filter->language, mask, level, false);
+    if (seq) {
+        IndexEntry probe = {.serial = cursor};
+        GSequenceIter* it = g_sequence_search(seq, &probe, entry_cmp, NULL);
+        int found = 0, skipped = 0;
+        guint64 last = cursor;
+        for (; !g_sequence_iter_is_end(it); it = g_sequence_iter_next(it)) {
+            IndexEntry* entry = g_sequence_get(it);
+            if (found == limit || skipped == SCAN_MAX) {
+                next = last;
+                break;
+            }
+            last = entry->serial;
+            // only a bound between two levels leaves rows to skip
+            if (filter->max_queued >= 0 && entry->summary.queued > filter->max_queued) {
+                skipped++;
+                continue;
+            }
+            if (binary) {
+                wire_put_bytes(out, entry->summary.id.bytes, sizeof(entry->summary.id.bytes));
+                wire_put_u8(out, entry->summary.max_players);
+                wire_put_u8(out, entry->summary.players);
+                wire_put_str8(out, entry->summary.host);
+            } else {
+                g_string_append_printf(out, "%s %s %d %d\n", lobby_id_text(&(entry->summary.id)).str, entry->summary.host,
+                                       entry->summary.max_players, entry->summary.players);
+            }
+            found++;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return next;
+}
@@ -0,0 +1,47 @@
+#ifndef LOBBY_INDEX_H
+#define LOBBY_INDEX_H
+
+#include <stdbool.h>
+#include <glib-2.0/glib.h>
+#include "lobby_id.h"
+
+// Listing indexes for OP_FIND_LOBBIES. Every lobby is kept in one creation
+// ordered sequence per combination of the indexed filters (host language,
+// free slots, match not running, queue level), so a page is found with one
+// O(log n) search and costs what it returns. The queue levels are no queue,
+// at most 2 waiting and any; a queue bound between two levels walks the next
+// level up and skips the longer queues, at most 256 of them per page.
+
+typedef struct {
+    LobbyId id;
+    char host[32];
+    char language[3]; // of the host
+    int max_players;
+    int players;
+    int queued;
+    bool running;
+} LobbySummary;
+
+typedef struct {
+    bool free_slots;
+    bool not_running;
+    char language[3]; // empty for any
+    int max_queued;   // -1 for any
+} LobbyFilter;
+
+void lobby_index_init(void);
+
+// Adds the lobby or refreshes its entry.
+void lobby_index_put(const LobbySummary* summary);
+
+void lobby_index_remove(const LobbyId* id);
+
+// Appends up to limit matching lobbies listed after cursor to out, one
+// "<id> <host> <max players> <players>" line each, or with binary set one
+// entry each: the raw id, u8 max players, u8 players and the host as a str8
+// (see wire.h). Returns the cursor of the next page, 0 when this was the last one.
+// A page cut short by skipped lobbies can hold fewer than limit, or none, and
+// still have a next one.
+guint64 lobby_index_query(const LobbyFilter* filter, guint64 cursor, int limit, bool binary, GString* out);
+
+#endif
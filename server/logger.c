@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <glib-2.0/glib.h>
+#include "logger.h"
+
+#define LOG_RING 32       // default records per thread, about 9 KB
+#define LOG_MESSAGE 176   // bytes of the message, longer ones are cut
+#define LOG_IDLE_US 10000 // writer nap when every ring is empty
+
+typedef struct {
+    gint64 time; // wall clock, microseconds
+    LogLevel level;
+    int sampled;
+    const char* event;
+    char lobby[37];
+    char player[32];
+    char message[LOG_MESSAGE];
+} LogRecord;
+
+// Single producer (the owning thread), single consumer (the writer)
+typedef struct LogRing {
+    LogRecord* records; // ring_size of them
+    unsigned head; // next record the writer reads
+    unsigned tail; // next record the owner fills
+    unsigned long dropped;  // records lost to a full ring
+    unsigned long reported; // of those, already counted by the writer
+    bool orphaned; // the owner exited, the writer frees the ring once drained
+    struct LogRing* next;
+} LogRing;
+
+int log_threshold = LOG_LEVEL_INFO;
+int log_sample_rate = 10;
+
+static bool json = false;
+static bool running = false;
+static unsigned ring_size = LOG_RING; // a power of two, so indexes survive the counters wrapping
+static __thread LogRing* own_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LogRing* rings = NULL;
+static pthread_mutex_t direct_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* level_names[] = {"debug", "info", "warn", "error"};
+
+static void ring_orphan(void* data) {
+    own_ring = NULL; // a later record on this thread gets a fresh ring
+    __atomic_store_n(&(((LogRing*) data)->orphaned), true, __ATOMIC_RELEASE);
+}
+
+static LogRing* ring_get(void) {
+    if (!own_ring) {
+        own_ring = g_new0(LogRing, 1);
+        own_ring->records = g_new(LogRecord, ring_size);
+        pthread_setspecific(ring_key, own_ring);
+        pthread_mutex_lock(&rings_mutex);
+        own_ring->next = rings;
+        rings = own_ring;
+        pthread_mutex_unlock(&rings_mutex);
+    }
+    return own_ring;
+}
+
+static void append_escaped(GString* line, const char* text) {
+    for (const char* c = text; *c; c++) {
+        switch (*c) {
+            case '"': g_string_append(line, "\\\""); break;
+            case '\\': g_string_append(line, "\\\\"); break;
+            case '\n': g_string_append(line, "\\n"); break;
+            case '\r': g_string_append(line, "\\r"); break;
+            case '\t': g_string_append(line, "\\t"); break;
+            default:
+                if ((unsigned char) *c < 0x20) g_string_append_printf(line, "\\u%04x", *c);
+                else g_string_append_c(line, *c);
+        }
+    }
+}
+
+static void append_field(GString* line, const char* key, const char* value, bool quoted) {
+    if (json) {
+        g_string_append_printf(line, ",\"%s\":", key);
+        if (quoted) g_string_append_c(line, '"');
+        append_escaped(line, value);
+        if (quoted) g_string_append_c(line, '"');
+    } else {
+        g_string_append_printf(line, " %s=", key);
+        if (quoted) g_string_append_c(line, '"');
+        append_escaped(line, value);
+        if (quoted) g_string_append_c(line, '"');
+    }
+}
+
+static void record_format(const LogRecord* record, GString* line) {
+    time_t seconds = record->time / G_USEC_PER_SEC;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    char ts[32];
+    size_t len = strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(ts + len, sizeof(ts) - len, ".%03dZ", (int) (record->time % G_USEC_PER_SEC / 1000));
+    if (json) {
+        g_string_append_printf(line, "{\"ts\":\"%s\"", ts);
+    } else {
+        g_string_append_printf(line, "ts=%s", ts);
+    }
+    append_field(line, "level", level_names[record->level], json);
+    append_field(line, "event", record->event, json);
+    if (record->lobby[0]) append_field(line, "lobby", record->lobby, json);
+    if (record->player[0]) append_field(line, "player", record->player, true);
+    if (record->sampled > 1) {
+        char rate[16];
+        snprintf(rate, sizeof(rate), "%d", record->sampled);
+        append_field(line, "sampled", rate, false);
+    }
+    append_field(line, "msg", record->message, true);
+    g_string_append(line, json ? "}\n" : "\n");
+}
+
+static void record_fill(LogRecord* record, LogLevel level, int sampled, const char* event,
+                        const char* lobby, const char* player, const char* fmt, va_list args) {
+    record->time = g_get_real_time();
+    record->level = level;
+    record->sampled = sampled;
+    record->event = event;
+    g_strlcpy(record->lobby, lobby ? lobby : "", sizeof(record->lobby));
+    g_strlcpy(record->player, player ? player : "", sizeof(record->player));
+    vsnprintf(record->message, sizeof(record->message), fmt, args);
+}
+
+void log_write(LogLevel level, int sampled, const char* event, const char* lobby, const char* player,
+               const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        // before the writer starts, and in tools linking a module without it
+        LogRecord record;
+        record_fill(&record, level, sampled, event, lobby, player, fmt, args);
+        GString* line = g_string_new(NULL);
+        record_format(&record, line);
+        pthread_mutex_lock(&direct_mutex);
+        fwrite(line->str, 1, line->len, stdout);
+        fflush(stdout);
+        pthread_mutex_unlock(&direct_mutex);
+        g_string_free(line, TRUE);
+        va_end(args);
+        return;
+    }
+    LogRing* ring = ring_get();
+    unsigned tail = ring->tail;
+    if (tail - __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE) == ring_size) {
+        __atomic_add_fetch(&(ring->dropped), 1, __ATOMIC_RELAXED);
+    } else {
+        record_fill(&(ring->records[tail % ring_size]), level, sampled, event, lobby, player, fmt, args);
+        __atomic_store_n(&(ring->tail), tail + 1, __ATOMIC_RELEASE);
+    }
+    va_end(args);
+}
+
+static void* logger_writer(void* arg) {
+    GString* batch = g_string_sized_new(64 * 1024);
+    while (1) {
+        unsigned long dropped = 0;
+        pthread_mutex_lock(&rings_mutex);
+        LogRing** link = &rings;
+        while (*link) {
+            LogRing* ring = *link;
+            bool orphaned = __atomic_load_n(&(ring->orphaned), __ATOMIC_ACQUIRE);
+            unsigned head = ring->head;
+            unsigned tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+            for (; head != tail; head++) {
+                record_format(&(ring->records[head % ring_size]), batch);
+            }
+            __atomic_store_n(&(ring->head), head, __ATOMIC_RELEASE);
+            unsigned long ring_dropped = __atomic_load_n(&(ring->dropped), __ATOMIC_RELAXED);
+            dropped += ring_dropped - ring->reported;
+            ring->reported = ring_dropped;
+            if (orphaned) {
+                // the owner is gone, so tail cannot move any more
+                *link = ring->next;
+                g_free(ring->records);
+                g_free(ring);
+            } else {
+                link = &(ring->next);
+            }
+        }
+        pthread_mutex_unlock(&rings_mutex);
+        if (dropped > 0) {
+            LogRecord record = {g_get_real_time(), LOG_LEVEL_WARN, 1, "log.dropped", "", "", ""};
+            snprintf(record.message, sizeof(record.message), "%lu records dropped on full rings", dropped);
+            record_format(&record, batch);
+        }
+        if (batch->len > 0) {
+            fwrite(batch->str, 1, batch->len, stdout);
+            fflush(stdout);
+            g_string_truncate(batch, 0);
+        } else {
+            usleep(LOG_IDLE_US);
+        }
+    }
+    return NULL;
+}
+
+int logger_start(const char* level, const char* format, int sample_rate, int ring_records) {
+    for (int i = 0; level && i < (int) G_N_ELEMENTS(level_names); i++) {
+        if (strcmp(level, level_names[i]) == 0) log_threshold = i;
+    }
+    json = format && strcmp(format, "json") == 0;
+    if (sample_rate > 0) log_sample_rate = sample_rate;
+    if (ring_records > 0) {
+        ring_size = 1;
+        while (ring_size < (unsigned) MIN(ring_records, 65536)) ring_size *= 2;
+    }
+    if (pthread_key_create(&ring_key, ring_orphan) != 0) {
+        fprintf(stderr, "failed to create the log ring key\n");
+        return 1;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, logger_writer, NULL) != 0) {
+        fprintf(stderr, "failed to start the log writer\n");
+        return 1;
+    }
+    pthread_detach(tid);
+    __atomic_store_n(&running, true, __ATOMIC_RELEASE);
+    return 0;
+}
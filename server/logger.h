@@ -0,0 +1,55 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+// Structured logging off the hot path. A log call formats one record into a
+// ring owned by the calling thread, with no lock and no syscall; a writer
+// thread drains the rings and writes whole batches of lines to stdout, as
+// key=value pairs or as JSON. A full ring drops the record and counts it, so
+// logging never waits for the terminal. Records below the compile-time level
+// are compiled out, records below the runtime level cost one comparison, and
+// LOG_SAMPLED keeps one record in log_sample_rate for chatty call sites.
+
+typedef enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+} LogLevel;
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+extern int log_threshold;
+extern int log_sample_rate;
+
+#define LOG_ENABLED(level) ((level) >= LOG_COMPILE_LEVEL && (level) >= log_threshold)
+
+// event is a static dotted name ("lobby.join"); lobby and player may be NULL
+#define LOG(level, event, lobby, player, ...) do { \
+    if (LOG_ENABLED(level)) log_write((level), 1, (event), (lobby), (player), __VA_ARGS__); \
+} while (0)
+
+#define LOG_SAMPLED(level, event, lobby, player, ...) do { \
+    static unsigned log_site_count_; \
+    if (LOG_ENABLED(level) && __atomic_fetch_add(&log_site_count_, 1, __ATOMIC_RELAXED) % log_sample_rate == 0) \
+        log_write((level), log_sample_rate, (event), (lobby), (player), __VA_ARGS__); \
+} while (0)
+
+#define LOG_DEBUG(...) LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// level is "debug", "info", "warn" or "error", format "text" or "json".
+// ring_records is rounded up to a power of two, 0 keeps the default of 32.
+// Every thread that logs gets a ring, so with a thread per connection this is
+// paid per player. Returns 0 once the writer runs; until then records are
+// written directly.
+int logger_start(const char* level, const char* format, int sample_rate, int ring_records);
+
+// sampled is the rate the record was kept at, 1 for every record
+void log_write(LogLevel level, int sampled, const char* event, const char* lobby, const char* player,
+               const char* fmt, ...) __attribute__((format(printf, 6, 7)));
+
+#endif
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <glib-2.0/glib.h>
+#include "matchmaker.h"
+#include "logger.h"
+
+typedef struct {
+    char language[3];
+    int size;
+    GQueue waiting; // of Ticket, oldest first
+    GQueue offers;  // of Offer, oldest first
+} Bucket;
+
+typedef struct {
+    Handle player;
+    Bucket* bucket;
+    GList link; // node in bucket->waiting
+} Ticket;
+
+typedef struct {
+    LobbyId id;
+    int players;
+    Bucket* bucket;
+    GList link; // node in bucket->offers
+} Offer;
+
+static GHashTable* buckets = NULL; // "<language>|<size>" -> Bucket
+static GHashTable* tickets = NULL; // player handle -> Ticket
+static GHashTable* offers = NULL;  // LobbyId -> Offer
+static int min_players = 4;
+static int batch_interval_ms = 100;
+static matchmaker_fill_cb fill_cb = NULL;
+static void* fill_userdata = NULL;
+static bool pending = false;
+
+// data_mutex guards the tables above. It is held only to cut the groups, the
+// fill callbacks run without it, so cancels and new requests never wait for them.
+// The callbacks resolve players by handle and skip those that left or took a
+// lobby of their own since their group was cut.
+static pthread_mutex_t data_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+
+static Bucket* bucket_for(const char* language, int size) {
+    char key[16];
+    snprintf(key, sizeof(key), "%s|%d", language, size);
+    Bucket* bucket = g_hash_table_lookup(buckets, key);
+    if (!bucket) {
+        bucket = g_new0(Bucket, 1);
+        g_strlcpy(bucket->language, language, sizeof(bucket->language));
+        bucket->size = size;
+        g_queue_init(&(bucket->waiting));
+        g_queue_init(&(bucket->offers));
+        g_hash_table_insert(buckets, g_strdup(key), bucket);
+    }
+    return bucket;
+}
+
+static void wake(void) {
+    pending = true;
+    pthread_cond_signal(&pending_cond);
+}
+
+static Ticket* ticket_add(Handle player, Bucket* bucket, bool head) {
+    Ticket* ticket = g_new0(Ticket, 1);
+    ticket->player = player;
+    ticket->bucket = bucket;
+    ticket->link.data = ticket;
+    if (head) {
+        g_queue_push_head_link(&(bucket->waiting), &(ticket->link));
+    } else {
+        g_queue_push_tail_link(&(bucket->waiting), &(ticket->link));
+    }
+    g_hash_table_insert(tickets, &(ticket->player), ticket);
+    return ticket;
+}
+
+// Moves the oldest waiting players of the bucket into the group
+static void group_take(Bucket* bucket, MatchGroup* group, int count) {
+    while (count-- > 0) {
+        GList* link = g_queue_pop_head_link(&(bucket->waiting));
+        Ticket* ticket = (Ticket*) link->data;
+        group->players[group->count++] = ticket->player;
+        g_hash_table_remove(tickets, &(ticket->player));
+    }
+}
+
+static MatchGroup* group_new(Bucket* bucket, const LobbyId* lobby_id) {
+    MatchGroup* group = g_new0(MatchGroup, 1);
+    g_strlcpy(group->language, bucket->language, sizeof(group->language));
+    group->size = bucket->size;
+    if (lobby_id) group->lobby_id = *lobby_id;
+    return group;
+}
+
+// Cuts the groups of one bucket. Call with data_mutex held.
+static void bucket_assign(Bucket* bucket, GPtrArray* groups) {
+    GList* node = bucket->offers.head;
+    while (node && bucket->waiting.length > 0) {
+        Offer* offer = (Offer*) node->data;
+        node = node->next;
+        int need = MAX(min_players - offer->players, 1);
+        if ((int) bucket->waiting.length < need) continue;
+        MatchGroup* group = group_new(bucket, &(offer->id));
+        group_take(bucket, group, MIN(bucket->size - offer->players, (int) bucket->waiting.length));
+        g_ptr_array_add(groups, group);
+        // the lobby offers itself again if the callback leaves it short
+        g_queue_unlink(&(bucket->offers), &(offer->link));
+        g_hash_table_remove(offers, &(offer->id));
+    }
+    while ((int) bucket->waiting.length >= min_players) {
+        MatchGroup* group = group_new(bucket, NULL);
+        group_take(bucket, group, MIN(bucket->size, (int) bucket->waiting.length));
+        g_ptr_array_add(groups, group);
+    }
+}
+
+static void* matchmaker_worker(void* arg) {
+    while (1) {
+        pthread_mutex_lock(&data_mutex);
+        while (!pending) {
+            pthread_cond_wait(&pending_cond, &data_mutex);
+        }
+        pthread_mutex_unlock(&data_mutex);
+        // let a burst of requests pile up into one pass
+        usleep(batch_interval_ms * 1000);
+
+        gint64 started = g_get_monotonic_time();
+        GPtrArray* groups = g_ptr_array_new_with_free_func(g_free);
+        int assigned = 0, waiting = 0;
+        pthread_mutex_lock(&data_mutex);
+        pending = false;
+        GHashTableIter iter;
+        gpointer key, value;
+        g_hash_table_iter_init(&iter, buckets);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            bucket_assign((Bucket*) value, groups);
+        }
+        pthread_mutex_unlock(&data_mutex);
+        for (guint i = 0; i < groups->len; i++) {
+            MatchGroup* group = (MatchGroup*) groups->pdata[i];
+            assigned += group->count;
+            fill_cb(group, fill_userdata);
+        }
+        pthread_mutex_lock(&data_mutex);
+        waiting = g_hash_table_size(tickets);
+        pthread_mutex_unlock(&data_mutex);
+        if (groups->len > 0) {
+            LOG_INFO("match.pass", NULL, NULL, "%d players in %u groups in %.2f ms, %d waiting",
+                     assigned, groups->len, (g_get_monotonic_time() - started) / 1000.0, waiting);
+        }
+        g_ptr_array_free(groups, TRUE);
+    }
+    return NULL;
+}
+
+int matchmaker_start(int min, int interval_ms, matchmaker_fill_cb fill, void* userdata) {
+    buckets = g_hash_table_new(g_str_hash, g_str_equal);
+    tickets = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+    offers = g_hash_table_new_full(lobby_id_hash, lobby_id_equal, NULL, g_free);
+    min_players = min;
+    batch_interval_ms = interval_ms;
+    fill_cb = fill;
+    fill_userdata = userdata;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, matchmaker_worker, NULL) != 0) {
+        fprintf(stderr, "failed to start the matchmaker\n");
+        return 1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+int matchmaker_enqueue(Handle player, const char* language, int size) {
+    pthread_mutex_lock(&data_mutex);
+    if (g_hash_table_contains(tickets, &player)) {
+        pthread_mutex_unlock(&data_mutex);
+        return -1;
+    }
+    Bucket* bucket = bucket_for(language, size);
+    ticket_add(player, bucket, false);
+    int waiting = bucket->waiting.length;
+    wake();
+    pthread_mutex_unlock(&data_mutex);
+    return waiting;
+}
+
+bool matchmaker_cancel(Handle player) {
+    pthread_mutex_lock(&data_mutex);
+    Ticket* ticket = g_hash_table_lookup(tickets, &player);
+    bool waiting = ticket != NULL;
+    if (ticket) {
+        g_queue_unlink(&(ticket->bucket->waiting), &(ticket->link));
+        g_hash_table_remove(tickets, &player);
+    }
+    pthread_mutex_unlock(&data_mutex);
+    return waiting;
+}
+
+void matchmaker_requeue(const MatchGroup* group, int from) {
+    pthread_mutex_lock(&data_mutex);
+    Bucket* bucket = bucket_for(group->language, group->size);
+    // backwards, so the group keeps its order at the head
+    for (int i = group->count - 1; i >= from; i--) {
+        ticket_add(group->players[i], bucket, true);
+    }
+    pthread_mutex_unlock(&data_mutex);
+}
+
+void matchmaker_offer(const LobbyId* lobby_id, const char* language, int size, int players) {
+    pthread_mutex_lock(&data_mutex);
+    Offer* offer = g_hash_table_lookup(offers, lobby_id);
+    if (offer && (offer->bucket->size != size || strcmp(offer->bucket->language, language) != 0)) {
+        g_queue_unlink(&(offer->bucket->offers), &(offer->link));
+        g_hash_table_remove(offers, lobby_id);
+        offer = NULL;
+    }
+    if (!offer) {
+        offer = g_new0(Offer, 1);
+        offer->id = *lobby_id;
+        offer->bucket = bucket_for(language, size);
+        offer->link.data = offer;
+        g_queue_push_tail_link(&(offer->bucket->offers), &(offer->link));
+        g_hash_table_insert(offers, &(offer->id), offer);
+    }
+    offer->players = players;
+    if (offer->bucket->waiting.length > 0) wake();
+    pthread_mutex_unlock(&data_mutex);
+}
+
+void matchmaker_withdraw(const LobbyId* lobby_id) {
+    pthread_mutex_lock(&data_mutex);
+    Offer* offer = g_hash_table_lookup(offers, lobby_id);
+    if (offer) {
+        g_queue_unlink(&(offer->bucket->offers), &(offer->link));
+        g_hash_table_remove(offers, lobby_id);
+    }
+    pthread_mutex_unlock(&data_mutex);
+}
+
+void matchmaker_kick(void) {
+    pthread_mutex_lock(&data_mutex);
+    if (g_hash_table_size(tickets) > 0) wake();
+    pthread_mutex_unlock(&data_mutex);
+}
+
+int matchmaker_waiting(void) {
+    pthread_mutex_lock(&data_mutex);
+    int waiting = tickets ? (int) g_hash_table_size(tickets) : 0;
+    pthread_mutex_unlock(&data_mutex);
+    return waiting;
+}
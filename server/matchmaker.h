@@ -0,0 +1,58 @@
+#ifndef MATCHMAKER_H
+#define MATCHMAKER_H
+
+#include <stdbool.h>
+#include "pool.h"
+#include "lobby_id.h"
+
+// Automatic matchmaking for OP_FIND_MATCH. Waiting players sit in one FIFO
+// bucket per (language, lobby size). A worker thread runs batched passes:
+// each pass first tops up matchmade lobbies of the bucket that lost players
+// and cannot start on their own, then cuts new lobbies out of the waiting
+// players as long as min_players of them are there. Joining, leaving and
+// assigning a player are O(1), so a pass costs what it assigns. Players are
+// held by their handles: one that went away while waiting no longer resolves.
+
+#define MATCHMAKER_MAX_GROUP 16
+
+typedef struct {
+    char language[3];
+    int size;          // max players of the lobby
+    LobbyId lobby_id; // lobby to top up, zero for a new lobby
+    int count;
+    Handle players[MATCHMAKER_MAX_GROUP];
+} MatchGroup;
+
+// Seats the players of a group. Runs on the matchmaker thread, players the
+// callback could not seat go back with matchmaker_requeue.
+typedef void (*matchmaker_fill_cb)(MatchGroup* group, void* userdata);
+
+// Returns 0 once the worker runs.
+int matchmaker_start(int min_players, int interval_ms, matchmaker_fill_cb fill, void* userdata);
+
+// Returns the number of players waiting in the bucket, -1 when the player
+// is already waiting.
+int matchmaker_enqueue(Handle player, const char* language, int size);
+
+// Takes the player out of matchmaking without waiting for a running pass.
+// Returns true when the player was still waiting; false also when a pass has
+// already cut them into a group, whose fill callback must then skip a player
+// who went on to leave or join another lobby.
+bool matchmaker_cancel(Handle player);
+
+// Puts players[from..] of a group back at the head of their bucket.
+void matchmaker_requeue(const MatchGroup* group, int from);
+
+// Lists a matchmade lobby that has free seats but too few players to start,
+// or refreshes its player count.
+void matchmaker_offer(const LobbyId* lobby_id, const char* language, int size, int players);
+
+void matchmaker_withdraw(const LobbyId* lobby_id);
+
+// Wakes the worker for another pass, e.g. when room for new lobbies frees up.
+void matchmaker_kick(void);
+
+// Players waiting in all buckets
+int matchmaker_waiting(void);
+
+#endif
@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "metrics.h"
+#include "logger.h"
+
+#define HIST_SUB 4                 // sub-buckets per power of two
+#define HIST_BUCKETS 104           // up to 2^27 us, about two minutes
+#define HIST_MAX ((1L << 27) - 1)  // longer ones count in the last bucket
+#define SCRAPE_TIMEOUT_S 2         // a scraper that sends nothing for this long is dropped
+
+typedef enum {
+    SERIES_GAUGE,
+    SERIES_HISTOGRAM
+} SeriesType;
+
+typedef struct {
+    char* name;
+    char* help;
+    char* labels; // "" without labels
+    SeriesType type;
+} Series;
+
+typedef struct {
+    unsigned long buckets[HIST_BUCKETS];
+    unsigned long count;
+    unsigned long sum; // microseconds
+} Histogram;
+
+// Written only by its thread; the scraper reads it with relaxed loads
+typedef struct Shard {
+    Histogram* histograms[METRICS_MAX_SERIES]; // allocated on the first observation
+    struct Shard* next;
+} Shard;
+
+static Series series[METRICS_MAX_SERIES];
+static int series_count = 0;
+static GHashTable* series_ids = NULL; // "name{labels}" -> id + 1
+static pthread_mutex_t series_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool full_logged = false; // the first series past METRICS_MAX_SERIES is logged
+static long gauges[METRICS_MAX_SERIES];
+
+static __thread Shard* own_shard = NULL;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Shard* shards = NULL;
+static Shard retired; // totals of the threads that exited
+
+static metrics_collect_fn collect_fn = NULL;
+
+static int bucket_of(gint64 micros) {
+    if (micros < HIST_SUB) return micros < 0 ? 0 : (int) micros;
+    if (micros > HIST_MAX) micros = HIST_MAX;
+    int power = 63 - __builtin_clzll((unsigned long long) micros);
+    return HIST_SUB * (power - 1) + (int) ((micros >> (power - 2)) & (HIST_SUB - 1));
+}
+
+// Exclusive upper bound of the bucket in microseconds
+static gint64 bucket_bound(int bucket) {
+    if (bucket < HIST_SUB) return bucket + 1;
+    int power = bucket / HIST_SUB + 1;
+    return (gint64) (HIST_SUB + 1 + bucket % HIST_SUB) << (power - 2);
+}
+
+static void add(unsigned long* total, unsigned long n) {
+    __atomic_store_n(total, __atomic_load_n(total, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static void shard_merge(Shard* into, Shard* from) {
+    for (int i = 0; i < METRICS_MAX_SERIES; i++) {
+        Histogram* h = __atomic_load_n(&(from->histograms[i]), __ATOMIC_ACQUIRE);
+        if (!h) continue;
+        if (!into->histograms[i]) into->histograms[i] = g_new0(Histogram, 1);
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            into->histograms[i]->buckets[b] += __atomic_load_n(&(h->buckets[b]), __ATOMIC_RELAXED);
+        }
+        into->histograms[i]->count += __atomic_load_n(&(h->count), __ATOMIC_RELAXED);
+        into->histograms[i]->sum += __atomic_load_n(&(h->sum), __ATOMIC_RELAXED);
+    }
+}
+
+static void shard_free(Shard* shard) {
+    for (int i = 0; i < METRICS_MAX_SERIES; i++) {
+        g_free(shard->histograms[i]);
+    }
+    g_free(shard);
+}
+
+// The thread exits: its totals move to retired so they keep counting
+static void shard_retire(void* data) {
+    Shard* shard = (Shard*) data;
+    own_shard = NULL; // a later record on this thread gets a fresh shard
+    pthread_mutex_lock(&shards_mutex);
+    Shard** link = &shards;
+    while (*link != shard) link = &((*link)->next);
+    *link = shard->next;
+    shard_merge(&retired, shard);
+    pthread_mutex_unlock(&shards_mutex);
+    shard_free(shard);
+}
+
+static void shard_key_create(void) {
+    pthread_key_create(&shard_key, shard_retire);
+}
+
+static Shard* shard_get(void) {
+    if (!own_shard) {
+        pthread_once(&shard_key_once, shard_key_create);
+        own_shard = g_new0(Shard, 1);
+        pthread_setspecific(shard_key, own_shard);
+        pthread_mutex_lock(&shards_mutex);
+        own_shard->next = shards;
+        shards = own_shard;
+        pthread_mutex_unlock(&shards_mutex);
+    }
+    return own_shard;
+}
+
+static int series_register(const char* name, const char* help, const char* labels, SeriesType type) {
+    if (!labels) labels = "";
+    char* key = g_strdup_printf("%s{%s}", name, labels);
+    pthread_mutex_lock(&series_mutex);
+    if (!series_ids) series_ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    int id = GPOINTER_TO_INT(g_hash_table_lookup(series_ids, key)) - 1;
+    if (id < 0 && series_count < METRICS_MAX_SERIES) {
+        id = series_count;
+        series[id].name = g_strdup(name);
+        series[id].help = g_strdup(help);
+        series[id].labels = g_strdup(labels);
+        series[id].type = type;
+        g_hash_table_insert(series_ids, key, GINT_TO_POINTER(id + 1));
+        key = NULL;
+        // the scraper reads the series below the count without the lock
+        __atomic_store_n(&series_count, id + 1, __ATOMIC_RELEASE);
+    } else if (id < 0 && !full_logged) {
+        full_logged = true;
+        LOG_WARN("metrics.full", NULL, NULL, "No room for series %s, at most %d exist", key, METRICS_MAX_SERIES);
+    }
+    pthread_mutex_unlock(&series_mutex);
+    g_free(key);
+    return id;
+}
+
+int metrics_histogram(const char* name, const char* help, const char* labels) {
+    return series_register(name, help, labels, SERIES_HISTOGRAM);
+}
+
+int metrics_gauge(const char* name, const char* help, const char* labels) {
+    return series_register(name, help, labels, SERIES_GAUGE);
+}
+
+void metrics_observe(int id, gint64 micros) {
+    if (id < 0) return;
+    Shard* shard = shard_get();
+    Histogram* h = shard->histograms[id];
+    if (!h) {
+        h = g_new0(Histogram, 1);
+        __atomic_store_n(&(shard->histograms[id]), h, __ATOMIC_RELEASE);
+    }
+    add(&(h->buckets[bucket_of(micros)]), 1);
+    add(&(h->sum), micros > 0 ? micros : 0);
+    add(&(h->count), 1);
+}
+
+void metrics_gauge_add(int id, long delta) {
+    if (id < 0) return;
+    __atomic_add_fetch(&(gauges[id]), delta, __ATOMIC_RELAXED);
+}
+
+void metrics_gauge_set(int id, long value) {
+    if (id < 0) return;
+    __atomic_store_n(&(gauges[id]), value, __ATOMIC_RELAXED);
+}
+
+/* ** EXPOSITION ** */
+
+// Writes name+suffix{labels,extra}
+static void series_name(GString* out, const Series* s, const char* suffix, const char* extra) {
+    g_string_append(out, s->name);
+    g_string_append(out, suffix);
+    if (!s->labels[0] && !extra) return;
+    g_string_append_c(out, '{');
+    g_string_append(out, s->labels);
+    if (extra) {
+        if (s->labels[0]) g_string_append_c(out, ',');
+        g_string_append(out, extra);
+    }
+    g_string_append_c(out, '}');
+}
+
+static void histogram_write(GString* out, const Series* s, const Histogram* h) {
+    unsigned long cumulative = 0;
+    char le[32];
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        cumulative += h->buckets[b];
+        snprintf(le, sizeof(le), "le=\"%.6f\"", bucket_bound(b) / 1e6);
+        series_name(out, s, "_bucket", le);
+        g_string_append_printf(out, " %lu\n", cumulative);
+    }
+    series_name(out, s, "_bucket", "le=\"+Inf\"");
+    g_string_append_printf(out, " %lu\n", h->count);
+    series_name(out, s, "_sum", NULL);
+    g_string_append_printf(out, " %.6f\n", h->sum / 1e6);
+    series_name(out, s, "_count", NULL);
+    g_string_append_printf(out, " %lu\n", h->count);
+}
+
+static void metrics_write(GString* out) {
+    if (collect_fn) collect_fn();
+    Shard* total = g_new0(Shard, 1);
+    pthread_mutex_lock(&shards_mutex);
+    shard_merge(total, &retired);
+    for (Shard* shard = shards; shard; shard = shard->next) {
+        shard_merge(total, shard);
+    }
+    pthread_mutex_unlock(&shards_mutex);
+
+    static const char* type_names[] = {"gauge", "histogram"};
+    static const Histogram empty;
+    int count = __atomic_load_n(&series_count, __ATOMIC_ACQUIRE);
+    bool* written = g_new0(bool, count);
+    // the series of one name together, under one HELP and TYPE
+    for (int i = 0; i < count; i++) {
+        if (written[i]) continue;
+        g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n",
+                               series[i].name, series[i].help, series[i].name, type_names[series[i].type]);
+        for (int j = i; j < count; j++) {
+            const Series* s = &(series[j]);
+            if (written[j] || strcmp(s->name, series[i].name) != 0) continue;
+            written[j] = true;
+            if (s->type == SERIES_HISTOGRAM) {
+                histogram_write(out, s, total->histograms[j] ? total->histograms[j] : &empty);
+            } else {
+                series_name(out, s, "", NULL);
+                g_string_append_printf(out, " %ld\n", __atomic_load_n(&(gauges[j]), __ATOMIC_RELAXED));
+            }
+        }
+    }
+    g_free(written);
+    shard_free(total);
+}
+
+static void send_all(int socket, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(socket, data, len, MSG_NOSIGNAL);
+        if (n <= 0) return;
+        data += n;
+        len -= n;
+    }
+}
+
+static void metrics_serve(int client) {
+    struct timeval timeout = {SCRAPE_TIMEOUT_S, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char request[1024];
+    ssize_t n = recv(client, request, sizeof(request) - 1, 0);
+    if (n <= 0) return;
+    request[n] = '\0';
+    if (strncmp(request, "GET /metrics", 12) != 0 || (request[12] != ' ' && request[12] != '?')) {
+        const char* missing = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send_all(client, missing, strlen(missing));
+        return;
+    }
+    GString* body = g_string_sized_new(64 * 1024);
+    metrics_write(body);
+    char header[160];
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                       "Content-Length: %zu\r\nConnection: close\r\n\r\n", body->len);
+    send_all(client, header, len);
+    send_all(client, body->str, body->len);
+    g_string_free(body, TRUE);
+}
+
+// One scrape at a time is plenty for a Prometheus server
+static void* metrics_listener(void* arg) {
+    int server = GPOINTER_TO_INT(arg);
+    while (1) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) {
+            LOG_WARN("metrics.accept_failed", NULL, NULL, "Metrics accept failed: %s", g_strerror(errno));
+            continue;
+        }
+        metrics_serve(client);
+        close(client);
+    }
+    return NULL;
+}
+
+int metrics_start(const char* address, int port, metrics_collect_fn collect) {
+    collect_fn = collect;
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &(addr.sin_addr)) != 1) {
+        fprintf(stderr, "invalid metrics address %s\n", address);
+        return 1;
+    }
+    int server = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server < 0) {
+        perror("metrics socket failed");
+        return 1;
+    }
+    int yes = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (bind(server, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(server, 16) < 0) {
+        perror("metrics bind failed");
+        close(server);
+        return 1;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, metrics_listener, GINT_TO_POINTER(server)) != 0) {
+        fprintf(stderr, "failed to start the metrics listener\n");
+        close(server);
+        return 1;
+    }
+    pthread_detach(tid);
+    LOG_INFO("metrics.listen", NULL, NULL, "Metrics served on http://%s:%d/metrics", address, port);
+    return 0;
+}
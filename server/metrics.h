@@ -0,0 +1,35 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <glib-2.0/glib.h>
+
+// Latency histograms and gauges, served in the Prometheus text format on a port
+// of their own. Histograms are kept per thread: a thread records into its own
+// shard with plain relaxed stores, no lock and no shared cache line, and a
+// scrape adds the shards up. They are HDR-style, four sub-buckets per power of
+// two of microseconds, so every latency from 1 us to two minutes lands in a
+// bucket at most 25% wide.
+//
+// A series is one metric name with one set of labels, e.g.
+// metrics_histogram("request_duration_seconds", "...", "op=\"101\""). Looking a
+// series up takes a lock, so call sites with fixed labels keep the id.
+
+#define METRICS_MAX_SERIES 256
+
+// Called before every scrape, to set gauges that are cheaper to read than to track
+typedef void (*metrics_collect_fn)(void);
+
+// Serves GET /metrics on address:port. Returns 0 once the listener runs.
+int metrics_start(const char* address, int port, metrics_collect_fn collect);
+
+// Each returns the id of the series, registering it on first use, or -1 once
+// METRICS_MAX_SERIES exist; recording into -1 does nothing. labels may be NULL.
+int metrics_histogram(const char* name, const char* help, const char* labels);
+int metrics_gauge(const char* name, const char* help, const char* labels);
+
+void metrics_observe(int series, gint64 micros);
+
+void metrics_gauge_add(int series, long delta);
+void metrics_gauge_set(int series, long value);
+
+#endif
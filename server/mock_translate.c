@@ -0,0 +1,252 @@
+// Local stand-in for the LibreTranslate /translate endpoint, for load tests
+// without the translation container. Every request waits latency ms, give or
+// take jitter ms, and gets the text back tagged with the target language.
+// With -t it answers from the translations in a trace recorded by the server
+// instead, after the time the backend took then unless -l is given.
+// Usage: ./mock_translate.out [-p port] [-l latency ms] [-j jitter ms] [-t trace]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <glib-2.0/glib.h>
+#include "trace.h"
+
+#define MAX_REQUEST 8192
+
+static int latency_ms = 50;
+static int jitter_ms = 0;
+static bool latency_set = false;
+static unsigned long served = 0;
+
+typedef struct {
+    char* translated;
+    int status;
+    int latency_ms; // -1 when the backend was not asked
+} Recorded;
+
+// "source target text" -> Recorded, the last answer recorded for each request
+static GHashTable* recorded = NULL;
+static unsigned long replayed = 0;
+
+static char* recorded_key(const char* source, const char* target, const char* text) {
+    return g_strdup_printf("%s\t%s\t%s", source, target, text);
+}
+
+static int recorded_load(const char* path) {
+    FILE* in = fopen(path, "rb");
+    if (!in || !trace_check(in)) {
+        fprintf(stderr, "%s is not a trace\n", path);
+        if (in) fclose(in);
+        return -1;
+    }
+    recorded = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    TraceRecord record;
+    while (trace_read(in, &record)) {
+        if (record.header.type == TRACE_TRANSLATION) {
+            // origin, source, target, text, answer
+            const char* fields[5];
+            const char* field = record.data;
+            int count = 0;
+            for (; count < 5 && field < record.data + record.header.len; count++) {
+                fields[count] = field;
+                field += strlen(field) + 1;
+            }
+            if (count == 5) {
+                Recorded* r = g_malloc(sizeof(Recorded) + strlen(fields[4]) + 1);
+                r->translated = (char*) (r + 1);
+                strcpy(r->translated, fields[4]);
+                r->status = record.header.conn;
+                r->latency_ms = strcmp(fields[0], "backend") == 0 || strcmp(fields[0], "error") == 0
+                                ? (int) (record.header.aux / 1000) : -1;
+                char* key = recorded_key(fields[1], fields[2], fields[3]);
+                Recorded* previous = g_hash_table_lookup(recorded, key);
+                // a cache hit keeps the backend time of an earlier record
+                if (previous && r->latency_ms < 0) r->latency_ms = previous->latency_ms;
+                g_hash_table_replace(recorded, key, r);
+            }
+        }
+        g_free(record.data);
+    }
+    fclose(in);
+    return g_hash_table_size(recorded);
+}
+
+// Value of key in a form-urlencoded body, decoded; NULL when missing
+static char* form_value(const char* body, const char* key) {
+    size_t key_len = strlen(key);
+    for (const char* field = body; field && *field; field = strchr(field, '&'), field = field ? field + 1 : NULL) {
+        if (strncmp(field, key, key_len) != 0 || field[key_len] != '=') continue;
+        const char* value = field + key_len + 1;
+        size_t len = strcspn(value, "&");
+        char* raw = g_strndup(value, len);
+        g_strdelimit(raw, "+", ' ');
+        char* decoded = g_uri_unescape_string(raw, NULL);
+        g_free(raw);
+        return decoded;
+    }
+    return NULL;
+}
+
+static void json_escape(GString* out, const char* text) {
+    for (const char* c = text; *c; c++) {
+        if (*c == '"' || *c == '\\') g_string_append_c(out, '\\');
+        if ((unsigned char) *c >= 0x20) g_string_append_c(out, *c);
+    }
+}
+
+static bool respond(int client, int status, const char* type, const GString* body) {
+    char header[256];
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+                       status, status == 200 ? "OK" : "Not Found", type, body->len);
+    return send(client, header, len, MSG_NOSIGNAL) == len &&
+           send(client, body->str, body->len, MSG_NOSIGNAL) == (ssize_t) body->len;
+}
+
+// Serves keep-alive requests until the client hangs up
+static void* connection_run(void* arg) {
+    int client = GPOINTER_TO_INT(arg);
+    char buffer[MAX_REQUEST + 1];
+    int len = 0;
+    while (1) {
+        char* end = g_strstr_len(buffer, len, "\r\n\r\n");
+        if (!end) {
+            if (len == MAX_REQUEST) break;
+            ssize_t n = recv(client, buffer + len, MAX_REQUEST - len, 0);
+            if (n <= 0) break;
+            len += n;
+            buffer[len] = '\0';
+            continue;
+        }
+        int header_len = end - buffer + 4;
+        const char* length = strcasestr(buffer, "\r\nContent-Length:");
+        int body_len = length && length < end ? atoi(length + 17) : 0;
+        if (header_len + body_len > MAX_REQUEST) break;
+        if (len < header_len + body_len) {
+            ssize_t n = recv(client, buffer + len, MAX_REQUEST - len, 0);
+            if (n <= 0) break;
+            len += n;
+            buffer[len] = '\0';
+            continue;
+        }
+        char* body = g_strndup(buffer + header_len, body_len);
+        GString* reply = g_string_new(NULL);
+        bool ok;
+        if (strncmp(buffer, "POST /translate", 15) == 0) {
+            char* text = form_value(body, "q");
+            char* source = form_value(body, "source");
+            char* target = form_value(body, "target");
+            Recorded* r = NULL;
+            if (recorded) {
+                char* key = recorded_key(source ? source : "", target ? target : "", text ? text : "");
+                r = g_hash_table_lookup(recorded, key);
+                g_free(key);
+            }
+            int delay = r && !latency_set && r->latency_ms >= 0 ? r->latency_ms : latency_ms;
+            delay += jitter_ms > 0 ? g_random_int_range(-jitter_ms, jitter_ms + 1) : 0;
+            if (delay > 0) usleep(delay * 1000);
+            if (r && r->status != 0) {
+                ok = false; // hanging up fails the request like the recorded one
+            } else {
+                g_string_append(reply, "{\"translatedText\":\"");
+                if (r) {
+                    json_escape(reply, r->translated);
+                } else {
+                    json_escape(reply, text ? text : "");
+                    g_string_append(reply, " (");
+                    json_escape(reply, target ? target : "");
+                    g_string_append_c(reply, ')');
+                }
+                g_string_append(reply, "\"}");
+                ok = respond(client, 200, "application/json", reply);
+            }
+            __atomic_add_fetch(&served, 1, __ATOMIC_RELAXED);
+            if (r) __atomic_add_fetch(&replayed, 1, __ATOMIC_RELAXED);
+            g_free(text);
+            g_free(source);
+            g_free(target);
+        } else if (strncmp(buffer, "GET / ", 6) == 0) {
+            // wait-for-libretranslate.sh polls the root
+            g_string_append(reply, "mock");
+            ok = respond(client, 200, "text/plain", reply);
+        } else {
+            ok = respond(client, 404, "text/plain", reply);
+        }
+        g_string_free(reply, TRUE);
+        g_free(body);
+        if (!ok) break;
+        len -= header_len + body_len;
+        memmove(buffer, buffer + header_len + body_len, len);
+        buffer[len] = '\0';
+    }
+    close(client);
+    return NULL;
+}
+
+static void* stats_run(void* arg) {
+    unsigned long last = 0;
+    while (1) {
+        sleep(5);
+        unsigned long now = __atomic_load_n(&served, __ATOMIC_RELAXED);
+        if (now != last) {
+            printf("%lu translations served, %.1f/s, %lu from the trace\n", now, (now - last) / 5.0,
+                   __atomic_load_n(&replayed, __ATOMIC_RELAXED));
+        }
+        fflush(stdout);
+        last = now;
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    int port = 5000;
+    int opt;
+    const char* trace_path = NULL;
+    while ((opt = getopt(argc, argv, "p:l:j:t:")) != -1) {
+        switch (opt) {
+            case 'p': port = atoi(optarg); break;
+            case 'l': latency_ms = atoi(optarg); latency_set = true; break;
+            case 'j': jitter_ms = atoi(optarg); break;
+            case 't': trace_path = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-p port] [-l latency ms] [-j jitter ms] [-t trace]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (trace_path) {
+        int loaded = recorded_load(trace_path);
+        if (loaded < 0) return 1;
+        printf("Loaded %d recorded translations from %s\n", loaded, trace_path);
+    }
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server, SOMAXCONN) < 0) {
+        perror("bind failed");
+        return 1;
+    }
+    printf("Mock LibreTranslate on port %d, %d ms latency, %d ms jitter\n", port, latency_ms, jitter_ms);
+    fflush(stdout);
+    pthread_t tid;
+    pthread_create(&tid, NULL, stats_run, NULL);
+    pthread_detach(tid);
+    while (1) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) continue;
+        if (pthread_create(&tid, NULL, connection_run, GINT_TO_POINTER(client)) != 0) {
+            close(client);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+}
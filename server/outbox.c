@@ -0,0 +1,371 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "outbox.h"
+#include "logger.h"
+
+#define OUTBOX_IOV 64    // parts handed to one sendmsg
+#define OUTBOX_HARD 4    // a backlog this many times the high watermark is evicted at once
+#define FLUSHER_TICK 250 // ms between slow consumer checks while some socket is full
+
+typedef struct {
+    GBytes* parts[OUTBOX_PARTS];
+    int count;
+    int kind;
+    gsize size;
+} Entry;
+
+struct Outbox {
+    int socket;
+    pthread_mutex_t mutex;
+    GQueue entries; // of Entry, oldest first
+    int part;       // parts of the head entry already written
+    gsize offset;   // bytes of that part already written
+    gsize bytes;    // unwritten bytes
+    guint64 queued; // bytes ever queued, less the superseded ones
+    gint64 congested_since; // when the backlog went over the high watermark, 0 once under the low one
+    bool closed;
+    bool flushing;  // the socket was full, the flusher or the watcher owns the backlog
+    bool listed;    // in the flusher's list
+    outbox_watch_fn watch; // NULL when the flusher polls the socket
+    void* watch_ctx;
+    int refs;       // the connection, and the flusher while listed
+};
+
+static pthread_mutex_t flusher_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GList* handed = NULL; // outboxes given to the flusher since its last poll
+static int wake_fds[2] = {-1, -1};
+static gsize high_watermark = 256 * 1024;
+static gsize low_watermark = 64 * 1024;
+static int slow_ms = 5000;
+static gulong evictions = 0;
+static gulong superseded = 0;
+
+static Outbox* outbox_ref(Outbox* outbox) {
+    g_atomic_int_inc(&(outbox->refs));
+    return outbox;
+}
+
+static void flusher_wake(void) {
+    char wake = 1;
+    if (write(wake_fds[1], &wake, 1) < 0 && errno != EAGAIN) {
+        LOG_WARN("outbox.wake_failed", NULL, NULL, "Outbox wake failed: %s", g_strerror(errno));
+    }
+}
+
+static void entry_free(Entry* entry) {
+    for (int i = 0; i < entry->count; i++) {
+        g_bytes_unref(entry->parts[i]);
+    }
+    g_free(entry);
+}
+
+static void outbox_drop(Outbox* outbox) {
+    Entry* entry;
+    while ((entry = g_queue_pop_head(&(outbox->entries)))) {
+        entry_free(entry);
+    }
+    outbox->part = 0;
+    outbox->offset = 0;
+    outbox->bytes = 0;
+    outbox->congested_since = 0;
+}
+
+// Drops the unwritten entries of the kind. The head entry stays once it is
+// partly out, the peer would get half a message otherwise.
+static void outbox_supersede(Outbox* outbox, int kind) {
+    GList* node = outbox->entries.head;
+    if (node && (outbox->part > 0 || outbox->offset > 0)) node = node->next;
+    while (node) {
+        GList* next = node->next;
+        Entry* entry = (Entry*) node->data;
+        if (entry->kind == kind) {
+            outbox->bytes -= entry->size;
+            __atomic_sub_fetch(&(outbox->queued), entry->size, __ATOMIC_RELAXED);
+            g_queue_delete_link(&(outbox->entries), node);
+            entry_free(entry);
+            __atomic_add_fetch(&superseded, 1, __ATOMIC_RELAXED);
+        }
+        node = next;
+    }
+}
+
+// Closes the outbox of a consumer that cannot keep up; shutting the socket down
+// ends its reads as well, so the connection goes through the usual disconnect.
+// Call with the outbox mutex held.
+static void outbox_evict(Outbox* outbox, const char* reason) {
+    LOG_WARN("outbox.evict", NULL, NULL, "Evicting slow consumer on socket %d: %s, %zu bytes unsent",
+             outbox->socket, reason, outbox->bytes);
+    __atomic_add_fetch(&evictions, 1, __ATOMIC_RELAXED);
+    outbox->closed = true;
+    outbox_drop(outbox);
+    shutdown(outbox->socket, SHUT_RDWR);
+}
+
+// Writes the backlog until the socket is full. Call with the outbox mutex held.
+// Returns 0 when it is all out, 1 when some is left, -1 when the socket failed.
+static int outbox_write(Outbox* outbox) {
+    while (!g_queue_is_empty(&(outbox->entries))) {
+        struct iovec iov[OUTBOX_IOV];
+        int iovcnt = 0;
+        int first = outbox->part;
+        gsize skip = outbox->offset;
+        for (GList* node = outbox->entries.head; node && iovcnt < OUTBOX_IOV; node = node->next) {
+            Entry* entry = (Entry*) node->data;
+            for (int i = first; i < entry->count && iovcnt < OUTBOX_IOV; i++) {
+                gsize size;
+                const char* data = g_bytes_get_data(entry->parts[i], &size);
+                iov[iovcnt].iov_base = (char*) data + skip;
+                iov[iovcnt].iov_len = size - skip;
+                iovcnt++;
+                skip = 0;
+            }
+            first = 0;
+        }
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n = sendmsg(outbox->socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            return -1;
+        }
+        outbox->bytes -= n;
+        while (n > 0) {
+            Entry* entry = (Entry*) g_queue_peek_head(&(outbox->entries));
+            gsize left = g_bytes_get_size(entry->parts[outbox->part]) - outbox->offset;
+            if ((gsize) n < left) {
+                outbox->offset += n;
+                break;
+            }
+            n -= left;
+            outbox->offset = 0;
+            if (++outbox->part == entry->count) {
+                entry_free(g_queue_pop_head(&(outbox->entries)));
+                outbox->part = 0;
+            }
+        }
+        if (outbox->bytes <= low_watermark) {
+            outbox->congested_since = 0;
+        }
+    }
+    return 0;
+}
+
+static void* outbox_flusher(void* arg) {
+    GPtrArray* slow = g_ptr_array_new(); // of Outbox, flushing
+    GArray* fds = g_array_new(FALSE, FALSE, sizeof(struct pollfd));
+    while (1) {
+        pthread_mutex_lock(&flusher_mutex);
+        for (GList* node = handed; node; node = node->next) {
+            g_ptr_array_add(slow, node->data);
+        }
+        g_list_free(handed);
+        handed = NULL;
+        pthread_mutex_unlock(&flusher_mutex);
+
+        g_array_set_size(fds, slow->len + 1);
+        struct pollfd* pfd = (struct pollfd*) fds->data;
+        pfd[0].fd = wake_fds[0];
+        pfd[0].events = POLLIN;
+        for (guint i = 0; i < slow->len; i++) {
+            Outbox* outbox = (Outbox*) slow->pdata[i];
+            // poll skips a negative fd, a watched socket is only timed here
+            pfd[i + 1].fd = outbox->watch ? -1 : outbox->socket;
+            pfd[i + 1].events = POLLOUT;
+        }
+        if (poll(pfd, slow->len + 1, slow->len > 0 ? FLUSHER_TICK : -1) < 0) {
+            if (errno != EINTR) LOG_WARN("outbox.poll_failed", NULL, NULL, "Outbox poll failed: %s", g_strerror(errno));
+            continue;
+        }
+        if (pfd[0].revents) {
+            char drain[64];
+            while (read(wake_fds[0], drain, sizeof(drain)) > 0);
+        }
+        gint64 now = g_get_monotonic_time();
+        // backwards, so removing an outbox does not skip the next one
+        for (int i = (int) slow->len - 1; i >= 0; i--) {
+            Outbox* outbox = (Outbox*) slow->pdata[i];
+            pthread_mutex_lock(&(outbox->mutex));
+            int left = 0;
+            if (outbox->closed) {
+                left = 0;
+            } else if (outbox->watch) {
+                left = outbox->flushing ? 1 : 0;
+            } else if (pfd[i + 1].revents) {
+                left = outbox_write(outbox);
+                if (left < 0) {
+                    outbox->closed = true;
+                    outbox_drop(outbox);
+                }
+            } else {
+                left = 1;
+            }
+            if (left > 0 && outbox->congested_since && now - outbox->congested_since > (gint64) slow_ms * 1000) {
+                outbox_evict(outbox, "over the high watermark for too long");
+                left = 0;
+            }
+            bool done = left <= 0;
+            if (done) {
+                outbox->listed = false;
+                // a watched backlog is the watcher's to finish
+                if (!outbox->watch) outbox->flushing = false;
+            }
+            pthread_mutex_unlock(&(outbox->mutex));
+            if (done) {
+                g_ptr_array_remove_index_fast(slow, i);
+                outbox_unref(outbox);
+            }
+        }
+    }
+    return NULL;
+}
+
+int outbox_start(int high_kb, int low_kb, int slow_after_ms) {
+    high_watermark = (gsize) high_kb * 1024;
+    low_watermark = (gsize) MIN(low_kb, high_kb) * 1024;
+    slow_ms = slow_after_ms;
+    if (pipe2(wake_fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+        perror("failed to create the outbox wake pipe");
+        return 1;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, outbox_flusher, NULL) != 0) {
+        fprintf(stderr, "failed to start the outbox flusher\n");
+        return 1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+Outbox* outbox_new(int socket) {
+    Outbox* outbox = g_new0(Outbox, 1);
+    outbox->socket = socket;
+    pthread_mutex_init(&(outbox->mutex), NULL);
+    g_queue_init(&(outbox->entries));
+    outbox->refs = 1;
+    return outbox;
+}
+
+void outbox_watch(Outbox* outbox, outbox_watch_fn watch, void* ctx) {
+    outbox->watch = watch;
+    outbox->watch_ctx = ctx;
+}
+
+void outbox_flush(Outbox* outbox) {
+    pthread_mutex_lock(&(outbox->mutex));
+    if (outbox->flushing) {
+        int left = outbox->closed ? 0 : outbox_write(outbox);
+        if (left < 0) {
+            outbox->closed = true;
+            outbox_drop(outbox);
+        }
+        if (left <= 0) {
+            outbox->flushing = false;
+            outbox->watch(outbox->watch_ctx, false);
+        }
+    }
+    pthread_mutex_unlock(&(outbox->mutex));
+}
+
+int outbox_push(Outbox* outbox, GBytes* const* parts, int count, int kind, bool replace) {
+    pthread_mutex_lock(&(outbox->mutex));
+    if (outbox->closed) {
+        pthread_mutex_unlock(&(outbox->mutex));
+        return -1;
+    }
+    if (replace && kind != OUTBOX_PLAIN) {
+        outbox_supersede(outbox, kind);
+    }
+    Entry* entry = g_new0(Entry, 1);
+    entry->kind = kind;
+    for (int i = 0; i < count && entry->count < OUTBOX_PARTS; i++) {
+        gsize size = g_bytes_get_size(parts[i]);
+        if (size > 0) {
+            entry->parts[entry->count++] = g_bytes_ref(parts[i]);
+            entry->size += size;
+        }
+    }
+    if (entry->count == 0) {
+        g_free(entry);
+        pthread_mutex_unlock(&(outbox->mutex));
+        return 0;
+    }
+    g_queue_push_tail(&(outbox->entries), entry);
+    outbox->bytes += entry->size;
+    __atomic_add_fetch(&(outbox->queued), entry->size, __ATOMIC_RELAXED);
+    int ok = 0;
+    if (!outbox->flushing) {
+        int left = outbox_write(outbox);
+        if (left < 0) {
+            outbox->closed = true;
+            outbox_drop(outbox);
+            ok = -1;
+        } else if (left > 0) {
+            outbox->flushing = true;
+            if (outbox->watch) outbox->watch(outbox->watch_ctx, true);
+            if (!outbox->listed) {
+                outbox->listed = true;
+                outbox_ref(outbox);
+                pthread_mutex_lock(&flusher_mutex);
+                handed = g_list_prepend(handed, outbox);
+                pthread_mutex_unlock(&flusher_mutex);
+                flusher_wake();
+            }
+        }
+    }
+    if (ok == 0 && outbox->bytes > high_watermark) {
+        if (outbox->bytes > high_watermark * OUTBOX_HARD) {
+            outbox_evict(outbox, "backlog over the hard limit");
+            ok = -1;
+        } else if (!outbox->congested_since) {
+            outbox->congested_since = g_get_monotonic_time();
+        }
+    }
+    bool wake = outbox->closed && outbox->listed;
+    pthread_mutex_unlock(&(outbox->mutex));
+    if (wake) flusher_wake(); // lets go of an evicted outbox right away
+    return ok;
+}
+
+bool outbox_congested(Outbox* outbox) {
+    pthread_mutex_lock(&(outbox->mutex));
+    bool congested = outbox->congested_since != 0;
+    pthread_mutex_unlock(&(outbox->mutex));
+    return congested;
+}
+
+guint64 outbox_queued(Outbox* outbox) {
+    return __atomic_load_n(&(outbox->queued), __ATOMIC_RELAXED);
+}
+
+void outbox_stats(OutboxStats* stats) {
+    stats->evictions = __atomic_load_n(&evictions, __ATOMIC_RELAXED);
+    stats->superseded = __atomic_load_n(&superseded, __ATOMIC_RELAXED);
+}
+
+void outbox_close(Outbox* outbox) {
+    pthread_mutex_lock(&(outbox->mutex));
+    outbox->closed = true;
+    outbox_drop(outbox);
+    bool listed = outbox->listed;
+    pthread_mutex_unlock(&(outbox->mutex));
+    if (listed) flusher_wake(); // lets go of it without waiting for the socket
+}
+
+void outbox_unref(Outbox* outbox) {
+    if (!g_atomic_int_dec_and_test(&(outbox->refs))) {
+        return;
+    }
+    outbox_drop(outbox);
+    pthread_mutex_destroy(&(outbox->mutex));
+    g_free(outbox);
+}
@@ -0,0 +1,68 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stdbool.h>
+#include <glib-2.0/glib.h>
+
+// Outbound queue of one socket. Senders queue refcounted buffers, so one
+// payload queued to many sockets is never copied, and a push writes whatever
+// the socket takes right away with a single gather sendmsg, without blocking.
+// What does not fit waits for the flusher thread, which polls the sockets of
+// slow readers and writes their backlog once they drain, so a slow reader
+// never holds up the thread that sent to it. A socket owned by an event loop
+// is watched by the loop instead (outbox_watch); the flusher then only times
+// how long its backlog lasts.
+//
+// The backlog is bounded. Past the high watermark the outbox is congested until
+// it drains under the low one; a socket that stays congested for slow_ms, or
+// whose backlog grows past four times the high watermark, is evicted: the
+// backlog is dropped and the socket shut down. Messages of a kind that only
+// carries the latest state replace their unsent predecessors.
+
+#define OUTBOX_PARTS 3 // buffers in one message
+
+#define OUTBOX_PLAIN 0 // messages that never replace each other
+
+typedef struct Outbox Outbox;
+
+typedef struct {
+    unsigned long evictions;
+    unsigned long superseded; // messages dropped for a newer one of their kind
+} OutboxStats;
+
+// Returns 0 once the flusher runs.
+int outbox_start(int high_kb, int low_kb, int slow_ms);
+
+Outbox* outbox_new(int socket);
+
+// Asks watch(ctx, true) for a call to outbox_flush once the socket can take
+// more bytes, and watch(ctx, false) when the backlog is out. Both are called
+// with the outbox locked, so they never race, and never after outbox_close.
+// Set before the first push.
+typedef void (*outbox_watch_fn)(void* ctx, bool want);
+void outbox_watch(Outbox* outbox, outbox_watch_fn watch, void* ctx);
+
+// Writes the backlog of a watched outbox, from the loop that watches its socket
+void outbox_flush(Outbox* outbox);
+
+// Queues the parts back to back as one message, holding a reference to each.
+// With replace set, the unsent messages of the same kind are dropped first.
+// Returns -1 when the outbox is closed, the socket failed or was evicted.
+int outbox_push(Outbox* outbox, GBytes* const* parts, int count, int kind, bool replace);
+
+// True while the backlog is over the watermarks
+bool outbox_congested(Outbox* outbox);
+
+// Bytes queued so far, less the ones superseded before they went out. The
+// socket gets them all unless the outbox is closed or evicted.
+guint64 outbox_queued(Outbox* outbox);
+
+void outbox_stats(OutboxStats* stats);
+
+// Drops the backlog; nothing is written to the socket after this, so it can be
+// closed and its number reused.
+void outbox_close(Outbox* outbox);
+
+void outbox_unref(Outbox* outbox);
+
+#endif
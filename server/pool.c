@@ -0,0 +1,104 @@
+#include <string.h>
+#include <pthread.h>
+#include <glib-2.0/glib.h>
+#include "pool.h"
+
+#define SLOT_ALIGN 16
+
+// In front of every object; 16 bytes, so objects keep malloc's alignment
+typedef struct {
+    guint32 index;
+    guint32 generation;
+    guint32 next_free; // index + 1 of the next free slot, while free
+    guint32 unused;
+} SlotHeader;
+
+struct Pool {
+    pthread_mutex_t lock;
+    gsize slot_size; // header and object
+    int slab_slots;
+    GPtrArray* slabs;
+    guint32 free_head; // index + 1 of the last freed slot, 0 for none
+    gsize live;
+};
+
+Pool* pool_new(gsize object_size, int slab_slots) {
+    Pool* pool = g_new0(Pool, 1);
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->slot_size = sizeof(SlotHeader) + (object_size + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN;
+    pool->slab_slots = MAX(slab_slots, 1);
+    pool->slabs = g_ptr_array_new();
+    return pool;
+}
+
+// Call with the lock held
+static SlotHeader* slot_at(Pool* pool, guint32 index) {
+    char* slab = pool->slabs->pdata[index / pool->slab_slots];
+    return (SlotHeader*) (slab + (gsize) (index % pool->slab_slots) * pool->slot_size);
+}
+
+// Call with the lock held. The slots are chained in order, so a new slab
+// fills from its start.
+static void slab_add(Pool* pool) {
+    guint32 first = pool->slabs->len * pool->slab_slots;
+    char* slab = g_malloc0(pool->slot_size * pool->slab_slots);
+    g_ptr_array_add(pool->slabs, slab);
+    for (int i = pool->slab_slots - 1; i >= 0; i--) {
+        SlotHeader* slot = (SlotHeader*) (slab + (gsize) i * pool->slot_size);
+        slot->index = first + i;
+        slot->next_free = pool->free_head;
+        pool->free_head = first + i + 1;
+    }
+}
+
+void* pool_alloc(Pool* pool, Handle* handle) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_head == 0) slab_add(pool);
+    // the last freed slot first, it is the likeliest to be in cache
+    SlotHeader* slot = slot_at(pool, pool->free_head - 1);
+    pool->free_head = slot->next_free;
+    slot->generation++;
+    pool->live++;
+    if (handle) *handle = ((Handle) slot->generation << 32) | slot->index;
+    pthread_mutex_unlock(&pool->lock);
+    memset(slot + 1, 0, pool->slot_size - sizeof(SlotHeader));
+    return slot + 1;
+}
+
+void pool_free(Pool* pool, void* object) {
+    SlotHeader* slot = (SlotHeader*) object - 1;
+    pthread_mutex_lock(&pool->lock);
+    slot->generation++; // even, handles to the object stop resolving
+    slot->next_free = pool->free_head;
+    pool->free_head = slot->index + 1;
+    pool->live--;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+Handle pool_handle(const void* object) {
+    const SlotHeader* slot = (const SlotHeader*) object - 1;
+    return ((Handle) slot->generation << 32) | slot->index;
+}
+
+void* pool_ref(Pool* pool, Handle handle, pool_ref_fn ref) {
+    guint32 index = (guint32) handle;
+    guint32 generation = (guint32) (handle >> 32);
+    void* object = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (generation % 2 == 1 && index < (gsize) pool->slabs->len * pool->slab_slots) {
+        SlotHeader* slot = slot_at(pool, index);
+        if (slot->generation == generation && ref(slot + 1)) {
+            object = slot + 1;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return object;
+}
+
+void pool_stats(Pool* pool, PoolStats* stats) {
+    pthread_mutex_lock(&pool->lock);
+    stats->live = pool->live;
+    stats->slots = (gsize) pool->slabs->len * pool->slab_slots;
+    stats->bytes = stats->slots * pool->slot_size;
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,45 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+#include <glib-2.0/glib.h>
+
+// Fixed-size objects carved out of slabs and recycled through a free list, so
+// objects of one kind sit next to each other and never go back to malloc.
+// Every slot carries a generation, odd while the slot is in use and bumped on
+// every alloc and free, and objects are named by a Handle of the slot index
+// and that generation. A handle outliving its object no longer resolves,
+// where a kept pointer would reach whatever took the slot next.
+
+typedef guint64 Handle; // generation in the high 32 bits, slot index in the low ones
+#define HANDLE_NONE 0    // never handed out, the generation of a live slot is odd
+
+typedef struct Pool Pool;
+
+// Takes a reference to an object, unless it is already on its way to pool_free.
+typedef bool (*pool_ref_fn)(void* object);
+
+// slab_slots objects are allocated at a time
+Pool* pool_new(gsize object_size, int slab_slots);
+
+// A zeroed object and its handle
+void* pool_alloc(Pool* pool, Handle* handle);
+
+void pool_free(Pool* pool, void* object);
+
+Handle pool_handle(const void* object);
+
+// Returns the object of handle with a reference taken by ref, or NULL once it
+// was freed or ref refused. The generation check and ref run under the pool
+// lock, so the slot cannot be freed and reused in between.
+void* pool_ref(Pool* pool, Handle handle, pool_ref_fn ref);
+
+typedef struct {
+    gsize live;  // objects allocated
+    gsize slots; // in all slabs
+    gsize bytes; // of all slabs
+} PoolStats;
+
+void pool_stats(Pool* pool, PoolStats* stats);
+
+#endif
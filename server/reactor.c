@@ -0,0 +1,146 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <glib-2.0/glib.h>
+#include "reactor.h"
+#include "logger.h"
+
+#define MAX_EVENTS 256
+#define READ_BUFFER 1024
+
+typedef struct {
+    int id;
+    int epoll_fd;
+    int server_fd;
+    const ReactorCallbacks* callbacks;
+} Reactor;
+
+struct ReactorConn {
+    int socket;
+    Reactor* reactor;
+    void* data;
+};
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void reactor_accept(Reactor* r) {
+    while (1) {
+        int socket = accept4(r->server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (socket < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_WARN("reactor.accept_failed", NULL, NULL, "Accept failed: %s", g_strerror(errno));
+            }
+            return;
+        }
+        ReactorConn* rc = malloc(sizeof(ReactorConn));
+        rc->socket = socket;
+        rc->reactor = r;
+        rc->data = r->callbacks->on_accept(socket, rc);
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = rc;
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, socket, &ev) < 0) {
+            LOG_WARN("reactor.register_failed", NULL, NULL, "epoll_ctl failed: %s", g_strerror(errno));
+            r->callbacks->on_close(rc->data);
+            free(rc);
+        }
+    }
+}
+
+void reactor_want_write(ReactorConn* rc, bool want) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (want ? EPOLLOUT : 0);
+    ev.data.ptr = rc;
+    // fails harmlessly between reactor_close taking the socket out and the close callback
+    epoll_ctl(rc->reactor->epoll_fd, EPOLL_CTL_MOD, rc->socket, &ev);
+}
+
+static void reactor_close(Reactor* r, ReactorConn* rc) {
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, rc->socket, NULL);
+    r->callbacks->on_close(rc->data);
+    free(rc);
+}
+
+// Level triggered: one read per wakeup keeps a busy client from starving the
+// others on the same reactor, leftover bytes wake us up again.
+static void reactor_read(Reactor* r, ReactorConn* rc) {
+    char buffer[READ_BUFFER];
+    int bytes = recv(rc->socket, buffer, sizeof(buffer) - 1, 0);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (bytes <= 0 || !r->callbacks->on_read(rc->data, buffer, bytes)) {
+        reactor_close(r, rc);
+    }
+}
+
+static void* reactor_loop(void* arg) {
+    Reactor* r = (Reactor*) arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(r->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERROR("reactor.wait_failed", NULL, NULL, "epoll_wait failed: %s", g_strerror(errno));
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                reactor_accept(r);
+                continue;
+            }
+            ReactorConn* rc = (ReactorConn*) events[i].data.ptr;
+            if (events[i].events & EPOLLOUT) {
+                r->callbacks->on_write(rc->data);
+            }
+            // input, hangups and errors all go through a read, which closes on failure
+            if (events[i].events & ~EPOLLOUT) {
+                reactor_read(r, rc);
+            }
+        }
+    }
+    return NULL;
+}
+
+int reactor_run(int server_fd, int threads, const ReactorCallbacks* callbacks) {
+    if (set_nonblocking(server_fd) < 0) return 1;
+    Reactor* reactors = calloc(threads, sizeof(Reactor));
+    pthread_t* tids = calloc(threads, sizeof(pthread_t));
+    for (int i = 0; i < threads; i++) {
+        Reactor* r = &reactors[i];
+        r->id = i;
+        r->server_fd = server_fd;
+        r->callbacks = callbacks;
+        r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (r->epoll_fd < 0) {
+            perror("[FATAL] epoll_create1 failed");
+            return 1;
+        }
+        // EPOLLEXCLUSIVE wakes a single reactor per incoming connection
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+            perror("[FATAL] epoll_ctl on server socket failed");
+            return 1;
+        }
+        pthread_create(&tids[i], NULL, reactor_loop, r);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+    free(reactors);
+    return 0;
+}
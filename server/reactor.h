@@ -0,0 +1,38 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdbool.h>
+
+// Event loop alternative to one thread per client: a few reactor threads,
+// each with its own epoll set, share the listening socket and own the
+// connections they accept, so a connection is never served by two threads.
+
+typedef struct ReactorConn ReactorConn;
+
+// Called on the reactor thread that accepted the socket (already non-blocking),
+// with the handle reactor_want_write takes; returns the per-connection state
+// passed to the other callbacks.
+typedef void* (*reactor_accept_fn)(int socket, ReactorConn* handle);
+// Called with the bytes of one read, return false to close the connection.
+typedef bool (*reactor_read_fn)(void* conn, char* buffer, int bytes);
+// Called while the connection wants to write and its socket can take more bytes.
+typedef void (*reactor_write_fn)(void* conn);
+// Called once the peer is gone; the callback owns closing the socket.
+typedef void (*reactor_close_fn)(void* conn);
+
+typedef struct {
+    reactor_accept_fn on_accept;
+    reactor_read_fn on_read;
+    reactor_write_fn on_write;
+    reactor_close_fn on_close;
+} ReactorCallbacks;
+
+// Runs the reactor threads on server_fd and blocks until they exit.
+int reactor_run(int server_fd, int threads, const ReactorCallbacks* callbacks);
+
+// Arms or disarms EPOLLOUT for the connection, so a full socket is waited for
+// by its reactor instead of by the sender. Callable from any thread until the
+// close callback of the connection returns; calls must not race each other.
+void reactor_want_write(ReactorConn* handle, bool want);
+
+#endif
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <glib-2.0/glib.h>
+#include "registry.h"
+
+typedef struct {
+    pthread_rwlock_t lock;
+    GHashTable* entries; // key -> value
+} RegistryShard;
+
+struct Registry {
+    RegistryShard* shards;
+    int shard_count;
+    int capacity;
+    int size;
+    GHashFunc hash;
+    registry_ref_fn ref;
+    registry_release_fn release;
+};
+
+Registry* registry_new(int shards, int capacity, GHashFunc hash, GEqualFunc equal,
+                       registry_ref_fn ref, registry_release_fn release) {
+    if (shards < 1) shards = 1;
+    Registry* registry = g_new0(Registry, 1);
+    registry->shards = g_new0(RegistryShard, shards);
+    for (int i = 0; i < shards; i++) {
+        pthread_rwlock_init(&registry->shards[i].lock, NULL);
+        registry->shards[i].entries = g_hash_table_new(hash, equal);
+    }
+    registry->shard_count = shards;
+    registry->capacity = capacity;
+    registry->hash = hash;
+    registry->ref = ref;
+    registry->release = release;
+    return registry;
+}
+
+static RegistryShard* shard_for(Registry* registry, const void* key) {
+    return &registry->shards[registry->hash(key) % registry->shard_count];
+}
+
+bool registry_insert(Registry* registry, const void* key, void* value) {
+    // reserve the slot first so concurrent inserts cannot overshoot the capacity
+    if (g_atomic_int_add(&registry->size, 1) >= registry->capacity) {
+        g_atomic_int_add(&registry->size, -1);
+        return false;
+    }
+    RegistryShard* shard = shard_for(registry, key);
+    pthread_rwlock_wrlock(&shard->lock);
+    bool inserted = !g_hash_table_contains(shard->entries, key);
+    if (inserted) {
+        g_hash_table_insert(shard->entries, (gpointer) key, value);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    if (!inserted) {
+        g_atomic_int_add(&registry->size, -1);
+    }
+    return inserted;
+}
+
+void* registry_lookup(Registry* registry, const void* key) {
+    RegistryShard* shard = shard_for(registry, key);
+    pthread_rwlock_rdlock(&shard->lock);
+    void* value = g_hash_table_lookup(shard->entries, key);
+    if (value) {
+        // taken under the lock, so a concurrent remove cannot free it first
+        registry->ref(value);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return value;
+}
+
+bool registry_remove(Registry* registry, const void* key) {
+    RegistryShard* shard = shard_for(registry, key);
+    pthread_rwlock_wrlock(&shard->lock);
+    void* value = g_hash_table_lookup(shard->entries, key);
+    if (value) {
+        g_hash_table_remove(shard->entries, key);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    if (!value) {
+        return false;
+    }
+    g_atomic_int_add(&registry->size, -1);
+    registry->release(value);
+    return true;
+}
+
+int registry_size(Registry* registry) {
+    return g_atomic_int_get(&registry->size);
+}
+
+void registry_foreach(Registry* registry, registry_foreach_fn fn, void* userdata) {
+    for (int i = 0; i < registry->shard_count; i++) {
+        RegistryShard* shard = &registry->shards[i];
+        GHashTableIter iter;
+        gpointer key, value;
+        pthread_rwlock_rdlock(&shard->lock);
+        g_hash_table_iter_init(&iter, shard->entries);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            fn(key, value, userdata);
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdbool.h>
+#include <glib-2.0/glib.h>
+
+// Table of refcounted objects spread over shards, each guarded by its own
+// rwlock: lookups and listings on different shards never contend and readers
+// of one shard run in parallel, only inserts and removals take a shard
+// exclusively. The table owns one reference to every value. Keys are not
+// copied: the key of a value is part of it, its id, and lives as long as it.
+
+typedef struct Registry Registry;
+
+typedef void* (*registry_ref_fn)(void* value);
+typedef void (*registry_release_fn)(void* value); // drops the table reference
+typedef void (*registry_foreach_fn)(const void* key, void* value, void* userdata);
+
+Registry* registry_new(int shards, int capacity, GHashFunc hash, GEqualFunc equal,
+                       registry_ref_fn ref, registry_release_fn release);
+
+// Takes over the caller's reference; false (nothing taken) when full or the key exists.
+bool registry_insert(Registry* registry, const void* key, void* value);
+
+// Returns a new reference to the value, or NULL.
+void* registry_lookup(Registry* registry, const void* key);
+
+// Drops the table reference, false when the key is missing.
+bool registry_remove(Registry* registry, const void* key);
+
+int registry_size(Registry* registry);
+
+// Visits every value with its shard read-locked; fn must not modify the registry.
+void registry_foreach(Registry* registry, registry_foreach_fn fn, void* userdata);
+
+#endif
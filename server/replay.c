@@ -0,0 +1,473 @@
+// Replays a trace recorded with TRACE_FILE against a running server. Every
+// recorded connection is opened again by a thread of its own and sends the same
+// bytes. Inputs keep the order the server read them in: one goes out once all
+// the inputs recorded before it are out, and once its connection received as
+// many bytes as the server had sent it when the input was recorded, so the
+// client has seen the same answers and broadcasts it was reacting to. When
+// those do not come within -a ms the run has diverged; the input goes anyway
+// and the shortfall is forgiven for the rest of the connection. Between two
+// inputs the replay waits the recorded gap, scaled by -s, so a replay falling
+// behind slips instead of bunching up. With -s 0 it does not wait at all, which
+// can outrun work the server finishes asynchronously, a join seen by another
+// connection for one, and diverge where the recording did not. Lobby ids in
+// the input are rewritten to the ids the new run hands out, so joins find their
+// lobbies, in the text protocols and in binary (version 3) joins. Translations are answered by `mock_translate.out -t trace`, which the
+// server's TRANSLATOR_URL points to. The server should start from a copy of the
+// users.db the trace was recorded with, or the recorded logins fail.
+// Usage: ./replay.out [-h host] [-p port] [-s speed] [-a output wait ms]
+//                     [-w lobby wait ms] [-P server pid] trace
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <uuid/uuid.h>
+#include <glib-2.0/glib.h>
+#include "trace.h"
+
+#define UUID_LEN 36
+#define SCAN_KEEP (UUID_LEN + 4) // bytes kept between reads to find an "A00\n<id>" cut in two
+
+// Binary headers, a u16 code and a u32 length, of an A00 and of a join, each
+// followed by the 16 raw bytes of a lobby id
+static const char binary_created[] = {'A', 0, 0, 0, 0, sizeof(uuid_t)};
+static const char binary_join[] = {0, 101, 0, 0, 0, sizeof(uuid_t)};
+
+typedef struct {
+    TraceRecord record;
+    guint seq; // place among the inputs and closes of every connection
+} ReplayInput;
+
+typedef struct {
+    guint32 id;
+    GArray* records; // of ReplayInput, its open, inputs and close
+    GQueue lobbies;  // recorded ids of the lobbies it created, in order
+    int fd;
+    int wake_fd;     // eventfd, signalled when its next input may be next in line
+    gint64 sent_at;  // monotonic time of the last input still waiting for an answer, 0 if none
+    guint32 received; // bytes received, plus the shortfalls forgiven; compared modulo 2^32
+    guint32 expected; // what the server had sent when the next input was recorded
+    char scan[SCAN_KEEP + 4096];
+    int scan_len;
+} ReplayConn;
+
+static struct {
+    const char* host;
+    int port;
+    double speed;
+    int output_wait_ms;
+    int lobby_wait_ms;
+    int server_pid;
+} config = {"127.0.0.1", 8080, 1.0, 1000, 5000, 0};
+
+static gint64 recorded_start;
+static gint64 replay_start;
+static GHashTable* lobby_ids = NULL; // recorded id -> id in this run, "" until known
+static pthread_mutex_t lobby_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lobby_cond; // on the monotonic clock
+static int running = 0;
+
+static ReplayConn** owners = NULL; // seq -> connection
+static bool* done = NULL;          // seq -> sent, or given up with its connection
+static guint next_seq = 0;         // the first seq not done
+static guint seq_count = 0;
+static gint64* seq_times = NULL;   // seq -> recorded time
+static gint64 last_done_at = 0;    // when the input before next_seq went out
+static pthread_mutex_t order_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    unsigned long connections;
+    unsigned long failed;
+    unsigned long inputs;
+    unsigned long diverged; // inputs sent without the output the recorded client had seen
+    unsigned long bytes_sent;
+    unsigned long bytes_received;
+    unsigned long lobbies_mapped;
+    unsigned long lobbies_missed;
+    GArray* latencies; // of gint64 microseconds, from an input to the first bytes back
+} stats;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* ** OUTPUT ** */
+
+// Pairs every "A00\n<id>", or binary A00, the server sends with the next lobby
+// the trace says this connection created.
+static void scan_lobbies(ReplayConn* c, const char* data, int len) {
+    len = MIN(len, (int) sizeof(c->scan) - c->scan_len);
+    memcpy(c->scan + c->scan_len, data, len);
+    c->scan_len += len;
+    int consumed = 0;
+    for (int i = 0; i + (int) sizeof(binary_created) + (int) sizeof(uuid_t) <= c->scan_len; i++) {
+        char id[UUID_LEN + 1];
+        if (i + 4 + UUID_LEN <= c->scan_len && memcmp(c->scan + i, "A00\n", 4) == 0) {
+            memcpy(id, c->scan + i + 4, UUID_LEN);
+            id[UUID_LEN] = '\0';
+            consumed = i + 4 + UUID_LEN;
+        } else if (memcmp(c->scan + i, binary_created, sizeof(binary_created)) == 0) {
+            uuid_unparse((const unsigned char*) c->scan + i + sizeof(binary_created), id);
+            consumed = i + sizeof(binary_created) + sizeof(uuid_t);
+        } else {
+            continue;
+        }
+        char* recorded = g_queue_pop_head(&c->lobbies);
+        if (recorded) {
+            pthread_mutex_lock(&lobby_mutex);
+            g_hash_table_replace(lobby_ids, recorded, g_strdup(id));
+            pthread_cond_broadcast(&lobby_cond);
+            pthread_mutex_unlock(&lobby_mutex);
+            __atomic_add_fetch(&stats.lobbies_mapped, 1, __ATOMIC_RELAXED);
+        }
+        i = consumed - 1;
+    }
+    // the tail may hold the start of either form; what was matched is not kept
+    int keep = CLAMP(c->scan_len - consumed, 0, SCAN_KEEP);
+    memmove(c->scan, c->scan + c->scan_len - keep, keep);
+    c->scan_len = keep;
+}
+
+typedef bool (*WaitDone)(ReplayConn* c, guint seq);
+
+static bool wait_never(ReplayConn* c, guint seq) {
+    return false;
+}
+
+static bool wait_seen(ReplayConn* c, guint seq) {
+    return (gint32) (c->received - c->expected) >= 0;
+}
+
+static bool wait_turn(ReplayConn* c, guint seq) {
+    return __atomic_load_n(&next_seq, __ATOMIC_ACQUIRE) >= seq;
+}
+
+// Reads whatever the server sends until finished says so or the deadline passes,
+// G_MAXINT64 for none. Returns false once the server hung up.
+static bool conn_wait(ReplayConn* c, gint64 deadline, WaitDone finished, guint seq) {
+    char buffer[4096];
+    while (!finished(c, seq)) {
+        gint64 left = deadline == G_MAXINT64 ? -1 : MAX(deadline - g_get_monotonic_time(), 0);
+        struct pollfd pfds[2] = {{c->fd, POLLIN, 0}, {c->wake_fd, POLLIN, 0}};
+        int ready = poll(pfds, 2, left < 0 ? -1 : (int) ((left + 999) / 1000));
+        if (ready <= 0) return true;
+        if (pfds[1].revents & POLLIN) {
+            eventfd_t wakeups;
+            eventfd_read(c->wake_fd, &wakeups);
+        }
+        if (!(pfds[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        ssize_t bytes = recv(c->fd, buffer, sizeof(buffer), 0);
+        if (bytes <= 0) return false;
+        pthread_mutex_lock(&stats_mutex);
+        if (c->sent_at) {
+            gint64 latency = g_get_monotonic_time() - c->sent_at;
+            g_array_append_val(stats.latencies, latency);
+        }
+        stats.bytes_received += bytes;
+        pthread_mutex_unlock(&stats_mutex);
+        c->sent_at = 0;
+        c->received += bytes;
+        scan_lobbies(c, buffer, bytes);
+    }
+    return true;
+}
+
+// Marks seq done and wakes the connection whose input is next in line
+static void order_done(guint seq) {
+    pthread_mutex_lock(&order_mutex);
+    done[seq] = true;
+    guint next = next_seq;
+    while (next < seq_count && done[next]) next++;
+    if (next != next_seq) last_done_at = g_get_monotonic_time();
+    __atomic_store_n(&next_seq, next, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&order_mutex);
+    if (next < seq_count) eventfd_write(owners[next]->wake_fd, 1);
+}
+
+/* ** INPUT ** */
+
+static bool is_uuid(const char* s) {
+    for (int i = 0; i < UUID_LEN; i++) {
+        bool dash = i == 8 || i == 13 || i == 18 || i == 23;
+        if (dash ? s[i] != '-' : !g_ascii_isxdigit(s[i])) return false;
+    }
+    return true;
+}
+
+// The id of this run for a recorded one, into current, waiting for the create
+// that hands it out to be answered. False for an id the trace never handed out
+// or one that did not come in time.
+static bool lobby_current(const char* recorded, char* current) {
+    gint64 deadline = g_get_monotonic_time() + config.lobby_wait_ms * 1000L;
+    struct timespec until = {deadline / G_USEC_PER_SEC, (deadline % G_USEC_PER_SEC) * 1000};
+    pthread_mutex_lock(&lobby_mutex);
+    const char* mapped;
+    while ((mapped = g_hash_table_lookup(lobby_ids, recorded)) && mapped[0] == '\0') {
+        if (pthread_cond_timedwait(&lobby_cond, &lobby_mutex, &until) != 0) break;
+    }
+    bool found = mapped && mapped[0] != '\0';
+    if (found) {
+        memcpy(current, mapped, UUID_LEN + 1);
+    } else if (mapped) {
+        __atomic_add_fetch(&stats.lobbies_missed, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&lobby_mutex);
+    return found;
+}
+
+// Swaps the recorded lobby ids in data for the ones of this run. Ids have the
+// same length, so frame headers stay valid.
+static void rewrite_lobbies(char* data, int len) {
+    char recorded[UUID_LEN + 1], current[UUID_LEN + 1];
+    for (int i = 0; i + UUID_LEN <= len; i++) {
+        if (!is_uuid(data + i)) continue;
+        memcpy(recorded, data + i, UUID_LEN);
+        recorded[UUID_LEN] = '\0';
+        if (lobby_current(recorded, current)) memcpy(data + i, current, UUID_LEN);
+        i += UUID_LEN - 1;
+    }
+    for (int i = 0; i + (int) sizeof(binary_join) + (int) sizeof(uuid_t) <= len; i++) {
+        if (memcmp(data + i, binary_join, sizeof(binary_join)) != 0) continue;
+        unsigned char* raw = (unsigned char*) data + i + sizeof(binary_join);
+        uuid_unparse(raw, recorded);
+        if (lobby_current(recorded, current)) uuid_parse(current, raw);
+        i += sizeof(binary_join) + sizeof(uuid_t) - 1;
+    }
+}
+
+// Call once seq is next in line
+static gint64 due_time(guint seq) {
+    if (config.speed <= 0 || seq == 0) return 0;
+    pthread_mutex_lock(&order_mutex);
+    gint64 after = last_done_at;
+    pthread_mutex_unlock(&order_mutex);
+    return after + (gint64) ((seq_times[seq] - seq_times[seq - 1]) / config.speed);
+}
+
+static bool conn_connect(ReplayConn* c) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    inet_pton(AF_INET, config.host, &addr.sin_addr);
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0) return false;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(c->fd);
+        return false;
+    }
+    return true;
+}
+
+static void* conn_run(void* arg) {
+    ReplayConn* c = (ReplayConn*) arg;
+    bool connected = conn_connect(c);
+    __atomic_add_fetch(connected ? &stats.connections : &stats.failed, 1, __ATOMIC_RELAXED);
+    guint i = 1;
+    for (; connected && i < c->records->len; i++) {
+        ReplayInput* input = &g_array_index(c->records, ReplayInput, i);
+        TraceRecord* r = &input->record;
+        // keeps reading while it waits, a connection that stops reading gets evicted
+        c->expected = r->header.aux;
+        if (!conn_wait(c, g_get_monotonic_time() + config.output_wait_ms * 1000L, wait_seen, 0)) break;
+        if (!wait_seen(c, 0)) {
+            c->received = c->expected;
+            __atomic_add_fetch(&stats.diverged, 1, __ATOMIC_RELAXED);
+        }
+        if (!conn_wait(c, G_MAXINT64, wait_turn, input->seq)) break;
+        if (!conn_wait(c, due_time(input->seq), wait_never, 0)) break;
+        if (r->header.type == TRACE_CLOSE) {
+            shutdown(c->fd, SHUT_WR);
+            order_done(input->seq);
+            continue;
+        }
+        rewrite_lobbies(r->data, r->header.len);
+        c->sent_at = g_get_monotonic_time();
+        bool sent = send(c->fd, r->data, r->header.len, MSG_NOSIGNAL) == (ssize_t) r->header.len;
+        order_done(input->seq);
+        if (!sent) {
+            i++;
+            break;
+        }
+        __atomic_add_fetch(&stats.inputs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats.bytes_sent, r->header.len, __ATOMIC_RELAXED);
+    }
+    // what a lost connection never sent must not hold up the others
+    for (; i < c->records->len; i++) {
+        order_done(g_array_index(c->records, ReplayInput, i).seq);
+    }
+    if (connected) {
+        // after a close the server hangs up right away, otherwise the last answers get their wait
+        conn_wait(c, g_get_monotonic_time() + config.output_wait_ms * 1000L, wait_never, 0);
+        close(c->fd);
+    }
+    for (i = 0; i < c->records->len; i++) {
+        g_free(g_array_index(c->records, ReplayInput, i).record.data);
+    }
+    g_array_free(c->records, TRUE);
+    g_queue_clear_full(&c->lobbies, g_free);
+    close(c->wake_fd);
+    g_free(c);
+    __atomic_sub_fetch(&running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* ** REPORT ** */
+
+static double server_cpu_seconds(void) {
+    if (!config.server_pid) return 0;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", config.server_pid);
+    char* contents = NULL;
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) return 0;
+    // utime and stime are fields 14 and 15, counted after the ")" closing the name
+    const char* rest = strrchr(contents, ')');
+    unsigned long utime = 0, stime = 0;
+    if (rest) sscanf(rest + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    g_free(contents);
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static gint compare_samples(gconstpointer a, gconstpointer b) {
+    gint64 x = *(const gint64*) a, y = *(const gint64*) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(GArray* sorted, double p) {
+    if (sorted->len == 0) return 0;
+    guint i = (guint) ceil(p * sorted->len) - 1;
+    if (i >= sorted->len) i = sorted->len - 1;
+    return g_array_index(sorted, gint64, i) / 1000.0;
+}
+
+static void report(double seconds, double recorded_seconds, double cpu_seconds) {
+    printf("%lu connections (%lu failed), %lu inputs (%lu diverged) in %.2fs, recorded in %.2fs\n",
+           stats.connections, stats.failed, stats.inputs, stats.diverged, seconds, recorded_seconds);
+    printf("%lu bytes sent, %lu received, %lu lobby ids mapped, %lu not handed out in time\n",
+           stats.bytes_sent, stats.bytes_received, stats.lobbies_mapped, stats.lobbies_missed);
+    if (config.server_pid) {
+        printf("server cpu %.2fs (%.0f%% of one core)\n", cpu_seconds, 100.0 * cpu_seconds / seconds);
+    }
+    g_array_sort(stats.latencies, compare_samples);
+    printf("%-9s %8s %9s %9s %9s %9s\n", "", "count", "p50 ms", "p99 ms", "p999 ms", "max ms");
+    printf("%-9s %8u %9.2f %9.2f %9.2f %9.2f\n", "response", stats.latencies->len,
+           percentile_ms(stats.latencies, 0.50), percentile_ms(stats.latencies, 0.99),
+           percentile_ms(stats.latencies, 0.999), percentile_ms(stats.latencies, 1.0));
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    bool usage = false;
+    while ((opt = getopt(argc, argv, "h:p:s:a:w:P:")) != -1) {
+        switch (opt) {
+            case 'h': config.host = optarg; break;
+            case 'p': config.port = atoi(optarg); break;
+            case 's': config.speed = atof(optarg); break;
+            case 'a': config.output_wait_ms = atoi(optarg); break;
+            case 'w': config.lobby_wait_ms = atoi(optarg); break;
+            case 'P': config.server_pid = atoi(optarg); break;
+            default: usage = true;
+        }
+    }
+    if (usage || optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-h host] [-p port] [-s speed] [-a output wait ms] "
+                        "[-w lobby wait ms] [-P server pid] trace\n", argv[0]);
+        return 1;
+    }
+    FILE* in = fopen(argv[optind], "rb");
+    if (!in || !trace_check(in)) {
+        fprintf(stderr, "%s is not a trace\n", argv[optind]);
+        return 1;
+    }
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&lobby_cond, &cond_attr);
+    lobby_ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    stats.latencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+    // the whole trace is read up front, so the replay never waits on the disk
+    GHashTable* by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GPtrArray* conns = g_ptr_array_new(); // in the order they opened
+    GPtrArray* order = g_ptr_array_new();
+    gint64 recorded_end = 0;
+    TraceRecord record;
+    while (trace_read(in, &record)) {
+        ReplayConn* c = g_hash_table_lookup(by_id, GUINT_TO_POINTER(record.header.conn));
+        if (record.header.type == TRACE_OPEN) {
+            c = g_new0(ReplayConn, 1);
+            c->id = record.header.conn;
+            c->records = g_array_new(FALSE, FALSE, sizeof(ReplayInput));
+            c->wake_fd = eventfd(0, EFD_NONBLOCK);
+            g_queue_init(&c->lobbies);
+            g_hash_table_replace(by_id, GUINT_TO_POINTER(c->id), c);
+            g_ptr_array_add(conns, c);
+        }
+        if (c && record.header.type == TRACE_LOBBY) {
+            g_queue_push_tail(&c->lobbies, g_strdup(record.data));
+            g_hash_table_replace(lobby_ids, g_strdup(record.data), g_strdup(""));
+        }
+        if (c && record.header.type != TRACE_LOBBY && record.header.type != TRACE_TRANSLATION) {
+            ReplayInput input = {record, 0};
+            if (record.header.type != TRACE_OPEN) {
+                input.seq = order->len;
+                g_ptr_array_add(order, c);
+            }
+            g_array_append_val(c->records, input);
+            recorded_end = MAX(recorded_end, record.header.time);
+        } else {
+            g_free(record.data);
+        }
+    }
+    fclose(in);
+    g_hash_table_destroy(by_id);
+    if (conns->len == 0) {
+        fprintf(stderr, "the trace holds no connections\n");
+        return 1;
+    }
+    recorded_start = g_array_index(((ReplayConn*) conns->pdata[0])->records, ReplayInput, 0).record.header.time;
+    seq_count = order->len;
+    owners = (ReplayConn**) order->pdata;
+    done = g_new0(bool, seq_count);
+    seq_times = g_new(gint64, seq_count);
+    for (guint i = 0; i < conns->len; i++) {
+        GArray* records = ((ReplayConn*) conns->pdata[i])->records;
+        for (guint j = 1; j < records->len; j++) {
+            ReplayInput* input = &g_array_index(records, ReplayInput, j);
+            seq_times[input->seq] = input->record.header.time;
+        }
+    }
+
+    double cpu_before = server_cpu_seconds();
+    replay_start = g_get_monotonic_time();
+    last_done_at = replay_start;
+    for (guint i = 0; i < conns->len; i++) {
+        ReplayConn* c = conns->pdata[i];
+        // opens keep the recorded pace, the inputs wait their turn anyway
+        gint64 opened = g_array_index(c->records, ReplayInput, 0).record.header.time;
+        gint64 wait = config.speed > 0 ? replay_start + (gint64) ((opened - recorded_start) / config.speed)
+                                         - g_get_monotonic_time() : 0;
+        if (wait > 0) usleep(wait);
+        __atomic_add_fetch(&running, 1, __ATOMIC_RELEASE);
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, conn_run, c) != 0) {
+            fprintf(stderr, "failed to start connection %u\n", c->id);
+            __atomic_sub_fetch(&running, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE) > 0) {
+        usleep(10000);
+    }
+    double seconds = (g_get_monotonic_time() - replay_start) / 1e6;
+    report(seconds, (recorded_end - recorded_start) / 1e6, server_cpu_seconds() - cpu_before);
+    g_ptr_array_free(conns, TRUE);
+    return 0;
+}
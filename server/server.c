@@ -4,18 +4,38 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <pthread.h>
+#include <sys/resource.h>
 #include <arpa/inet.h>
-#include <uuid/uuid.h>
 #include <glib-2.0/glib.h>
-#include <sqlite3.h>
+#include "auth.h"
+#include "db.h"
+#include "lobby_id.h"
+#include "lobby_index.h"
+#include "logger.h"
+#include "matchmaker.h"
+#include "metrics.h"
+#include "outbox.h"
+#include "pool.h"
 #include "translator.h"
+#include "cache.h"
+#include "cache_store.h"
+#include "reactor.h"
+#include "registry.h"
+#include "strand.h"
+#include "trace.h"
+#include "wire.h"
 
 #define PORT 8080
 #define MIN_PLAYERS 4
 #define MAX_PLAYERS 10
+#define MAX_QUEUED 20 // players waiting for a seat in one lobby
 #define MAX_LOBBIES 5
+#define LOBBY_SHARDS 16
 #define MAX_LENGTH 30
+#define MAX_FRAME 1023
+#define MAX_PAGE 50
 
 /* ** PROTOCOL ** */
 
@@ -23,10 +43,22 @@
 #define OP_JOIN_LOBBY 101
 #define OP_GET_LOBBIES 102
 #define OP_LEAVE_LOBBY 103
+#define OP_FIND_LOBBIES 104
+#define OP_SUBSCRIBE_LOBBIES 105
+#define OP_FIND_MATCH 106
 #define OP_START_MATCH 110
 #define OP_SPEAK 111
 #define OP_SIGNUP 201
 #define OP_LOGIN 202
+#define OP_PROTOCOL 300
+
+// Protocol versions, negotiated with "300 <version>" (answered with B00 in the old format):
+// 1 - legacy, every recv is one command and responses are not delimited
+// 2 - framed, every message in both directions is "<length>\n<payload>"
+// 3 - binary, fixed headers and typed payloads, see wire.h and the README
+#define PROTOCOL_LEGACY 1
+#define PROTOCOL_FRAMED 2
+#define PROTOCOL_BINARY 3
 
 // LOBBY CREATED A00
 // LOBBY JOINED A01
@@ -41,9 +73,19 @@
 // YOUR TURN A11
 // MATCH TERMINATED A12
 // WAIT FOR THE OTHERS A13
+// LOBBIES NOT MODIFIED A14
+// LOBBY PAGE A15
+// LOBBIES CHANGED A16
+// MATCHMAKING A17
+// MATCHMAKING LEFT A18
+// PROTOCOL B00
 // SIGNED UP B01
 // LOGGED IN B02
 
+// Outbox kinds of messages that only carry the latest state, see outbox.h
+#define KIND_TURN 1       // A11/A13, superseded by the next turn
+#define KIND_LOBBY_LIST 2 // pushed A05/A16; a pushed A05 supersedes the updates before it
+
 // Z00 SERVER ERROR
 // Z01 BAD REQUEST
 // Z02 CONFLICT
@@ -52,46 +94,66 @@
 const char* translator_url = "http://libretranslate:5000/translate";
 const char* db_path = "users.db";
 
-sqlite3* db = NULL;
-
 typedef struct Lobby Lobby;
 typedef struct Match Match;
+typedef struct Player Player;
 
 typedef struct
 {
-    char id[37];
+    int socket;
+    int protocol; // written by the socket owner only while negotiable
+    bool negotiable; // cleared by the first 300 or auth request, no other thread sends before
+    GByteArray* inbuf; // unparsed bytes of framed requests
+    Player* player; // set once by login_done on an auth worker, read through conn_player
+    Outbox* outbox; // every send to the socket goes through it
+    int refs; // held by the socket owner and by pending auth requests
+    bool closed;
+    bool auth_pending;
+    guint32 trace_id; // 0 unless TRACE_FILE records the traffic
+} Connection;
+
+// Players and lobbies live in slab pools, players_pool and lobbies_pool. A
+// player is named by the handle of its slot, which stops resolving once the
+// player is freed; a lobby by its random id, kept as raw bytes.
+struct Player
+{
+    Handle id;
     char username[32];
     char language[3];
-    int socket;
-    Lobby* lobby;
-    bool isHost;
-    pthread_mutex_t socket_mutex;
-} Player;
+    Connection* conn; // holds a connection reference
+    Lobby* lobby; // seated, queued or on the way in; holds a lobby reference
+    bool gone; // disconnected, no lobby takes them any more
+    pthread_mutex_t mutex; // guards lobby and gone
+    int refs; // the players table, lobbies the player is in and pending lobby requests hold one
+};
 
 struct Lobby
 {
-    char id[37];
+    LobbyId id;
     Player *host;
     int max_players;
-    GList* players;
-    GQueue* queue;
+    Player* seats[MAX_PLAYERS]; // in joining order, the host in seat 0
+    int seated;
+    Player* queue[MAX_QUEUED]; // ring, the oldest at queue_head
+    int queue_head;
+    int queued;
     Match* match;
-    Translator* translator;
-    pthread_mutex_t players_mutex;
+    Strand* strand; // every read and write of the fields above runs on it, one at a time
+    int refs; // the lobbies registry, players bound to it, queued requests and in-progress lookups hold one
+    bool closed;
+    bool matchmade; // created by the matchmaker, which tops it up while it is too small to start
 };
 
-typedef struct {
-    char id[37];
-    char host_username[32];
-    int max_players;
-    int player_count;
-} LobbyDto;
+// The textual id, for logs
+#define LOBBY_NAME(lobby) (lobby_id_text(&(lobby)->id).str)
 
 struct Match {
     int turn;
-    bool clockwise;
+    int round; // bumped at every start, lets late translations spot a restarted match
+    int stride; // 1 clockwise, -1 counter-clockwise
     bool terminated;
-    GSList* word;
+    bool pending; // the translation for the current turn is in flight
+    GSList* word; // phrases of the running or an aborted round, a finished one hands them to its MatchEnd
 };
 
 typedef struct {
@@ -100,74 +162,571 @@ typedef struct {
 } BufferContext;
 
 typedef struct {
-    Player* player_turn;
-    bool terminated;
-    GSList* word;
-} TurnContext;
+    Lobby* lobby;
+    int round;
+} TurnJob;
+
+typedef struct {
+    Lobby* lobby;
+    int round;
+    GSList* word; // owned
+    GHashTable* translations; // target language -> final phrase
+    int remaining;
+} MatchEnd;
+
+typedef struct {
+    MatchEnd* end;
+    char language[3];
+} MatchEndRequest;
+
+Pool* players_pool;
+Pool* lobbies_pool;
+
+/* ** METRICS ** */
+
+// Series ids, registered in metrics_register before any thread records
+const int metered_ops[] = {OP_CREATE_LOBBY, OP_JOIN_LOBBY, OP_GET_LOBBIES, OP_LEAVE_LOBBY, OP_FIND_LOBBIES,
+                           OP_SUBSCRIBE_LOBBIES, OP_FIND_MATCH, OP_START_MATCH, OP_SPEAK, OP_SIGNUP, OP_LOGIN, OP_PROTOCOL};
+int request_metrics[G_N_ELEMENTS(metered_ops) + 1]; // the last one counts unknown requests
+int broadcast_turn_metric, broadcast_story_metric, broadcast_list_metric;
+int players_metric, lobbies_metric, queued_metric, matches_metric;
+int matchmaking_metric, auth_queue_metric, translator_backlog_metric;
+int players_pool_metric, lobbies_pool_metric;
+
+void metrics_register(void) {
+    // logins, signups and words finish on an auth worker or the lobby strand,
+    // their series only time the connection thread's part
+    const char* request_help = "Time to handle a request on its connection thread, "
+                               "up to queueing it for login, signup and speak";
+    char labels[16];
+    for (int i = 0; i < (int) G_N_ELEMENTS(metered_ops); i++) {
+        snprintf(labels, sizeof(labels), "op=\"%d\"", metered_ops[i]);
+        request_metrics[i] = metrics_histogram("telephone_request_duration_seconds", request_help, labels);
+    }
+    request_metrics[G_N_ELEMENTS(metered_ops)] =
+        metrics_histogram("telephone_request_duration_seconds", request_help, "op=\"other\"");
+    const char* broadcast_help = "Time to queue one message to every recipient";
+    broadcast_turn_metric = metrics_histogram("telephone_broadcast_duration_seconds", broadcast_help, "message=\"turn\"");
+    broadcast_story_metric = metrics_histogram("telephone_broadcast_duration_seconds", broadcast_help, "message=\"story\"");
+    broadcast_list_metric = metrics_histogram("telephone_broadcast_duration_seconds", broadcast_help, "message=\"lobby_list\"");
+    players_metric = metrics_gauge("telephone_players", "Players logged in", NULL);
+    lobbies_metric = metrics_gauge("telephone_lobbies", "Open lobbies", NULL);
+    queued_metric = metrics_gauge("telephone_lobby_queued_players", "Players waiting in lobby queues", NULL);
+    matches_metric = metrics_gauge("telephone_matches_running", "Matches in progress", NULL);
+    matchmaking_metric = metrics_gauge("telephone_matchmaking_players", "Players waiting for the matchmaker", NULL);
+    auth_queue_metric = metrics_gauge("telephone_auth_queue", "Logins and signups waiting for an auth worker", NULL);
+    translator_backlog_metric = metrics_gauge("telephone_translator_backlog", "Translations waiting for a connection", NULL);
+    const char* pool_help = "Bytes of the slabs objects are allocated from";
+    players_pool_metric = metrics_gauge("telephone_pool_bytes", pool_help, "pool=\"players\"");
+    lobbies_pool_metric = metrics_gauge("telephone_pool_bytes", pool_help, "pool=\"lobbies\"");
+}
+
+int request_metric(int op) {
+    int i = 0;
+    while (i < (int) G_N_ELEMENTS(metered_ops) && metered_ops[i] != op) i++;
+    return request_metrics[i];
+}
+
+Connection* connection_new(int socket) {
+    Connection* conn = g_new(Connection, 1);
+    conn->socket = socket;
+    conn->protocol = PROTOCOL_LEGACY;
+    conn->negotiable = true;
+    conn->inbuf = g_byte_array_new();
+    conn->player = NULL;
+    conn->outbox = outbox_new(socket);
+    conn->refs = 1;
+    conn->closed = false;
+    conn->auth_pending = false;
+    conn->trace_id = trace_connection();
+    return conn;
+}
+
+Connection* connection_ref(Connection* conn) {
+    __atomic_add_fetch(&(conn->refs), 1, __ATOMIC_RELAXED);
+    return conn;
+}
+
+void connection_unref(Connection* conn) {
+    if (__atomic_sub_fetch(&(conn->refs), 1, __ATOMIC_ACQ_REL) > 0) return;
+    g_byte_array_unref(conn->inbuf);
+    outbox_unref(conn->outbox);
+    g_free(conn);
+}
+
+GBytes* frame_header(gsize len) {
+    char header[16];
+    return g_bytes_new(header, snprintf(header, sizeof(header), "%zu\n", len));
+}
+
+// Queues the parts as one message to the connection's outbox, which writes what
+// the socket takes now and leaves the rest to its flusher, so this never blocks.
+// On framed connections the length header goes in front; on binary ones the
+// parts already start with theirs. The parts are queued as they are, shared
+// buffers need no copy. With replace set, the message drops the unsent ones of
+// its kind.
+int conn_push(Connection* conn, GBytes* const* parts, int count, int kind, bool replace) {
+    if (__atomic_load_n(&(conn->closed), __ATOMIC_ACQUIRE)) {
+        // late replies (auth, translations) after a disconnect
+        return -1;
+    }
+    GBytes* queued[count + 1];
+    int n = 0;
+    GBytes* header = NULL;
+    if (conn->protocol == PROTOCOL_FRAMED) {
+        gsize len = 0;
+        for (int i = 0; i < count; i++) len += g_bytes_get_size(parts[i]);
+        header = frame_header(len);
+        queued[n++] = header;
+    }
+    for (int i = 0; i < count; i++) {
+        queued[n++] = parts[i];
+    }
+    int ok = outbox_push(conn->outbox, queued, n, kind, replace);
+    if (header) g_bytes_unref(header);
+    return ok;
+}
+
+int conn_sendv(Connection* conn, GBytes* const* parts, int count) {
+    return conn_push(conn, parts, count, OUTBOX_PLAIN, false);
+}
+
+bool conn_binary(Connection* conn) {
+    return conn->protocol == PROTOCOL_BINARY;
+}
+
+// The logged in player, NULL before login. Pairs with the release store in
+// login_done, so a player seen here is fully built.
+Player* conn_player(Connection* conn) {
+    return __atomic_load_n(&(conn->player), __ATOMIC_ACQUIRE);
+}
+
+// Takes over a message built with wire_begin
+int conn_send_binary(Connection* conn, GString* message) {
+    GBytes* part = wire_end(message, 0);
+    int ok = conn_sendv(conn, &part, 1);
+    g_bytes_unref(part);
+    return ok;
+}
+
+// Sends a text message, "<code>\n<text>". Binary connections only get the code,
+// with the text as payload for errors; the messages with arguments build their
+// binary form themselves.
+int conn_send(Connection* conn, const char* message, size_t len) {
+    if (conn_binary(conn)) {
+        GString* binary = wire_begin(wire_code(message), 0);
+        const char* text = message[0] == 'Z' ? memchr(message, '\n', len) : NULL;
+        if (text) g_string_append(binary, text + 1);
+        return conn_send_binary(conn, binary);
+    }
+    if (conn->protocol >= PROTOCOL_FRAMED) {
+        while (len > 0 && message[len-1] == '\0') len--; // callers using sizeof() send the terminator too
+    }
+    GBytes* part = g_bytes_new(message, len);
+    int ok = conn_sendv(conn, &part, 1);
+    g_bytes_unref(part);
+    return ok;
+}
+
+// A00 to the host of a new lobby; binary: the raw id
+int conn_send_lobby_created(Connection* conn, const LobbyId* lobby_id) {
+    if (conn->trace_id) trace_lobby(conn->trace_id, lobby_id_text(lobby_id).str);
+    if (conn_binary(conn)) {
+        GString* binary = wire_begin(wire_code("A00"), sizeof(lobby_id->bytes));
+        wire_put_bytes(binary, lobby_id->bytes, sizeof(lobby_id->bytes));
+        return conn_send_binary(conn, binary);
+    }
+    char message[64];
+    snprintf(message, sizeof(message), "A00\n%s", lobby_id_text(lobby_id).str);
+    return conn_send(conn, message, strlen(message));
+}
+
+bool conn_congested(Connection* conn) {
+    return outbox_congested(conn->outbox);
+}
+
+// A broadcast payload, serialized once together with its frame header and
+// its binary form and queued by reference to every recipient
+typedef struct {
+    GBytes* payload;
+    GBytes* header;
+    GBytes* binary;
+    int kind; // replaces the unsent messages of the kind, unless OUTBOX_PLAIN
+} Message;
+
+// Takes over text, a g_malloc'd string, and binary, built with wire_begin
+Message message_take(char* text, GString* binary, int kind) {
+    Message message;
+    message.kind = kind;
+    gsize len = strlen(text);
+    message.payload = g_bytes_new_take(text, len);
+    message.header = frame_header(len);
+    message.binary = wire_end(binary, 0);
+    return message;
+}
+
+void message_clear(Message* message) {
+    g_bytes_unref(message->payload);
+    g_bytes_unref(message->header);
+    g_bytes_unref(message->binary);
+}
+
+int conn_send_message(Connection* conn, const Message* message) {
+    if (__atomic_load_n(&(conn->closed), __ATOMIC_ACQUIRE)) return -1;
+    if (conn_binary(conn)) {
+        return outbox_push(conn->outbox, &(message->binary), 1, message->kind, message->kind != OUTBOX_PLAIN);
+    }
+    if (conn->protocol >= PROTOCOL_FRAMED) {
+        GBytes* parts[2] = {message->header, message->payload};
+        return outbox_push(conn->outbox, parts, 2, message->kind, message->kind != OUTBOX_PLAIN);
+    }
+    return outbox_push(conn->outbox, &(message->payload), 1, message->kind, message->kind != OUTBOX_PLAIN);
+}
+
+const char* player_name(const Player* p) {
+    return p ? p->username : NULL;
+}
+
+Player* player_ref(Player* p) {
+    g_atomic_int_inc(&(p->refs));
+    return p;
+}
+
+void player_unref(Player* p) {
+    if (!g_atomic_int_dec_and_test(&(p->refs))) {
+        return;
+    }
+    connection_unref(p->conn);
+    pthread_mutex_destroy(&(p->mutex));
+    pool_free(players_pool, p);
+}
+
+// For pool_ref: a player whose last reference is gone stays gone
+bool player_try_ref(void* player) {
+    Player* p = (Player*) player;
+    int refs = __atomic_load_n(&(p->refs), __ATOMIC_RELAXED);
+    while (refs > 0) {
+        if (__atomic_compare_exchange_n(&(p->refs), &refs, refs + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns a new reference to the player of the handle, or NULL once it is freed.
+Player* player_lookup(Handle id) {
+    return (Player*) pool_ref(players_pool, id, player_try_ref);
+}
 
 void delete_player(gpointer data) {
-    Player* p = (Player*) data;
-    g_free(p);
+    player_unref((Player*) data);
 }
 
-void delete_lobby(gpointer data) {
-    Lobby* lobby = (Lobby*) data;
-    pthread_mutex_lock(&(lobby->players_mutex));
-    g_list_free(lobby->players);
-    g_queue_free(lobby->queue);
-    pthread_mutex_unlock(&(lobby->players_mutex));
+Lobby* lobby_ref(Lobby* lobby) {
+    g_atomic_int_inc(&(lobby->refs));
+    return lobby;
+}
+
+void* lobby_ref_data(void* data) {
+    return lobby_ref((Lobby*) data);
+}
+
+/* ** SEATS AND QUEUE ** */
+
+// Fixed arrays, touched only on the lobby strand. Each slot holds a player reference.
+
+int lobby_seat_of(const Lobby* lobby, const Player* p) {
+    for (int i = 0; i < lobby->seated; i++) {
+        if (lobby->seats[i] == p) return i;
+    }
+    return -1;
+}
+
+// Takes over the caller's reference to p
+void lobby_seat(Lobby* lobby, Player* p) {
+    lobby->seats[lobby->seated++] = p;
+}
+
+// Closes the gap, so the others keep their order and the host seat 0;
+// returns the player's reference to the caller
+Player* lobby_unseat(Lobby* lobby, int seat) {
+    Player* p = lobby->seats[seat];
+    memmove(&(lobby->seats[seat]), &(lobby->seats[seat + 1]), (lobby->seated - seat - 1) * sizeof(Player*));
+    lobby->seated--;
+    return p;
+}
+
+// Seat of the player who speaks at turn of the running match: the host starts
+// and the turn walks around the table in the direction of the stride
+Player* lobby_turn_player(const Lobby* lobby, int turn) {
+    if (turn < 0 || turn >= lobby->seated) return NULL;
+    int seat = (turn * lobby->match->stride + lobby->seated) % lobby->seated;
+    return lobby->seats[seat];
+}
+
+void lobby_foreach_seat(Lobby* lobby, GFunc fn, gpointer data) {
+    for (int i = 0; i < lobby->seated; i++) {
+        fn(lobby->seats[i], data);
+    }
+}
+
+// Takes over the caller's reference to p; false when the queue is full
+bool lobby_queue_push(Lobby* lobby, Player* p) {
+    if (lobby->queued == MAX_QUEUED) return false;
+    lobby->queue[(lobby->queue_head + lobby->queued++) % MAX_QUEUED] = p;
+    metrics_gauge_add(queued_metric, 1);
+    return true;
+}
+
+// Returns the oldest queued player with its reference, or NULL
+Player* lobby_queue_pop(Lobby* lobby) {
+    if (lobby->queued == 0) return NULL;
+    Player* p = lobby->queue[lobby->queue_head];
+    lobby->queue_head = (lobby->queue_head + 1) % MAX_QUEUED;
+    lobby->queued--;
+    metrics_gauge_add(queued_metric, -1);
+    return p;
+}
+
+// Drops p from the queue, the players behind move up; returns whether p was queued
+bool lobby_queue_remove(Lobby* lobby, Player* p) {
+    int i = 0;
+    while (i < lobby->queued && lobby->queue[(lobby->queue_head + i) % MAX_QUEUED] != p) i++;
+    if (i == lobby->queued) return false;
+    for (; i < lobby->queued - 1; i++) {
+        lobby->queue[(lobby->queue_head + i) % MAX_QUEUED] = lobby->queue[(lobby->queue_head + i + 1) % MAX_QUEUED];
+    }
+    lobby->queued--;
+    metrics_gauge_add(queued_metric, -1);
+    player_unref(p);
+    return true;
+}
+
+void lobby_foreach_queued(Lobby* lobby, GFunc fn, gpointer data) {
+    for (int i = 0; i < lobby->queued; i++) {
+        fn(lobby->queue[(lobby->queue_head + i) % MAX_QUEUED], data);
+    }
+}
+
+// Empties seats and queue, dropping their references
+void lobby_clear(Lobby* lobby) {
+    while (lobby->seated > 0) {
+        player_unref(lobby_unseat(lobby, lobby->seated - 1));
+    }
+    Player* p;
+    while ((p = lobby_queue_pop(lobby))) {
+        player_unref(p);
+    }
+}
+
+void lobby_unref(Lobby* lobby) {
+    if (!g_atomic_int_dec_and_test(&(lobby->refs))) {
+        return;
+    }
+    lobby_clear(lobby);
+    strand_free(lobby->strand);
+    g_slist_free_full(lobby->match->word, g_free);
     free(lobby->match);
-    free(lobby->translator);
-    g_free(lobby);
+    pool_free(lobbies_pool, lobby);
+}
+
+void lobby_unref_data(void* data) {
+    lobby_unref((Lobby*) data);
+}
+
+// Every match starting or stopping goes through here, which keeps the running
+// matches gauge exact. On the lobby strand.
+void match_set_running(Match* match, bool running) {
+    if (match->terminated == running) {
+        metrics_gauge_add(matches_metric, running ? 1 : -1);
+    }
+    match->terminated = !running;
+}
+
+/* ** PLAYER TO LOBBY BINDING ** */
+
+// p->lobby is written by the lobby strands and read by the player's connection,
+// so it goes through these under p->mutex.
+
+// Returns a new reference to the lobby of p, or NULL.
+Lobby* player_lobby(Player* p) {
+    pthread_mutex_lock(&(p->mutex));
+    Lobby* lobby = p->lobby ? lobby_ref(p->lobby) : NULL;
+    pthread_mutex_unlock(&(p->mutex));
+    return lobby;
+}
+
+// Binds p to the lobby unless p is in one already or left the server.
+bool player_enter(Player* p, Lobby* lobby) {
+    pthread_mutex_lock(&(p->mutex));
+    bool free = !p->gone && !p->lobby;
+    if (free) {
+        p->lobby = lobby_ref(lobby);
+    }
+    pthread_mutex_unlock(&(p->mutex));
+    return free;
+}
+
+// True while p is bound to the lobby and online.
+bool player_in(Player* p, Lobby* lobby) {
+    pthread_mutex_lock(&(p->mutex));
+    bool in = !p->gone && p->lobby == lobby;
+    pthread_mutex_unlock(&(p->mutex));
+    return in;
+}
+
+bool player_in_lobby(Player* p) {
+    pthread_mutex_lock(&(p->mutex));
+    bool bound = p->lobby != NULL;
+    pthread_mutex_unlock(&(p->mutex));
+    return bound;
+}
+
+// Unbinds p if the lobby is still theirs.
+void player_exit(Player* p, Lobby* lobby) {
+    pthread_mutex_lock(&(p->mutex));
+    bool bound = p->lobby == lobby;
+    if (bound) {
+        p->lobby = NULL;
+    }
+    pthread_mutex_unlock(&(p->mutex));
+    if (bound) {
+        lobby_unref(lobby);
+    }
+}
+
+// Hands p back to the matchmaker unless they left the server meanwhile; under
+// p->mutex, so a disconnect either sees the ticket and cancels it or comes first.
+void player_requeue(Player* p, const char* language, int size) {
+    MatchGroup group = {.size = size, .count = 1, .players = {p->id}};
+    g_strlcpy(group.language, language, sizeof(group.language));
+    pthread_mutex_lock(&(p->mutex));
+    if (!p->gone && !p->lobby) {
+        matchmaker_requeue(&group, 0);
+    }
+    pthread_mutex_unlock(&(p->mutex));
+}
+
+/* ** LOBBY REQUESTS ** */
+
+// Lobby operations are requests posted to the lobby strand, so they never run
+// concurrently with each other, on any thread.
+typedef struct {
+    Player* player; // holds a player reference, NULL for internal requests
+    int arg;
+    char* text;
+    void* data;
+} LobbyRequest;
+
+void lobby_post(Lobby* lobby, strand_fn fn, Player* p, int arg, const char* text, void* data) {
+    LobbyRequest* request = g_new(LobbyRequest, 1);
+    request->player = p ? player_ref(p) : NULL;
+    request->arg = arg;
+    request->text = g_strdup(text);
+    request->data = data;
+    strand_post(lobby->strand, fn, request);
+}
+
+void lobby_request_free(LobbyRequest* request) {
+    if (request->player) player_unref(request->player);
+    g_free(request->text);
+    g_free(request);
+}
+
+/* ** LOBBY LIST ** */
+
+// The A05 body is serialized once per change of the lobby list and shared by
+// every OP_GET_LOBBIES until the next change. lobby_list_version counts the
+// changes; the snapshot is rebuilt lazily, so a burst of changes costs one rebuild.
+// Text and binary snapshots are kept apart, indexed by whether they are binary.
+guint lobby_list_version = 1;
+GBytes* lobby_snapshot[2] = {NULL, NULL};
+guint lobby_snapshot_version[2] = {0, 0};
+pthread_mutex_t lobby_snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_mutex_t lobby_push_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t lobby_push_cond = PTHREAD_COND_INITIALIZER;
+
+void lobby_list_changed(void) {
+    __atomic_add_fetch(&lobby_list_version, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&lobby_push_mutex);
+    pthread_cond_signal(&lobby_push_cond);
+    pthread_mutex_unlock(&lobby_push_mutex);
+}
+
+// Refreshes the listing entry of the lobby and invalidates the list snapshot.
+// Call on the lobby strand, after every change to its players, queue or match.
+void lobby_changed(Lobby* lobby) {
+    if (lobby->closed) return;
+    LobbySummary summary;
+    summary.id = lobby->id;
+    g_strlcpy(summary.host, lobby->host->username, sizeof(summary.host));
+    g_strlcpy(summary.language, lobby->host->language, sizeof(summary.language));
+    summary.max_players = lobby->max_players;
+    summary.players = lobby->seated;
+    summary.queued = lobby->queued;
+    summary.running = !lobby->match->terminated;
+    lobby_index_put(&summary);
+    if (lobby->matchmade) {
+        if (!summary.running && summary.players < MIN_PLAYERS) {
+            matchmaker_offer(&(lobby->id), summary.language, lobby->max_players, summary.players);
+        } else {
+            matchmaker_withdraw(&(lobby->id));
+        }
+    }
+    lobby_list_changed();
 }
 
-void fill_buffer(gpointer key, gpointer value, gpointer bufferContext) {
-    Lobby* lobby = (Lobby*) value;
-    BufferContext* bufCont = (BufferContext*) bufferContext;
-    int written = snprintf(bufCont->buffer + bufCont->idx, 1024, "%s %s %d %d\n",
-                          lobby->id,
-                          lobby->host->username,
-                          lobby->max_players,
-                          (int)g_list_length(lobby->players));
-    bufCont->idx += written;
+// Called by the lobbies registry on removal, which only happens on the lobby strand;
+// queued requests and pending translations keep the memory alive
+void delete_lobby(gpointer data) {
+    Lobby* lobby = (Lobby*) data;
+    lobby->closed = true;
+    match_set_running(lobby->match, false);
+    lobby_index_remove(&(lobby->id));
+    if (lobby->matchmade) matchmaker_withdraw(&(lobby->id));
+    lobby_list_changed();
+    matchmaker_kick(); // players waiting for room for a new lobby
+    lobby_unref(lobby);
 }
 
 void lobby_broadcast_joined(gpointer player, gpointer ssender) {
     Player* p = (Player*) player;
     Player* sender = (Player*) ssender;
-    if (strcmp(p->id, sender->id) == 0) {
+    if (p->id == sender->id) {
         return; //do not send to sender
     }
     char * message = "A08\nA player joined the lobby";
-    pthread_mutex_lock(&(p->socket_mutex));
-    printf("[INFO] Sending join message to %s\n", p->username);
-    send(p->socket, message, strlen(message), 0);
-    pthread_mutex_unlock(&(p->socket_mutex));
+    LOG_DEBUG("lobby.notify_join", NULL, p->username, "Sending join message to %s", p->username);
+    conn_send(p->conn, message, strlen(message));
 }
 
-void lobby_broadcast_disconnection(gpointer player, gpointer ssender) {
+typedef struct {
+    Player* sender;
+    Lobby* lobby;
+} LeaveContext;
+
+void lobby_broadcast_disconnection(gpointer player, gpointer leaveContext) {
     Player* p = (Player*) player;
-    Player* sender = (Player*) ssender;
-    if (strcmp(p->id, sender->id) == 0) {
+    LeaveContext* context = (LeaveContext*) leaveContext;
+    Player* sender = context->sender;
+    if (p->id == sender->id) {
         return; //do not send to sender
     }
 
-    char* message = (sender->isHost) ? 
+    bool host = context->lobby->host == sender;
+    char* message = host ?
         "A02\nThe host left, leaving the lobby" :
         "A03\nA player left the lobby";
-    pthread_mutex_lock(&(p->socket_mutex));
-    printf("[INFO] Notifying %s about disconnection\n", p->username);
-    send(p->socket, message, strlen(message), 0);
-    pthread_mutex_unlock(&(p->socket_mutex));
-    if(sender->isHost){
-        p->lobby = NULL;
+    LOG_DEBUG("lobby.notify_leave", LOBBY_NAME(context->lobby), p->username, "Notifying %s about disconnection", p->username);
+    conn_send(p->conn, message, strlen(message));
+    if(host){
+        player_exit(p, context->lobby);
     } else {
-        if (!p->lobby->match->terminated) {
+        if (!context->lobby->match->terminated) {
             char * match_terminated = "A12\nThe match is terminated";
-            pthread_mutex_lock(&(p->socket_mutex));
-            printf("[INFO] Notifying %s about match termination\n", p->username);
-            send(p->socket, match_terminated, strlen(match_terminated), 0);
-            pthread_mutex_unlock(&(p->socket_mutex));
+            LOG_DEBUG("match.notify_terminated", LOBBY_NAME(context->lobby), p->username, "Notifying %s about match termination", p->username);
+            conn_send(p->conn, match_terminated, strlen(match_terminated));
         }
     }
 }
@@ -179,709 +738,1786 @@ void word_history(gpointer word_step, gpointer bufferContext) {
     context->idx += written;
 }
 
-void match_turn_broadcast(gpointer player, gpointer turnContext) {
-    Player* p = (Player*) player;
-    TurnContext* context = (TurnContext*) turnContext;
-
-    char message[MAX_LENGTH*MAX_PLAYERS+200] = {0};
-    char body[MAX_LENGTH*MAX_PLAYERS+100] = {0};
-    if (context->terminated) {
-        const char* header = "A12\nThe match is terminated\nHere is the story of the phrase:\n";
-        strcpy(body, header);
-        int header_len = strlen(header);
-
-        char phrase[MAX_LENGTH*MAX_PLAYERS+50] = {0};
-        int phrase_idx = 0;
-        for (GSList* node = context->word; node != NULL; node = node->next) {
-            char* step = (char*) node->data;
-            int written = snprintf(phrase + phrase_idx, sizeof(phrase) - phrase_idx, "%s -> ", step);
-            phrase_idx += written;
-        }
-        if (phrase_idx >= 4) {
-            phrase[phrase_idx-4] = '\0';
-        }
-        snprintf(body + header_len, sizeof(body) - header_len, "%s\n", phrase);
-        char* final_phrase = NULL;
-        GSList* last = g_slist_last(context->word);
-        final_phrase = (char*) last->data;
-        char translated[MAX_LENGTH*MAX_PLAYERS+50] = {0};
-        if (translate(p->lobby->translator, final_phrase, context->player_turn->language, p->language, translated, sizeof(translated)) == 0) {
-            size_t body_len = strlen(body);
-            snprintf(body + body_len, sizeof(body) - body_len, "=> %s\n", translated);
+// A11 to the player whose turn it is, A13 to the others; both are built once
+void match_broadcast_turn(Lobby* lobby, Player* turn, GSList* word) {
+    gint64 started = g_get_monotonic_time();
+    GSList* last = g_slist_last(word);
+    // binary: the phrase, empty on the first turn
+    GString* binary = wire_begin(wire_code("A11"), last ? strlen((char*) last->data) : 0);
+    if (last) g_string_append(binary, (char*) last->data);
+    Message yours = message_take(last ?
+        g_strdup_printf("A11\nIs your turn!\nThe current phrase is: %s\n", (char*) last->data) :
+        g_strdup("A11\nIs your turn!\nStart with a phrase\n"), binary, KIND_TURN);
+    // a player who has not read the last turn yet only gets this one
+    Message wait = message_take(g_strdup("A13\nWait for the other players to finish"), wire_begin(wire_code("A13"), 0), KIND_TURN);
+    for (int i = 0; i < lobby->seated; i++) {
+        Player* p = lobby->seats[i];
+        conn_send_message(p->conn, p == turn ? &yours : &wait);
+    }
+    LOG_DEBUG("match.turn", LOBBY_NAME(lobby), turn->username, "Turn of %s sent to %d players in lobby %s", turn->username, lobby->seated, LOBBY_NAME(lobby));
+    message_clear(&yours);
+    message_clear(&wait);
+    metrics_observe(broadcast_turn_metric, g_get_monotonic_time() - started);
+}
+
+// Binary A12: a u8 count of steps, each a str16, then the final phrase in the
+// language of the recipient as the rest of the payload, empty when untranslated.
+// An A12 without payload ends a match nobody finished.
+GString* story_binary(GSList* word, const char* translated) {
+    GString* binary = wire_begin(wire_code("A12"), 256);
+    wire_put_u8(binary, g_slist_length(word)); // a step per seat at most
+    for (GSList* node = word; node != NULL; node = node->next) {
+        wire_put_str16(binary, (char*) node->data);
+    }
+    if (translated) g_string_append(binary, translated);
+    return binary;
+}
+
+// A12 with the story of the phrase, built once per language of the players;
+// translations maps a language to the final phrase in it
+void match_broadcast_end(Lobby* lobby, GSList* word, GHashTable* translations) {
+    gint64 started = g_get_monotonic_time();
+    GString* story = g_string_new("A12\nThe match is terminated\nHere is the story of the phrase:\n");
+    for (GSList* node = word; node != NULL; node = node->next) {
+        g_string_append(story, (char*) node->data);
+        g_string_append(story, node->next ? " -> " : "\n");
+    }
+    if (!word) g_string_append_c(story, '\n');
+    Message untranslated = message_take(g_strdup(story->str), story_binary(word, NULL), OUTBOX_PLAIN);
+    struct {
+        const char* language;
+        Message message;
+    } versions[MAX_PLAYERS];
+    int count = 0;
+    for (int i = 0; i < lobby->seated; i++) {
+        Player* p = lobby->seats[i];
+        const char* translated = g_hash_table_lookup(translations, p->language);
+        if (!translated) {
+            conn_send_message(p->conn, &untranslated);
+            continue;
         }
-    } else {
-        if (p->id == context->player_turn->id) {
-            GSList* node = g_slist_last(context->word);
-            if (node) {
-                snprintf(body, sizeof(body), "A11\nIs your turn!\nThe current phrase is: %s\n", (char*) node->data);
-            } else {
-                snprintf(body, sizeof(body), "A11\nIs your turn!\nStart with a phrase\n");
-            }
-        } else {
-            snprintf(body, sizeof(body), "A13\nWait for the other players to finish");
+        int v = 0;
+        while (v < count && strcmp(versions[v].language, p->language) != 0) v++;
+        if (v == count) {
+            versions[v].language = p->language;
+            versions[v].message = message_take(g_strdup_printf("%s=> %s\n", story->str, translated),
+                                               story_binary(word, translated), OUTBOX_PLAIN);
+            count++;
         }
+        conn_send_message(p->conn, &(versions[v].message));
     }
-    strncat(message, body, sizeof(message) - strlen(message) - 1);
-    pthread_mutex_lock(&(p->socket_mutex));
-    printf("[INFO] Sending turn/match message to %s: %s\n", p->username, message);
-    send(p->socket, message, strlen(message), 0);
-    pthread_mutex_unlock(&(p->socket_mutex));
+    LOG_INFO("match.story", LOBBY_NAME(lobby), NULL, "Story of lobby %s sent to %d players in %d languages", LOBBY_NAME(lobby), lobby->seated, count);
+    for (int v = 0; v < count; v++) {
+        message_clear(&(versions[v].message));
+    }
+    message_clear(&untranslated);
+    g_string_free(story, TRUE);
+    metrics_observe(broadcast_story_metric, g_get_monotonic_time() - started);
 }
 
-GHashTable* players;
-GHashTable* lobbies;
+// Fills free seats from the queue once a match is over. On the lobby strand.
+void lobby_promote_queue(Lobby* lobby) {
+    while (lobby->seated < lobby->max_players && lobby->queued > 0) {
+        Player* queue_player = lobby_queue_pop(lobby);
+        lobby_seat(lobby, queue_player);
+        char success_message[] = "A01\nWelcome to the lobby";
+        LOG_INFO("lobby.promote", LOBBY_NAME(lobby), queue_player->username, "Player %s joined from queue after match", queue_player->username);
+        conn_send(queue_player->conn, success_message, sizeof(success_message));
+        lobby_changed(lobby);
+    }
+}
 
-pthread_mutex_t lobbies_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t global_players_mutex = PTHREAD_MUTEX_INITIALIZER;
+void match_end_broadcast(MatchEnd* end) {
+    Lobby* lobby = end->lobby;
+    bool current = !lobby->closed && lobby->match->round == end->round;
+    if (current) {
+        match_broadcast_end(lobby, end->word, end->translations);
+        lobby_promote_queue(lobby);
+    }
+    g_slist_free_full(end->word, g_free);
+    TranslatorPoolStats stats;
+    translator_pool_stats(&stats);
+    LOG_INFO("stats.translator", NULL, NULL, "Translator pool: %d/%d in use, peak %d, %lu waits of %lu borrows, backlog %d",
+           stats.in_use, stats.size, stats.peak_in_use, stats.waits, stats.borrows, stats.backlog);
+    CacheStats cache;
+    cache_stats(&cache);
+    LOG_INFO("stats.cache", NULL, NULL, "Translation cache: %lu hits, %lu misses, %lu shared in flight, %lu entries, %zu/%zu bytes, %lu evictions",
+           cache.hits, cache.misses, translator_coalesced(), cache.entries, cache.bytes, cache.budget, cache.evictions);
+    if (cache_store_is_open()) {
+        CacheStoreStats store;
+        cache_store_stats(&store);
+        LOG_INFO("stats.store", NULL, NULL, "Translation store: %lu writes pending, %lu dropped on a full queue",
+               store.pending, store.dropped);
+    }
+    OutboxStats outboxes;
+    outbox_stats(&outboxes);
+    LOG_INFO("stats.outbox", NULL, NULL, "Outboxes: %lu slow consumers evicted, %lu superseded messages dropped",
+           outboxes.evictions, outboxes.superseded);
+    g_hash_table_destroy(end->translations);
+    lobby_unref(lobby);
+    g_free(end);
+}
 
-void print_lobby(const Lobby* lobby){
-    printf("[INFO] Lobby created: id %s\n",lobby->id);
+// On the lobby strand; text is NULL when the translation failed
+void lobby_on_end_translated(void* owner, void* arg) {
+    LobbyRequest* lobby_request = (LobbyRequest*) arg;
+    MatchEndRequest* request = (MatchEndRequest*) lobby_request->data;
+    MatchEnd* end = request->end;
+    if (lobby_request->text) {
+        g_hash_table_insert(end->translations, g_strdup(request->language), g_strdup(lobby_request->text));
+    }
+    g_free(request);
+    if (--end->remaining == 0) {
+        match_end_broadcast(end);
+    }
+    lobby_request_free(lobby_request);
 }
 
-void sanitize_username(char *buffer) {
-    int read_pos = 0;
-    int write_pos = 0;
-    while (buffer[read_pos] != '\0') {
-        if (isalnum(buffer[read_pos])) {
-            buffer[write_pos] = buffer[read_pos];
-            write_pos++;
+void match_end_translated(int status, const char* translated, void* data) {
+    MatchEndRequest* request = (MatchEndRequest*) data;
+    lobby_post(request->end->lobby, lobby_on_end_translated, NULL, 0, status == 0 ? translated : NULL, request);
+}
+
+// Translates the final phrase once per language spoken in the lobby, all at once;
+// A12 goes out when the last one is back
+void match_end(Lobby* lobby, const char* source) {
+    Match* match = lobby->match;
+    GSList* last = g_slist_last(match->word);
+    MatchEnd* end = g_new0(MatchEnd, 1);
+    end->lobby = lobby_ref(lobby);
+    end->round = match->round;
+    end->word = match->word;
+    match->word = NULL;
+    end->translations = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+    GSList* requests = NULL;
+    int player_count = lobby->seated;
+    for (int i = 0; i < lobby->seated; i++) {
+        Player* player = lobby->seats[i];
+        // no request for the speaker's own language or one already asked for
+        if (strcmp(player->language, source) == 0) {
+            if (!g_hash_table_contains(end->translations, source)) {
+                g_hash_table_insert(end->translations, g_strdup(source), g_strdup((char*) last->data));
+            }
+            continue;
         }
-        read_pos++;
+        bool requested = false;
+        for (GSList* r = requests; r != NULL && !requested; r = r->next) {
+            requested = strcmp(((MatchEndRequest*) r->data)->language, player->language) == 0;
+        }
+        if (requested) continue;
+        MatchEndRequest* request = g_new(MatchEndRequest, 1);
+        request->end = end;
+        strcpy(request->language, player->language);
+        requests = g_slist_prepend(requests, request);
+        end->remaining++;
     }
-    buffer[write_pos] = '\0';
+    LOG_INFO("match.end", LOBBY_NAME(lobby), NULL, "Final phrase in lobby %s needs %d translations for %d players", LOBBY_NAME(lobby), end->remaining, player_count);
+
+    if (!requests) {
+        match_end_broadcast(end);
+        return;
+    }
+    for (GSList* node = requests; node != NULL; node = node->next) {
+        MatchEndRequest* request = (MatchEndRequest*) node->data;
+        translate_async((char*) last->data, source, request->language, match_end_translated, request);
+    }
+    g_slist_free(requests);
 }
 
-int db_init() {
-    int rc = sqlite3_open(db_path, &db);
-    if (rc) {
-        fprintf(stderr, "[ERROR] Can't open DB: %s\n", sqlite3_errmsg(db));
-        return 1;
-    }
-    const char* sql = "CREATE TABLE IF NOT EXISTS users ("
-                      "uuid TEXT PRIMARY KEY,"
-                      "username TEXT UNIQUE NOT NULL,"
-                      "password TEXT NOT NULL,"
-                      "language TEXT NOT NULL);";
-    char* err = NULL;
-    rc = sqlite3_exec(db, sql, 0, 0, &err);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "[ERROR] SQL error: %s\n", err);
-        sqlite3_free(err);
-        return 1;
-    }
-    printf("[INFO] Database initialized successfully\n");
-    return 0;
+// Moves the match to the next turn once the phrase for it is ready
+void match_advance(Lobby* lobby) {
+    Match* match = lobby->match;
+    Player* speaker = lobby_turn_player(lobby, match->turn);
+    char source[3];
+    strcpy(source, speaker->language);
+    match->turn++;
+    if (match->turn >= lobby->seated) {
+        match_set_running(match, false);
+        lobby_changed(lobby);
+        LOG_INFO("match.terminated", LOBBY_NAME(lobby), NULL, "Match terminated in lobby %s", LOBBY_NAME(lobby));
+        match_end(lobby, source);
+        return;
+    }
+    Player* next_player = lobby_turn_player(lobby, match->turn);
+    match_broadcast_turn(lobby, next_player, match->word);
 }
 
-int db_signup(const char* username, const char* password, const char* language, char* out_uuid) {
-    uuid_t id;
-    uuid_generate_random(id);
-    uuid_unparse(id, out_uuid);
-    const char* sql = "INSERT INTO users (uuid, username, password, language) VALUES (?, ?, ?, ?);";
-    sqlite3_stmt* stmt;
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) return 2;
-    sqlite3_bind_text(stmt, 1, out_uuid, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, username, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 3, password, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 4, language, -1, SQLITE_STATIC);
-    rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    if (rc == SQLITE_DONE) return 0;
-    return 1; // already exists or error
-}
-
-int db_login(const char* username, const char* password, char* out_uuid, char* out_language) {
-    const char* sql = "SELECT uuid, password, language FROM users WHERE username = ?;";
-    sqlite3_stmt* stmt;
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) return 2;
-    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
-    rc = sqlite3_step(stmt);
-    if (rc == SQLITE_ROW) {
-        const char* db_uuid = (const char*)sqlite3_column_text(stmt, 0);
-        const char* db_pass = (const char*)sqlite3_column_text(stmt, 1);
-        const char* db_lang = (const char*)sqlite3_column_text(stmt, 2);
-        if (strcmp(password, db_pass) == 0) {
-            strncpy(out_uuid, db_uuid, 36);
-            out_uuid[36] = '\0';
-            strncpy(out_language, db_lang, 2);
-            out_language[2] = '\0';
-            sqlite3_finalize(stmt);
-            return 0;
-        }
-        sqlite3_finalize(stmt);
-        return 1; // wrong password
-    }
-    sqlite3_finalize(stmt);
-    return 2; // not found
+// On the lobby strand; arg is the round the phrase belongs to, text NULL when the translation failed
+void lobby_on_turn_translated(void* owner, void* arg) {
+    Lobby* lobby = (Lobby*) owner;
+    LobbyRequest* request = (LobbyRequest*) arg;
+    Match* match = lobby->match;
+    if (!lobby->closed && match->round == request->arg && !match->terminated) {
+        GSList* last = g_slist_last(match->word);
+        match->word = g_slist_append(match->word, g_strdup(request->text ? request->text : (char*) last->data));
+        match->pending = false;
+        match_advance(lobby);
+    }
+    lobby_request_free(request);
 }
 
-bool is_username_logged_in(const char* username) {
-    GHashTableIter iter;
-    gpointer key, value;
-    pthread_mutex_lock(&global_players_mutex);
-    g_hash_table_iter_init(&iter, players);
-    while (g_hash_table_iter_next(&iter, &key, &value)) {
-        Player* p = (Player*)value;
-        if (strcmp(p->username, username) == 0) {
-            pthread_mutex_unlock(&global_players_mutex);
-            return true;
-        }
+void speak_translated(int status, const char* translated, void* data) {
+    TurnJob* job = (TurnJob*) data;
+    lobby_post(job->lobby, lobby_on_turn_translated, NULL, job->round, status == 0 ? translated : NULL, NULL);
+    lobby_unref(job->lobby);
+    g_free(job);
+}
+
+// Starts a new match, the host speaks first. On the lobby strand.
+// The seats stay as they are, the direction only flips the stride.
+void match_start(Lobby* lobby, bool clockwise) {
+    Match* match = lobby->match;
+    match->turn = 0;
+    match->round++;
+    match_set_running(match, true);
+    match->pending = false;
+    // phrases left by a round aborted when a player left
+    g_slist_free_full(match->word, g_free);
+    match->word = NULL;
+    match->stride = clockwise ? 1 : -1;
+    lobby_changed(lobby);
+    LOG_INFO("match.start", LOBBY_NAME(lobby), lobby->host->username, "Match started in lobby %s (host: %s)", LOBBY_NAME(lobby), lobby->host->username);
+    match_broadcast_turn(lobby, lobby->host, NULL);
+}
+
+GHashTable* players;
+GHashTable* players_by_username; // same players keyed by username, owned by players
+Registry* lobbies;
+int max_lobbies = MAX_LOBBIES;
+
+// Returns a reference to the current A05 body, rebuilding it if the list changed.
+GBytes* lobby_snapshot_get(bool binary, guint* version) {
+    pthread_mutex_lock(&lobby_snapshot_mutex);
+    guint current = __atomic_load_n(&lobby_list_version, __ATOMIC_ACQUIRE);
+    if (!lobby_snapshot[binary] || lobby_snapshot_version[binary] != current) {
+        // the listing index holds the same lines, no lobby has to be visited
+        LobbyFilter all = {false, false, "", -1};
+        GString* list = g_string_sized_new(registry_size(lobbies) * (binary ? 40 : 80) + 1);
+        lobby_index_query(&all, 0, G_MAXINT, binary, list);
+        if (lobby_snapshot[binary]) g_bytes_unref(lobby_snapshot[binary]);
+        lobby_snapshot[binary] = g_string_free_to_bytes(list);
+        lobby_snapshot_version[binary] = current;
     }
-    pthread_mutex_unlock(&global_players_mutex);
-    return false;
+    GBytes* snapshot = g_bytes_ref(lobby_snapshot[binary]);
+    *version = lobby_snapshot_version[binary];
+    pthread_mutex_unlock(&lobby_snapshot_mutex);
+    return snapshot;
 }
 
-void *handle_client(void *arg)
-{
-    int client_socket = *(int *)arg;
-    free(arg);
-    char buffer[1024];
-    Player *p = NULL;
-    printf("[INFO] New client connected (socket %d)\n", client_socket);
-    while (1)
-    {
-        int bytes = recv(client_socket, buffer, sizeof(buffer), 0);
-        if (bytes <= 0)
-            break;
-        buffer[bytes] = '\0';
-        char op[4];
-        strncpy(op,buffer,3);
-        op[3] = '\0';
-        int op_number=atoi(op);
-        if(p){
-            printf("[INFO] Player %s (%s): %s\n", p->username, p->id, buffer);
-        }
-        switch (op_number)
-        {
-            case OP_SIGNUP: {
-                // Format: 201 <lang> <username> <password>
-                char lang[3], username[32], password[32], uuid[37];
-                int n = sscanf(buffer+4, "%2s %31s %31s", lang, username, password);
-                if (n != 3) {
-                    char * msg = "Z01\nUsage: 201 <lang> <username> <password>";
-                    printf("[WARN] Signup failed: bad request format\n");
-                    send(client_socket, msg, strlen(msg), 0);
-                    break;
-                }
-                sanitize_username(username);
-                if (strlen(username) < 5 || strlen(username) > 15) {
-                    char * msg = "Z01\nUsername must be 5-15 chars";
-                    printf("[WARN] Signup failed: username length invalid\n");
-                    send(client_socket, msg, strlen(msg), 0);
-                    break;
-                }
-                int res = db_signup(username, password, lang, uuid);
-                if (res == 0) {
-                    char * msg = "B01\nSignup successful!";
-                    printf("[INFO] Signup successful for user %s\n", username);
-                    send(client_socket, msg, strlen(msg), 0);
-                } else {
-                    char * msg = "Z02\nUsername already exists";
-                    printf("[WARN] Signup failed: username %s already exists\n", username);
-                    send(client_socket, msg, strlen(msg), 0);
-                }
-                break;
-            }
-            case OP_LOGIN: {
-                // Format: 202 <username> <password>
-                char username[32], password[32], lang[3], uuid[37];
-                int n = sscanf(buffer+4, "%31s %31s", username, password);
-                if (n != 2) {
-                    char * msg = "Z01\nUsage: 202 <username> <password>";
-                    printf("[WARN] Login failed: bad request format\n");
-                    send(client_socket, msg, strlen(msg), 0);
-                    break;
-                }
-                sanitize_username(username);
-                if (is_username_logged_in(username)) {
-                    char * msg = "Z02\nUser already logged in from another client";
-                    printf("[WARN] Login failed: user %s already logged in\n", username);
-                    send(client_socket, msg, strlen(msg), 0);
-                    break;
-                }
-                int res = db_login(username, password, uuid, lang);
-                if (res == 0) {
-                    if (p) {
-                        char * msg = "Z02\nAlready logged in!";
-                        printf("[WARN] Login failed: already logged in\n");
-                        send(client_socket, msg, strlen(msg), 0);
-                        break;
-                    }
-                    p = g_new(Player, 1);
-                    strncpy(p->id, uuid, 36);
-                    p->id[36] = '\0';
-                    strcpy(p->username, username);
-                    p->socket = client_socket;
-                    p->lobby = NULL;
-                    p->isHost = false;
-                    strncpy(p->language, lang, 2);
-                    p->language[2] = '\0';
-                    pthread_mutex_init(&(p->socket_mutex), NULL);
-                    pthread_mutex_lock(&global_players_mutex);
-                    g_hash_table_insert(players, g_strdup(p->id), p);
-                    pthread_mutex_unlock(&global_players_mutex);
-
-                    sprintf(buffer, "B02\nLogin successful! Your username is %s\n", p->username);
-                    pthread_mutex_lock(&(p->socket_mutex));
-                    send(client_socket, buffer, strlen(buffer), 0);
-                    pthread_mutex_unlock(&(p->socket_mutex));
-                    printf("[INFO] User logged in %s (%s) --> %s\n", p->username, p->id, p->language);
-                } else if (res == 1) {
-                    char * msg = "Z03\nWrong password";
-                    printf("[WARN] Login failed: wrong password for %s\n", username);
-                    send(client_socket, msg, strlen(msg), 0);
-                } else {
-                    char * msg = "Z03\nUser not found";
-                    printf("[WARN] Login failed: user %s not found\n", username);
-                    send(client_socket, msg, strlen(msg), 0);
-                }
-                break;
-            }
-            case OP_CREATE_LOBBY: {
-                if (!p) {
-                    char * msg = "Z03\nYou must authenticate first!";
-                    printf("[WARN] Create lobby failed: unauthenticated\n");
-                    send(client_socket, msg, strlen(msg), 0);
-                }
-                if(p->lobby){
-                    char error_messagge[] = "Z01\nYou cannot create a lobby since you already are in one";
-                    printf("[WARN] Create lobby failed: already in a lobby\n");
-                    pthread_mutex_lock(&(p->socket_mutex));
-                    send(client_socket, error_messagge, sizeof(error_messagge), 0);
-                    pthread_mutex_unlock(&(p->socket_mutex));
-                    break;
-                }
-                if(g_hash_table_size(lobbies) + 1 > MAX_LOBBIES){
-                    char error_messagge[] = "Z00\nWe have not room for other lobbies at the moment. Try later!";
-                    printf("[WARN] Create lobby failed: max lobbies reached\n");
-                    pthread_mutex_lock(&(p->socket_mutex));
-                    send(client_socket,error_messagge,sizeof(error_messagge), 0);
-                    pthread_mutex_unlock(&(p->socket_mutex));
-                    break;
-                }
-                Lobby *lobby = g_new(Lobby, 1);
-                uuid_t id;
-                uuid_generate_random(id);
-                uuid_unparse(id, lobby->id);
-                pthread_mutex_init(&(lobby->players_mutex), NULL);
-                lobby->host = p;
-                lobby->max_players = MAX_PLAYERS;
-                lobby->queue = g_queue_new();
-                p->lobby = lobby;
-                p->isHost = true;
-                lobby->players = NULL;
-                lobby->match = malloc(sizeof(Match));
-                lobby->match->terminated = true;
-                lobby->translator = malloc(sizeof(Translator));
-                translator_init(lobby->translator, translator_url);
-                lobby->players = g_list_append(lobby->players, lobby->host);
-                pthread_mutex_lock(&lobbies_mutex);
-                g_hash_table_insert(lobbies, g_strdup(lobby->id), lobby);
-                pthread_mutex_unlock(&lobbies_mutex);
-                char success_message[64];
-                snprintf(success_message, sizeof(success_message), "A00\n%s", lobby->id);
-                print_lobby(lobby);
-                printf("[INFO] Lobby created, number of lobbies: %d\n", g_hash_table_size(lobbies));
-                pthread_mutex_lock(&(p->socket_mutex));
-                send(client_socket, success_message, strlen(success_message), 0);
-                pthread_mutex_unlock(&(p->socket_mutex));
-                break;
-            }
-            case OP_JOIN_LOBBY : {
-                if (!p) {
-                    char * msg = "Z03\nYou must authenticate first!";
-                    printf("[WARN] Join lobby failed: unauthenticated\n");
-                    send(client_socket, msg, strlen(msg), 0);
-                }
-                char lobby_id[37];
-                strncpy(lobby_id,buffer+4,36);
-                lobby_id[36]='\0';
-                if(p->lobby){
-                    char error_messagge[] = "Z01\nYou are already in a lobby";
-                    printf("[WARN] Join lobby failed: already in a lobby\n");
-                    pthread_mutex_lock(&(p->socket_mutex));
-                    send(client_socket, error_messagge, sizeof(error_messagge), 0);
-                    pthread_mutex_unlock(&(p->socket_mutex));
-                    break;
-                }
+/* ** LOBBY LIST PUSH ** */
 
-                Lobby *lobby = (Lobby *) g_hash_table_lookup(lobbies, lobby_id);
-                if(!lobby){
-                    char error_messagge[] = "Z01\nLobby not found";
-                    printf("[WARN] Join lobby failed: lobby not found\n");
-                    pthread_mutex_lock(&(p->socket_mutex));
-                    send(client_socket, error_messagge, sizeof(error_messagge), 0);
-                    pthread_mutex_unlock(&(p->socket_mutex));
-                    break;
-                }
-                if (!lobby->match->terminated) {
-                    char error_messagge[] = "A07\nThe match is already started, you are in a queue now";
-                    printf("[INFO] Player %s queued for lobby %s (match already started)\n", p->username, lobby_id);
-                    pthread_mutex_lock(&(lobby->players_mutex));
-                    g_queue_push_tail(lobby->queue, p);
-                    p->lobby = lobby;
-                    pthread_mutex_unlock(&(lobby->players_mutex));
-                    pthread_mutex_lock(&(p->socket_mutex));
-                    send(client_socket, error_messagge, sizeof(error_messagge), 0);
-                    pthread_mutex_unlock(&(p->socket_mutex));
-                    break;
-                }
-                if (g_list_length(lobby->players) + 1 > lobby->max_players) {
-                    char error_messagge[] = "A04\nThe lobby is full, you are in a queue now";
-                    printf("[INFO] Player %s queued for lobby %s (lobby full)\n", p->username, lobby_id);
-                    pthread_mutex_lock(&(lobby->players_mutex));
-                    g_queue_push_tail(lobby->queue, p);
-                    p->lobby = lobby;
-                    pthread_mutex_unlock(&(lobby->players_mutex));
-                    pthread_mutex_lock(&(p->socket_mutex));
-                    send(client_socket, error_messagge, sizeof(error_messagge), 0);
-                    pthread_mutex_unlock(&(p->socket_mutex));
-                    break;
-                }
+// Clients on the home screen subscribe with 105 instead of polling 102. Changes
+// are coalesced: the push worker sends at most one update per interval, an A16
+// delta to subscribers holding the previous push and a full A05 to the others.
+typedef struct {
+    Connection* conn;
+    guint version; // last list version sent to it
+} LobbySubscriber;
 
-                pthread_mutex_lock(&(lobby->players_mutex));
-                lobby->players = g_list_append(lobby->players, p);
-                p->lobby = lobby;
-                pthread_mutex_unlock(&(lobby->players_mutex));
-                
-                char response_message[] = "A01\nWelcome to the lobby";
-                printf("[INFO] Player %s joined lobby %s\n", p->username, lobby_id);
-                pthread_mutex_lock(&(p->socket_mutex));
-                send(client_socket, response_message, sizeof(response_message), 0);
-                pthread_mutex_unlock(&(p->socket_mutex));
-
-                g_list_foreach(p->lobby->players, lobby_broadcast_joined, p);
-                break;
-            }
-            case OP_GET_LOBBIES: {
-                if (!p) {
-                    char * msg = "Z03\nYou must authenticate first!";
-                    printf("[WARN] Get lobbies failed: unauthenticated\n");
-                    send(client_socket, msg, strlen(msg), 0);
-                    break;
-                }
-                if (g_hash_table_size(lobbies) <= 0) {
-                    printf("[INFO] No lobbies to show\n");
-                    char error_messagge[] = "A05";
-                    pthread_mutex_lock(&(p->socket_mutex));
-                    send(client_socket, error_messagge, sizeof(error_messagge), 0);
-                    pthread_mutex_unlock(&(p->socket_mutex));
-                    break;
-                }
-                printf("[INFO] Number of lobbies to show: %d\n", g_hash_table_size(lobbies));
-                char* buffer = malloc(g_hash_table_size(lobbies) * 200 + 5);
-                BufferContext bufferContext = {buffer, 4};
-                memcpy(buffer, "A05\n", 4);
-                buffer[4] = '\0';
-                g_hash_table_foreach(lobbies, fill_buffer, &bufferContext);  
-                buffer[bufferContext.idx] = '\0';
-                printf("[INFO] Sending lobby list to %s\n", p->username);
-                pthread_mutex_lock(&(p->socket_mutex));
-                send(client_socket, buffer, strlen(buffer), 0);
-                pthread_mutex_unlock(&(p->socket_mutex));
-                free(buffer);
-                break;
-            }
-            case OP_LEAVE_LOBBY: {
-                if (!p) {
-                    char * msg = "Z03\nYou must authenticate first!";
-                    printf("[WARN] Leave lobby failed: unauthenticated\n");
-                    send(client_socket, msg, strlen(msg), 0);
-                    break;
-                }
-                if (!p->lobby) {
-                    char error_messagge[] = "Z01\nYou are not in a lobby";
-                    printf("[WARN] Leave lobby failed: not in a lobby\n");
-                    pthread_mutex_lock(&(p->socket_mutex));
-                    send(client_socket, error_messagge, sizeof(error_messagge), 0);
-                    pthread_mutex_unlock(&(p->socket_mutex));
-                    break;
-                }
-                if (p->isHost) {
-                    printf("[INFO] Host %s leaving and deleting lobby %s\n", p->username, p->lobby->id);
-                    g_list_foreach(p->lobby->players, lobby_broadcast_disconnection, p);
-                    g_queue_foreach(p->lobby->queue, lobby_broadcast_disconnection, p);
-                    pthread_mutex_lock(&lobbies_mutex);
-                    g_hash_table_remove(lobbies, p->lobby->id);
-                    pthread_mutex_unlock(&lobbies_mutex);
-                    p->lobby = NULL;
-                    p->isHost = false;
-                } else {
-                    if (g_queue_find(p->lobby->queue, p)){
-                        pthread_mutex_lock(&(p->lobby->players_mutex));
-                        g_queue_pop_head(p->lobby->queue);
-                        pthread_mutex_unlock(&(p->lobby->players_mutex));
-                        char success_message[] = "A06\nYou left the queue";
-                        printf("[INFO] Player %s left the queue\n", p->username);
-                        pthread_mutex_lock(&(p->socket_mutex));
-                        send(p->socket, success_message, sizeof(success_message), 0);
-                        pthread_mutex_unlock(&(p->socket_mutex));
-                        p->lobby = NULL;
-                    }
-                    else
-                    {
-                        printf("[INFO] Player %s leaving lobby %s\n", p->username, p->lobby->id);
-                        g_list_foreach(p->lobby->players, lobby_broadcast_disconnection, p);
-                        p->lobby->match->terminated = true;
-                        pthread_mutex_lock(&(p->lobby->players_mutex));
-                        p->lobby->players = g_list_remove(p->lobby->players, p);
-                        if (!g_queue_is_empty(p->lobby->queue)){
-                            Player *queue_player = g_queue_pop_head(p->lobby->queue);
-                            p->lobby->players = g_list_append(p->lobby->players, queue_player);
-                            char success_message[] = "A01\nWelcome to the lobby";
-                            printf("[INFO] Player %s joined from queue\n", queue_player->username);
-                            pthread_mutex_lock(&(queue_player->socket_mutex));
-                            send(queue_player->socket, success_message, sizeof(success_message), 0);
-                            pthread_mutex_unlock(&(queue_player->socket_mutex));
-                        }
-                        pthread_mutex_unlock(&(p->lobby->players_mutex));
-                        p->lobby = NULL;
-                    }
-                }
-                char success_message[] = "A03\nYou left the lobby";
-                pthread_mutex_lock(&(p->socket_mutex));
-                send(p->socket, success_message, sizeof(success_message), 0);
-                pthread_mutex_unlock(&(p->socket_mutex));
-                break;
-            }
-            case OP_START_MATCH: {
-                if (!p) {
-                    char * msg = "Z03\nYou must authenticate first!";
-                    printf("[WARN] Start match failed: unauthenticated\n");
-                    send(client_socket, msg, strlen(msg), 0);
-                    break;
-                }
-                if (!p->isHost) {
-                    char error_messagge[] = "Z01\nYou are not the host";
-                    printf("[WARN] Start match failed: not host\n");
-                    pthread_mutex_lock(&(p->socket_mutex));
-                    send(client_socket, error_messagge, sizeof(error_messagge), 0);
-                    pthread_mutex_unlock(&(p->socket_mutex));
-                    break;
-                }
-                if (g_list_length(p->lobby->players) < MIN_PLAYERS) {
-                    char error_messagge[] = "Z01\nMinimum 4 players required";
-                    printf("[WARN] Start match failed: not enough players\n");
-                    pthread_mutex_lock(&(p->socket_mutex));
-                    send(client_socket, error_messagge, sizeof(error_messagge), 0);
-                    pthread_mutex_unlock(&(p->socket_mutex));
-                    break;
-                }
-                if (!p->lobby->match->terminated) {
-                    char error_messagge[] = "Z01\nWait for the match to finish to restart it";
-                    printf("[WARN] The host tried to restart the match before match was terminated\n");
-                    pthread_mutex_lock(&(p->socket_mutex));
-                    send(client_socket, error_messagge, sizeof(error_messagge), 0);
-                    pthread_mutex_unlock(&(p->socket_mutex));
-                    break;
-                }
-                char clockwise[1];
-                strncpy(clockwise,buffer+4,1);
-                clockwise[1]='\0';
-                Match* match = p->lobby->match;
-                match->turn = 0;
-                match->terminated = false;
-                match->word = NULL;
-                match->clockwise = (clockwise[0] != '0');
-                if (!match->clockwise) {
-                    pthread_mutex_lock(&(p->lobby->players_mutex));
-                    p->lobby->players = g_list_reverse(p->lobby->players);
-                    GList* last = g_list_last(p->lobby->players);
-                    p->lobby->players = g_list_delete_link(p->lobby->players, last);
-                    p->lobby->players = g_list_prepend(p->lobby->players, p->lobby->host);
-                    pthread_mutex_unlock(&(p->lobby->players_mutex));
-                }
-                printf("[INFO] Match started in lobby %s (host: %s)\n", p->lobby->id, p->username);
-                TurnContext context = {p, false, NULL};
-                g_list_foreach(p->lobby->players, match_turn_broadcast, &context);
+// The pushes in one format; the worker keeps one per format and fills in the
+// snapshot and delta when a subscriber using it comes up
+typedef struct {
+    guint from;       // version of the last push in the format
+    GBytes* before;   // its list
+    guint to;
+    GBytes* snapshot; // NULL until needed
+    GBytes* delta;
+} LobbyPush;
+
+GList* lobby_subscribers = NULL;
+pthread_mutex_t lobby_subscribers_mutex = PTHREAD_MUTEX_INITIALIZER;
+int lobby_push_interval_ms = 500;
+
+// "A05 <version>" then the list; binary: a u32 version, 0 when unversioned, then the entries
+GBytes* lobby_list_header(Connection* conn, bool versioned, guint version, GBytes* snapshot) {
+    if (conn_binary(conn)) {
+        GString* header = wire_begin(wire_code("A05"), 4);
+        wire_put_u32(header, versioned ? version : 0);
+        return wire_end(header, g_bytes_get_size(snapshot));
+    }
+    char header[32];
+    return g_bytes_new(header, versioned ? snprintf(header, sizeof(header), "A05 %u\n", version)
+                                         : snprintf(header, sizeof(header), "A05\n"));
+}
+
+// snapshot is in the format of the subscriber
+void lobby_send_list(LobbySubscriber* subscriber, GBytes* snapshot, guint version) {
+    GBytes* parts[2];
+    parts[0] = lobby_list_header(subscriber->conn, true, version, snapshot);
+    parts[1] = snapshot;
+    // the whole list makes the updates still queued for the subscriber moot
+    conn_push(subscriber->conn, parts, 2, KIND_LOBBY_LIST, true);
+    g_bytes_unref(parts[0]);
+    subscriber->version = version;
+}
+
+GBytes* lobby_delta(GBytes* before, GBytes* after, guint version, bool binary);
+
+// lobbyPush is the array of pushes, indexed by whether they are binary
+void lobby_broadcast_list(gpointer subscriber, gpointer lobbyPush) {
+    LobbySubscriber* sub = (LobbySubscriber*) subscriber;
+    bool binary = conn_binary(sub->conn);
+    LobbyPush* push = &((LobbyPush*) lobbyPush)[binary];
+    if (!push->snapshot) {
+        push->snapshot = lobby_snapshot_get(binary, &(push->to));
+        push->delta = lobby_delta(push->before, push->snapshot, push->to, binary);
+    }
+    // a subscriber behind on its reads gets the whole list instead of one more delta
+    if (sub->version != push->from || conn_congested(sub->conn)) {
+        lobby_send_list(sub, push->snapshot, push->to);
+        return;
+    }
+    conn_push(sub->conn, &(push->delta), 1, KIND_LOBBY_LIST, false);
+    sub->version = push->to;
+}
+
+// Indexes the entries of a snapshot by lobby id, as it is written in them: its
+// "<id> ..." lines, or its binary entries (id, max players, players, host)
+GHashTable* lobby_snapshot_lines(GBytes* snapshot, bool binary) {
+    GHashTable* lines = g_hash_table_new_full(g_bytes_hash, g_bytes_equal, (GDestroyNotify) g_bytes_unref,
+                                              (GDestroyNotify) g_bytes_unref);
+    gsize size;
+    const char* data = g_bytes_get_data(snapshot, &size);
+    const char* end = data + size;
+    while (binary && data < end) {
+        WireReader entry;
+        wire_reader_init(&entry, data, end - data);
+        LobbyId id;
+        char host[32];
+        wire_get_bytes(&entry, id.bytes, sizeof(id.bytes));
+        wire_get_u16(&entry);
+        wire_get_str8(&entry, host, sizeof(host));
+        if (!entry.ok) break;
+        g_hash_table_insert(lines, g_bytes_new(id.bytes, sizeof(id.bytes)), g_bytes_new(data, entry.pos));
+        data += entry.pos;
+    }
+    while (!binary && data < end) {
+        const char* newline = memchr(data, '\n', end - data);
+        if (!newline) newline = end;
+        const char* space = memchr(data, ' ', newline - data);
+        if (space) {
+            g_hash_table_insert(lines, g_bytes_new(data, space - data), g_bytes_new(data, newline - data));
+        }
+        data = newline + 1;
+    }
+    return lines;
+}
+
+// "A16 <version>" then "+<line>" for every new or changed lobby and "-<id>" for every removed one.
+// Binary: a u32 version, a u16 count of new or changed lobbies and their entries, then the removed ids.
+GBytes* lobby_delta(GBytes* before, GBytes* after, guint version, bool binary) {
+    GString* delta = g_string_new(NULL);
+    GString* removed = g_string_new(NULL);
+    int changed = 0;
+    GHashTable* old_lines = lobby_snapshot_lines(before, binary);
+    GHashTable* new_lines = lobby_snapshot_lines(after, binary);
+    GHashTableIter iter;
+    gpointer id, line;
+    g_hash_table_iter_init(&iter, new_lines);
+    while (g_hash_table_iter_next(&iter, &id, &line)) {
+        GBytes* old_line = g_hash_table_lookup(old_lines, id);
+        if (!old_line || !g_bytes_equal(old_line, line)) {
+            gsize len;
+            const char* data = g_bytes_get_data(line, &len);
+            if (!binary) g_string_append_c(delta, '+');
+            g_string_append_len(delta, data, len);
+            if (!binary) g_string_append_c(delta, '\n');
+            changed++;
+        }
+    }
+    g_hash_table_iter_init(&iter, old_lines);
+    while (g_hash_table_iter_next(&iter, &id, &line)) {
+        if (g_hash_table_contains(new_lines, id)) continue;
+        gsize len;
+        const char* data = g_bytes_get_data(id, &len);
+        if (!binary) g_string_append_c(removed, '-');
+        g_string_append_len(removed, data, len);
+        if (!binary) g_string_append_c(removed, '\n');
+    }
+    g_hash_table_destroy(old_lines);
+    g_hash_table_destroy(new_lines);
+    GString* message;
+    if (binary) {
+        message = wire_begin(wire_code("A16"), 6 + delta->len + removed->len);
+        wire_put_u32(message, version);
+        wire_put_u16(message, changed);
+    } else {
+        message = g_string_new(NULL);
+        g_string_printf(message, "A16 %u\n", version);
+    }
+    g_string_append_len(message, delta->str, delta->len);
+    g_string_append_len(message, removed->str, removed->len);
+    g_string_free(delta, TRUE);
+    g_string_free(removed, TRUE);
+    return binary ? wire_end(message, 0) : g_string_free_to_bytes(message);
+}
+
+void* lobby_push_worker(void* arg) {
+    // a format nobody subscribed with is not built; its next subscribers get whole lists
+    LobbyPush pushes[2];
+    for (int binary = 0; binary < 2; binary++) {
+        pushes[binary] = (LobbyPush) {0, g_bytes_new(NULL, 0), 0, NULL, NULL};
+    }
+    guint pushed_version = 0;
+    gint64 last_push = 0;
+    while (1) {
+        pthread_mutex_lock(&lobby_push_mutex);
+        while (__atomic_load_n(&lobby_list_version, __ATOMIC_ACQUIRE) == pushed_version) {
+            pthread_cond_wait(&lobby_push_cond, &lobby_push_mutex);
+        }
+        pthread_mutex_unlock(&lobby_push_mutex);
+        // let the changes of one interval pile up into one update
+        gint64 wait_us = last_push + lobby_push_interval_ms * 1000 - g_get_monotonic_time();
+        if (wait_us > 0) {
+            usleep(wait_us);
+        }
+        guint version = __atomic_load_n(&lobby_list_version, __ATOMIC_ACQUIRE);
+        pthread_mutex_lock(&lobby_subscribers_mutex);
+        if (lobby_subscribers) {
+            gint64 started = g_get_monotonic_time();
+            g_list_foreach(lobby_subscribers, lobby_broadcast_list, pushes);
+            metrics_observe(broadcast_list_metric, g_get_monotonic_time() - started);
+        }
+        pthread_mutex_unlock(&lobby_subscribers_mutex);
+        // the snapshots can be newer than version; the oldest one pushed is the new baseline
+        pushed_version = G_MAXUINT;
+        for (int binary = 0; binary < 2; binary++) {
+            LobbyPush* push = &pushes[binary];
+            if (!push->snapshot) continue;
+            pushed_version = MIN(pushed_version, push->to);
+            g_bytes_unref(push->before);
+            g_bytes_unref(push->delta);
+            push->before = push->snapshot;
+            push->from = push->to;
+            push->snapshot = NULL;
+        }
+        if (pushed_version == G_MAXUINT) pushed_version = version;
+        last_push = g_get_monotonic_time();
+    }
+    return NULL;
+}
+
+void lobby_subscribe(Connection* conn) {
+    guint version;
+    GBytes* snapshot = lobby_snapshot_get(conn_binary(conn), &version);
+    pthread_mutex_lock(&lobby_subscribers_mutex);
+    LobbySubscriber* sub = NULL;
+    for (GList* node = lobby_subscribers; node != NULL && !sub; node = node->next) {
+        if (((LobbySubscriber*) node->data)->conn == conn) sub = node->data;
+    }
+    if (!sub) {
+        sub = g_new(LobbySubscriber, 1);
+        sub->conn = connection_ref(conn);
+        lobby_subscribers = g_list_prepend(lobby_subscribers, sub);
+    }
+    lobby_send_list(sub, snapshot, version);
+    pthread_mutex_unlock(&lobby_subscribers_mutex);
+    g_bytes_unref(snapshot);
+}
+
+void lobby_unsubscribe(Connection* conn) {
+    pthread_mutex_lock(&lobby_subscribers_mutex);
+    for (GList* node = lobby_subscribers; node != NULL; node = node->next) {
+        LobbySubscriber* sub = (LobbySubscriber*) node->data;
+        if (sub->conn == conn) {
+            lobby_subscribers = g_list_delete_link(lobby_subscribers, node);
+            connection_unref(sub->conn);
+            g_free(sub);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lobby_subscribers_mutex);
+}
+
+pthread_mutex_t global_players_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void print_lobby(const Lobby* lobby){
+    LOG_INFO("lobby.create", LOBBY_NAME(lobby), lobby->host->username, "Lobby created: id %s",LOBBY_NAME(lobby));
+}
+
+void sanitize_username(char *buffer) {
+    int read_pos = 0;
+    int write_pos = 0;
+    while (buffer[read_pos] != '\0') {
+        if (isalnum(buffer[read_pos])) {
+            buffer[write_pos] = buffer[read_pos];
+            write_pos++;
+        }
+        read_pos++;
+    }
+    buffer[write_pos] = '\0';
+}
+
+bool is_username_logged_in(const char* username) {
+    pthread_mutex_lock(&global_players_mutex);
+    bool online = g_hash_table_contains(players_by_username, username);
+    pthread_mutex_unlock(&global_players_mutex);
+    return online;
+}
+
+// Adds p to both indexes unless its username is already online, so two logins
+// racing for one account cannot both get in. Call with global_players_mutex held.
+bool player_register(Player* p) {
+    if (g_hash_table_contains(players_by_username, p->username)) {
+        return false;
+    }
+    g_hash_table_insert(players_by_username, p->username, p);
+    g_hash_table_insert(players, &(p->id), p);
+    return true;
+}
+
+// Removes p, dropping the table reference. Call with global_players_mutex held.
+void player_unregister(Player* p) {
+    g_hash_table_remove(players_by_username, p->username);
+    g_hash_table_remove(players, &(p->id));
+}
+
+/* ** LOBBY STRAND ** */
+
+// Everything below named lobby_on_* runs on the lobby strand.
+
+void lobby_on_created(void* owner, void* arg) {
+    lobby_changed((Lobby*) owner);
+    lobby_request_free((LobbyRequest*) arg);
+}
+
+// OP_JOIN_LOBBY: seats p, or queues them while a match runs or the lobby is full.
+// p was bound to the lobby when the request was posted; a lobby closed since
+// unbinds them again, so nobody is left pointing at it once it is freed.
+void lobby_on_join(void* owner, void* arg)
+{
+    Lobby* lobby = (Lobby*) owner;
+    LobbyRequest* request = (LobbyRequest*) arg;
+    Player* p = request->player;
+    char* message;
+    bool seated = false;
+    if (!player_in(p, lobby)) {
+        // left the server meanwhile
+        lobby_request_free(request);
+        return;
+    }
+    if (lobby->closed) {
+        message = "Z01\nLobby not found";
+        LOG_WARN("lobby.join_failed", LOBBY_NAME(lobby), p->username, "Join lobby failed: lobby %s closed", LOBBY_NAME(lobby));
+        player_exit(p, lobby);
+    } else if ((!lobby->match->terminated || lobby->seated == lobby->max_players) && lobby->queued == MAX_QUEUED) {
+        message = "Z01\nThe lobby queue is full";
+        LOG_WARN("lobby.join_failed", LOBBY_NAME(lobby), p->username, "Join lobby failed: queue of lobby %s full", LOBBY_NAME(lobby));
+        player_exit(p, lobby);
+    } else if (!lobby->match->terminated) {
+        message = "A07\nThe match is already started, you are in a queue now";
+        LOG_INFO("lobby.queue", LOBBY_NAME(lobby), p->username, "Player %s queued for lobby %s (match already started)", p->username, LOBBY_NAME(lobby));
+        lobby_queue_push(lobby, player_ref(p));
+    } else if (lobby->seated == lobby->max_players) {
+        message = "A04\nThe lobby is full, you are in a queue now";
+        LOG_INFO("lobby.queue", LOBBY_NAME(lobby), p->username, "Player %s queued for lobby %s (lobby full)", p->username, LOBBY_NAME(lobby));
+        lobby_queue_push(lobby, player_ref(p));
+    } else {
+        message = "A01\nWelcome to the lobby";
+        LOG_INFO("lobby.join", LOBBY_NAME(lobby), p->username, "Player %s joined lobby %s", p->username, LOBBY_NAME(lobby));
+        lobby_seat(lobby, player_ref(p));
+        seated = true;
+    }
+    lobby_changed(lobby);
+    conn_send(p->conn, message, strlen(message) + 1);
+    if (seated) {
+        lobby_foreach_seat(lobby, lobby_broadcast_joined, p);
+    }
+    lobby_request_free(request);
+}
+
+// OP_LEAVE_LOBBY, or a disconnect when arg is set. A leaving host closes the lobby.
+void lobby_on_leave(void* owner, void* arg)
+{
+    Lobby* lobby = (Lobby*) owner;
+    LobbyRequest* request = (LobbyRequest*) arg;
+    Player* p = request->player;
+    bool disconnected = request->arg;
+    LeaveContext context = {p, lobby};
+    int seat = lobby_seat_of(lobby, p);
+    if (lobby->closed) {
+        // the host left first and unbound everybody
+    } else if (lobby->host == p) {
+        LOG_INFO("lobby.delete", LOBBY_NAME(lobby), p->username, "Host %s %s, deleting lobby %s", p->username, disconnected ? "disconnected" : "left", LOBBY_NAME(lobby));
+        lobby_foreach_seat(lobby, lobby_broadcast_disconnection, &context);
+        lobby_foreach_queued(lobby, lobby_broadcast_disconnection, &context);
+        registry_remove(lobbies, &(lobby->id));
+        lobby_clear(lobby);
+    } else if (lobby_queue_remove(lobby, p)) {
+        LOG_INFO("lobby.queue_leave", LOBBY_NAME(lobby), p->username, "Player %s left the queue", p->username);
+        if (!disconnected) {
+            char success_message[] = "A06\nYou left the queue";
+            conn_send(p->conn, success_message, sizeof(success_message));
+        }
+        lobby_changed(lobby);
+    } else if (seat >= 0) {
+        LOG_INFO("lobby.leave", LOBBY_NAME(lobby), p->username, "Player %s %s lobby %s", p->username, disconnected ? "disconnected from" : "leaving", LOBBY_NAME(lobby));
+        lobby_foreach_seat(lobby, lobby_broadcast_disconnection, &context);
+        match_set_running(lobby->match, false);
+        player_unref(lobby_unseat(lobby, seat));
+        if (lobby->queued > 0){
+            Player *queue_player = lobby_queue_pop(lobby);
+            lobby_seat(lobby, queue_player);
+            char success_message[] = "A01\nWelcome to the lobby";
+            LOG_INFO("lobby.promote", LOBBY_NAME(lobby), queue_player->username, "Player %s joined from queue", queue_player->username);
+            conn_send(queue_player->conn, success_message, sizeof(success_message));
+        }
+        lobby_changed(lobby);
+    }
+    player_exit(p, lobby);
+    if (!disconnected) {
+        char success_message[] = "A03\nYou left the lobby";
+        conn_send(p->conn, success_message, sizeof(success_message));
+    }
+    lobby_request_free(request);
+}
+
+// OP_START_MATCH, arg is the direction
+void lobby_on_start(void* owner, void* arg)
+{
+    Lobby* lobby = (Lobby*) owner;
+    LobbyRequest* request = (LobbyRequest*) arg;
+    Player* p = request->player;
+    if (lobby->closed || lobby->host != p) {
+        char error_messagge[] = "Z01\nYou are not the host";
+        LOG_WARN("match.start_failed", LOBBY_NAME(lobby), p->username, "Start match failed: not host");
+        conn_send(p->conn, error_messagge, sizeof(error_messagge));
+    } else if (lobby->seated < MIN_PLAYERS) {
+        char error_messagge[] = "Z01\nMinimum 4 players required";
+        LOG_WARN("match.start_failed", LOBBY_NAME(lobby), p->username, "Start match failed: not enough players");
+        conn_send(p->conn, error_messagge, sizeof(error_messagge));
+    } else if (!lobby->match->terminated) {
+        char error_messagge[] = "Z01\nWait for the match to finish to restart it";
+        LOG_WARN("match.start_failed", LOBBY_NAME(lobby), p->username, "The host tried to restart the match before match was terminated");
+        conn_send(p->conn, error_messagge, sizeof(error_messagge));
+    } else {
+        match_start(lobby, request->arg);
+    }
+    lobby_request_free(request);
+}
+
+// OP_SPEAK, text is the word
+void lobby_on_speak(void* owner, void* arg)
+{
+    Lobby* lobby = (Lobby*) owner;
+    LobbyRequest* request = (LobbyRequest*) arg;
+    Player* p = request->player;
+    Match* match = lobby->match;
+    if (lobby->closed || lobby_seat_of(lobby, p) < 0) {
+        char error_messagge[] = "Z01\nYou are not in a lobby";
+        LOG_WARN("match.speak_failed", LOBBY_NAME(lobby), p->username, "Speak failed: not in a lobby");
+        conn_send(p->conn, error_messagge, sizeof(error_messagge));
+    } else if (match->terminated) {
+        char error_messagge[] = "Z01\nThe match is terminated";
+        LOG_WARN("match.speak_failed", LOBBY_NAME(lobby), p->username, "Speak failed: match terminated");
+        conn_send(p->conn, error_messagge, sizeof(error_messagge));
+    } else if (match->pending || lobby_turn_player(lobby, match->turn) != p) {
+        char error_messagge[] = "Z01\nIs not your turn";
+        LOG_WARN("match.speak_failed", LOBBY_NAME(lobby), p->username, "Speak failed: not player's turn");
+        conn_send(p->conn, error_messagge, sizeof(error_messagge));
+    } else {
+        Player* nextPlayer = lobby_turn_player(lobby, match->turn + 1);
+        bool last = nextPlayer == NULL;
+        if (last) nextPlayer = p;
+        char* phrase;
+        if (match->turn == 0) {
+            phrase = g_strdup(request->text);
+            match->word = g_slist_append(match->word, phrase);
+        } else {
+            GSList* prev_node = g_slist_last(match->word);
+            char* current_phrase = malloc(MAX_LENGTH*MAX_PLAYERS);
+            LOG_DEBUG("match.phrase", LOBBY_NAME(lobby), p->username, "The concatenation is %s %s", (char*) prev_node->data, request->text);
+            snprintf(current_phrase, MAX_LENGTH*MAX_PLAYERS, "%s %s", (char*) prev_node->data, request->text);
+            free(prev_node->data);
+            prev_node->data = current_phrase;
+            phrase = current_phrase;
+            LOG_DEBUG("match.phrase", LOBBY_NAME(lobby), p->username, "The current phrase is %s", (char*) prev_node->data);
+        }
+        if (match->turn == 0 || !last) {
+            // the turn moves on in lobby_on_turn_translated, the strand goes on with other requests
+            match->pending = true;
+            TurnJob* job = g_new(TurnJob, 1);
+            job->lobby = lobby_ref(lobby);
+            job->round = match->round;
+            translate_async(phrase, p->language, nextPlayer->language, speak_translated, job);
+        } else {
+            match_advance(lobby);
+        }
+    }
+    lobby_request_free(request);
+}
+
+// Creates a lobby hosted by p and registers it. Returns a new reference, or NULL
+// when there is no room for it or p cannot take it (in another lobby, offline).
+Lobby* lobby_new(Player* p, int max_players, bool matchmade)
+{
+    Lobby *lobby = pool_alloc(lobbies_pool, NULL);
+    lobby_id_generate(&(lobby->id));
+    lobby->host = p;
+    lobby->max_players = max_players;
+    lobby->seated = 0;
+    lobby->queue_head = 0;
+    lobby->queued = 0;
+    lobby->refs = 1;
+    lobby->closed = false;
+    lobby->matchmade = matchmade;
+    lobby->strand = strand_new(lobby, lobby_ref_data, lobby_unref_data);
+    lobby->match = malloc(sizeof(Match));
+    lobby->match->round = 0;
+    lobby->match->stride = 1;
+    lobby->match->terminated = true;
+    lobby->match->pending = false;
+    lobby->match->word = NULL;
+    if (!player_enter(p, lobby)) {
+        lobby_unref(lobby);
+        return NULL;
+    }
+    lobby_seat(lobby, player_ref(p));
+    if (!registry_insert(lobbies, &(lobby->id), lobby_ref(lobby))) {
+        player_exit(p, lobby);
+        lobby_unref(lobby);
+        lobby_unref(lobby);
+        return NULL;
+    }
+    lobby_post(lobby, lobby_on_created, NULL, 0, NULL, NULL);
+    print_lobby(lobby);
+    LOG_INFO("lobby.create", LOBBY_NAME(lobby), p->username, "Lobby created, number of lobbies: %d", registry_size(lobbies));
+    return lobby;
+}
+
+/* ** MATCHMAKING ** */
+
+// Seats the players the matchmaker bound to the lobby while it has room and no
+// match runs and hands the others back, then starts the match once the lobby is
+// big enough. data is the MatchGroup; players gone since it was cut no longer resolve.
+void lobby_on_seat(void* owner, void* arg)
+{
+    Lobby* lobby = (Lobby*) owner;
+    LobbyRequest* request = (LobbyRequest*) arg;
+    MatchGroup* group = (MatchGroup*) request->data;
+    Player* players[MATCHMAKER_MAX_GROUP];
+    bool seated[MATCHMAKER_MAX_GROUP] = {false};
+    int count = 0;
+    for (int i = 0; i < group->count; i++) {
+        Player* p = players[i] = player_lookup(group->players[i]);
+        if (p && !lobby->closed && lobby->match->terminated && lobby->seated < lobby->max_players && player_in(p, lobby)) {
+            lobby_seat(lobby, player_ref(p));
+            seated[i] = true;
+            count++;
+        }
+    }
+    // backwards, so the rest keeps its order at the head of the bucket
+    for (int i = group->count - 1; i >= 0; i--) {
+        if (players[i] && !seated[i]) {
+            player_exit(players[i], lobby);
+            player_requeue(players[i], group->language, group->size);
+        }
+    }
+    if (count > 0) {
+        lobby_changed(lobby);
+    }
+    for (int i = 0; i < group->count; i++) {
+        Player* p = players[i];
+        if (seated[i]) {
+            char message[] = "A01\nWelcome to the lobby";
+            LOG_INFO("match.seat", LOBBY_NAME(lobby), p->username, "Matchmaker seated %s in lobby %s", p->username, LOBBY_NAME(lobby));
+            conn_send(p->conn, message, sizeof(message));
+            lobby_foreach_seat(lobby, lobby_broadcast_joined, p);
+        }
+    }
+    if (count > 0 && lobby->seated >= MIN_PLAYERS) {
+        match_start(lobby, true);
+    }
+    for (int i = 0; i < group->count; i++) {
+        if (players[i]) player_unref(players[i]);
+    }
+    g_free(group);
+    lobby_request_free(request);
+}
+
+// Runs on the matchmaker thread, outside its lock, so a player may cancel,
+// create or join a lobby, or disconnect while this runs. The players are resolved
+// from their handles and bound with player_enter, which refuses those who left or
+// are in another lobby by now; binding them here keeps them out of other lobbies
+// until the strand seats them. New lobbies count against MAX_LOBBIES.
+void matchmaker_fill(MatchGroup* group, void* unused)
+{
+    Player* players[MATCHMAKER_MAX_GROUP];
+    for (int i = 0; i < group->count; i++) {
+        players[i] = player_lookup(group->players[i]);
+    }
+    bool top_up = !lobby_id_is_null(&(group->lobby_id));
+    Lobby* lobby = NULL;
+    int from = 0;
+    if (top_up) {
+        lobby = (Lobby*) registry_lookup(lobbies, &(group->lobby_id));
+    } else {
+        // the first player still online hosts
+        while (!lobby && from < group->count && registry_size(lobbies) < max_lobbies) {
+            Player* host = players[from++];
+            if (!host) continue;
+            lobby = lobby_new(host, group->size, true);
+            if (lobby) {
+                conn_send_lobby_created(host->conn, &(lobby->id));
+            } else {
+                player_requeue(host, group->language, group->size);
+            }
+        }
+    }
+    if (!lobby) {
+        if (!top_up) {
+            LOG_WARN("match.no_room", NULL, NULL, "Matchmaker: no room for a new lobby, %d players keep waiting (MAX_LOBBIES %d)", group->count, max_lobbies);
+        }
+        for (int i = group->count - 1; i >= from; i--) {
+            if (players[i]) player_requeue(players[i], group->language, group->size);
+        }
+    } else {
+        MatchGroup* seats = g_new(MatchGroup, 1);
+        *seats = *group;
+        seats->count = 0;
+        for (int i = from; i < group->count; i++) {
+            if (players[i] && player_enter(players[i], lobby)) {
+                seats->players[seats->count++] = group->players[i];
+            }
+        }
+        if (seats->count > 0) {
+            lobby_post(lobby, lobby_on_seat, NULL, 0, NULL, seats);
+        } else {
+            g_free(seats);
+        }
+        lobby_unref(lobby);
+    }
+    for (int i = 0; i < group->count; i++) {
+        if (players[i]) player_unref(players[i]);
+    }
+}
+
+typedef struct {
+    Connection* conn;
+    char username[32];
+} AuthRequest;
+
+AuthRequest* auth_request_new(Connection* conn, const char* username) {
+    AuthRequest* request = g_new(AuthRequest, 1);
+    request->conn = connection_ref(conn);
+    strcpy(request->username, username);
+    return request;
+}
+
+void auth_request_free(AuthRequest* request) {
+    connection_unref(request->conn);
+    g_free(request);
+}
+
+void signup_done(int result, const char* uuid, const char* language, void* data) {
+    AuthRequest* request = (AuthRequest*) data;
+    Connection* conn = request->conn;
+    if (result == AUTH_OK) {
+        char * msg = "B01\nSignup successful!";
+        LOG_INFO("auth.signup", NULL, request->username, "Signup successful for user %s", request->username);
+        conn_send(conn, msg, strlen(msg));
+    } else if (result == AUTH_WRONG_PASSWORD) {
+        char * msg = "Z02\nUsername already exists";
+        LOG_WARN("auth.signup_failed", NULL, request->username, "Signup failed: username %s already exists", request->username);
+        conn_send(conn, msg, strlen(msg));
+    } else {
+        char * msg = "Z00\nServer error, try again";
+        LOG_WARN("auth.signup_failed", NULL, request->username, "Signup failed: database error for %s", request->username);
+        conn_send(conn, msg, strlen(msg));
+    }
+    auth_request_free(request);
+}
+
+void login_done(int result, const char* uuid, const char* language, void* data) {
+    AuthRequest* request = (AuthRequest*) data;
+    Connection* conn = request->conn;
+    if (result == AUTH_OK) {
+        Player* p = pool_alloc(players_pool, NULL);
+        p->id = pool_handle(p);
+        strcpy(p->username, request->username);
+        p->conn = connection_ref(conn);
+        p->lobby = NULL;
+        p->gone = false;
+        pthread_mutex_init(&(p->mutex), NULL);
+        p->refs = 1;
+        strncpy(p->language, language, 2);
+        p->language[2] = '\0';
+        // handle_disconnect reads conn->player under the same lock after marking the connection closed
+        pthread_mutex_lock(&global_players_mutex);
+        bool closed = __atomic_load_n(&(conn->closed), __ATOMIC_ACQUIRE);
+        bool registered = !closed && player_register(p);
+        if (registered) {
+            __atomic_store_n(&(conn->player), p, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&global_players_mutex);
+        if (registered) {
+            if (conn_binary(conn)) {
+                // binary: the username
+                GString* binary = wire_begin(wire_code("B02"), strlen(p->username));
+                g_string_append(binary, p->username);
+                conn_send_binary(conn, binary);
+            } else {
+                char msg[128];
+                snprintf(msg, sizeof(msg), "B02\nLogin successful! Your username is %s\n", p->username);
+                conn_send(conn, msg, strlen(msg));
+            }
+            LOG_INFO("auth.login", NULL, p->username, "User logged in %s (%s) --> %s", p->username, uuid, p->language);
+        } else if (closed) {
+            LOG_INFO("auth.login", NULL, p->username, "Login of %s completed after the client left", p->username);
+            player_unref(p);
+        } else {
+            char * msg = "Z02\nUser already logged in from another client";
+            LOG_WARN("auth.login_failed", NULL, p->username, "Login failed: user %s already logged in", p->username);
+            conn_send(conn, msg, strlen(msg));
+            player_unref(p);
+        }
+    } else if (result == AUTH_WRONG_PASSWORD) {
+        char * msg = "Z03\nWrong password";
+        LOG_WARN("auth.login_failed", NULL, request->username, "Login failed: wrong password for %s", request->username);
+        conn_send(conn, msg, strlen(msg));
+    } else if (result == AUTH_NOT_FOUND) {
+        char * msg = "Z03\nUser not found";
+        LOG_WARN("auth.login_failed", NULL, request->username, "Login failed: user %s not found", request->username);
+        conn_send(conn, msg, strlen(msg));
+    } else {
+        char * msg = "Z00\nServer error, try again";
+        LOG_WARN("auth.login_failed", NULL, request->username, "Login failed: server error for %s", request->username);
+        conn_send(conn, msg, strlen(msg));
+    }
+    __atomic_store_n(&(conn->auth_pending), false, __ATOMIC_RELEASE);
+    auth_request_free(request);
+}
+
+/* ** REQUESTS ** */
+
+// A request decoded from either wire format. The fields set depend on op; valid
+// is false when the arguments op needs are missing or malformed.
+typedef struct {
+    int op;
+    bool valid;
+    char language[3];
+    char username[32];
+    char password[32];
+    LobbyId lobby_id;
+    bool versioned; // OP_GET_LOBBIES carries the last version seen
+    guint version;
+    guint64 cursor; // OP_FIND_LOBBIES
+    int limit;
+    LobbyFilter filter;
+    int value; // OP_SUBSCRIBE_LOBBIES on, OP_FIND_MATCH size, OP_START_MATCH direction, OP_PROTOCOL version
+    int word_len; // OP_SPEAK, the word is only set when shorter than MAX_LENGTH
+    char word[MAX_LENGTH];
+} Request;
+
+// "<op> <arguments>", NUL terminated
+void request_parse_text(const char* buffer, Request* request)
+{
+    memset(request, 0, sizeof(*request));
+    char op[4];
+    strncpy(op,buffer,3);
+    op[3] = '\0';
+    request->op = atoi(op);
+    request->valid = true;
+    switch (request->op)
+    {
+        case OP_SIGNUP:
+            // Format: 201 <lang> <username> <password>
+            request->valid = sscanf(buffer+4, "%2s %31s %31s", request->language, request->username, request->password) == 3;
+            break;
+        case OP_LOGIN:
+            // Format: 202 <username> <password>
+            request->valid = sscanf(buffer+4, "%31s %31s", request->username, request->password) == 2;
+            break;
+        case OP_JOIN_LOBBY: {
+            // Format: 101 <lobby id>, a malformed id finds no lobby
+            char id[37] = "";
+            if (strlen(buffer) > 4) g_strlcpy(id, buffer + 4, sizeof(id));
+            lobby_id_parse(id, &(request->lobby_id));
+            break;
+        }
+        case OP_GET_LOBBIES:
+            // Format: 102 [<last seen version>]
+            request->versioned = sscanf(buffer+3, " %u", &(request->version)) == 1;
+            break;
+        case OP_SUBSCRIBE_LOBBIES:
+            // Format: 105 <1 to subscribe, 0 to unsubscribe>
+            request->value = atoi(buffer+4);
+            break;
+        case OP_FIND_MATCH:
+            // Format: 106 [<lobby size>], 0 leaves matchmaking
+            request->value = MIN_PLAYERS;
+            sscanf(buffer+3, " %d", &(request->value));
+            break;
+        case OP_FIND_LOBBIES: {
+            // Format: 104 <cursor> <limit> [free] [open] [lang=<xx>] [queue=<max queued>]
+            int used;
+            request->filter = (LobbyFilter) {false, false, "", -1};
+            request->valid = sscanf(buffer+3, " %" G_GUINT64_FORMAT " %d%n", &(request->cursor), &(request->limit), &used) == 2 &&
+                             request->limit > 0;
+            if (!request->valid) break;
+            char* filters = g_strdup(buffer + 3 + used);
+            char* save = NULL;
+            for (char* token = strtok_r(filters, " ", &save); token; token = strtok_r(NULL, " ", &save)) {
+                if (strcmp(token, "free") == 0) request->filter.free_slots = true;
+                else if (strcmp(token, "open") == 0) request->filter.not_running = true;
+                else if (strncmp(token, "lang=", 5) == 0) g_strlcpy(request->filter.language, token + 5, sizeof(request->filter.language));
+                else if (strncmp(token, "queue=", 6) == 0) request->filter.max_queued = atoi(token + 6);
+            }
+            g_free(filters);
+            break;
+        }
+        case OP_START_MATCH:
+            // Format: 110 <1 clockwise, 0 counter-clockwise>
+            request->value = buffer[4] != '0';
+            break;
+        case OP_SPEAK: {
+            // Format: 111 <two digit length> <word>
+            char word_len[3];
+            strncpy(word_len, buffer+4, 2);
+            word_len[2] = '\0';
+            request->word_len = atoi(word_len);
+            if (request->word_len >= 0 && request->word_len < MAX_LENGTH) {
+                strncpy(request->word, buffer+7, request->word_len);
+                request->word[request->word_len] = '\0';
+            }
+            break;
+        }
+        case OP_PROTOCOL:
+            // Format: 300 <version>
+            request->value = atoi(buffer+4);
+            break;
+    }
+}
+
+// The payload of a binary request with the opcode op. Strings are str8, lobby
+// ids raw; OP_FIND_LOBBIES is a u64 cursor, u8 limit, u8 flags (1 free slots,
+// 2 not running), two bytes of language (zeros for any) and a u8 queue
+// length (255 for any).
+void request_parse_binary(guint16 op, const guint8* payload, guint32 len, Request* request)
+{
+    memset(request, 0, sizeof(*request));
+    request->op = op;
+    WireReader in;
+    wire_reader_init(&in, payload, len);
+    switch (op)
+    {
+        case OP_SIGNUP:
+            wire_get_bytes(&in, request->language, 2);
+            wire_get_str8(&in, request->username, sizeof(request->username));
+            wire_get_str8(&in, request->password, sizeof(request->password));
+            break;
+        case OP_LOGIN:
+            wire_get_str8(&in, request->username, sizeof(request->username));
+            wire_get_str8(&in, request->password, sizeof(request->password));
+            break;
+        case OP_JOIN_LOBBY:
+            wire_get_bytes(&in, request->lobby_id.bytes, sizeof(request->lobby_id.bytes));
+            break;
+        case OP_GET_LOBBIES:
+            request->versioned = len >= 4;
+            if (request->versioned) request->version = wire_get_u32(&in);
+            break;
+        case OP_SUBSCRIBE_LOBBIES:
+            request->value = wire_get_u8(&in);
+            break;
+        case OP_FIND_MATCH:
+            request->value = len > 0 ? wire_get_u8(&in) : MIN_PLAYERS;
+            break;
+        case OP_FIND_LOBBIES: {
+            request->filter = (LobbyFilter) {false, false, "", -1};
+            request->cursor = wire_get_u64(&in);
+            request->limit = wire_get_u8(&in);
+            guint8 flags = wire_get_u8(&in);
+            request->filter.free_slots = flags & 1;
+            request->filter.not_running = flags & 2;
+            wire_get_bytes(&in, request->filter.language, 2);
+            guint8 max_queued = wire_get_u8(&in);
+            request->filter.max_queued = max_queued == G_MAXUINT8 ? -1 : max_queued;
+            in.ok = in.ok && request->limit > 0;
+            break;
+        }
+        case OP_START_MATCH:
+            request->value = len == 0 || wire_get_u8(&in) != 0;
+            break;
+        case OP_SPEAK:
+            request->word_len = len > 0 ? payload[0] : 0;
+            wire_get_str8(&in, request->word, sizeof(request->word));
+            break;
+        case OP_PROTOCOL:
+            request->value = wire_get_u16(&in);
+            break;
+    }
+    request->valid = in.ok;
+}
+
+void handle_request(Connection* conn, Request* request)
+{
+    Player *p = conn_player(conn);
+    gint64 started = g_get_monotonic_time();
+    switch (request->op)
+    {
+        case OP_SIGNUP: {
+            char* lang = request->language;
+            char* username = request->username;
+            char* password = request->password;
+            // the auth workers answer in this format
+            conn->negotiable = false;
+            if (!request->valid) {
+                char * msg = "Z01\nUsage: 201 <lang> <username> <password>";
+                LOG_WARN("auth.signup_failed", NULL, NULL, "Signup failed: bad request format");
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            sanitize_username(username);
+            if (strlen(username) < 5 || strlen(username) > 15) {
+                char * msg = "Z01\nUsername must be 5-15 chars";
+                LOG_WARN("auth.signup_failed", NULL, NULL, "Signup failed: username length invalid");
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            // hashing is slow on purpose, it runs on the auth workers
+            AuthRequest* request = auth_request_new(conn, username);
+            if (!auth_signup(username, password, lang, signup_done, request)) {
+                auth_request_free(request);
+                char * msg = "Z00\nServer busy, try again";
+                LOG_WARN("auth.signup_failed", NULL, NULL, "Signup failed: auth queue full");
+                conn_send(conn, msg, strlen(msg));
+            }
+            break;
+        }
+        case OP_LOGIN: {
+            char* username = request->username;
+            char* password = request->password;
+            conn->negotiable = false;
+            if (!request->valid) {
+                char * msg = "Z01\nUsage: 202 <username> <password>";
+                LOG_WARN("auth.login_failed", NULL, NULL, "Login failed: bad request format");
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            sanitize_username(username);
+            // early answer without hashing; player_register makes the binding check
+            if (is_username_logged_in(username)) {
+                char * msg = "Z02\nUser already logged in from another client";
+                LOG_WARN("auth.login_failed", NULL, username, "Login failed: user %s already logged in", username);
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            if (p) {
+                char * msg = "Z02\nAlready logged in!";
+                LOG_WARN("auth.login_failed", NULL, p->username, "Login failed: already logged in");
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            if (__atomic_exchange_n(&(conn->auth_pending), true, __ATOMIC_ACQ_REL)) {
+                char * msg = "Z02\nLogin already in progress";
+                LOG_WARN("auth.login_failed", NULL, NULL, "Login failed: login already in progress on socket %d", conn->socket);
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            AuthRequest* request = auth_request_new(conn, username);
+            if (!auth_login(username, password, login_done, request)) {
+                __atomic_store_n(&(conn->auth_pending), false, __ATOMIC_RELEASE);
+                auth_request_free(request);
+                char * msg = "Z00\nServer busy, try again";
+                LOG_WARN("auth.login_failed", NULL, NULL, "Login failed: auth queue full");
+                conn_send(conn, msg, strlen(msg));
+            }
+            break;
+        }
+        case OP_CREATE_LOBBY: {
+            if (!p) {
+                char * msg = "Z03\nYou must authenticate first!";
+                LOG_WARN("lobby.create_failed", NULL, NULL, "Create lobby failed: unauthenticated");
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            matchmaker_cancel(p->id);
+            if(player_in_lobby(p)){
+                char error_messagge[] = "Z01\nYou cannot create a lobby since you already are in one";
+                LOG_WARN("lobby.create_failed", NULL, p->username, "Create lobby failed: already in a lobby");
+                conn_send(conn, error_messagge, sizeof(error_messagge));
+                break;
+            }
+            if(registry_size(lobbies) >= max_lobbies){
+                char error_messagge[] = "Z00\nWe have not room for other lobbies at the moment. Try later!";
+                LOG_WARN("lobby.create_failed", NULL, p->username, "Create lobby failed: max lobbies reached");
+                conn_send(conn, error_messagge, sizeof(error_messagge));
+                break;
+            }
+            Lobby *lobby = lobby_new(p, MAX_PLAYERS, false);
+            if (!lobby && player_in_lobby(p)) {
+                // a matchmaker pass that cut p before the cancel seated them meanwhile
+                char error_messagge[] = "Z01\nYou cannot create a lobby since you already are in one";
+                LOG_WARN("lobby.create_failed", NULL, p->username, "Create lobby failed: already in a lobby");
+                conn_send(conn, error_messagge, sizeof(error_messagge));
+                break;
+            }
+            if (!lobby) {
+                // another create took the last slot since the check above
+                char error_messagge[] = "Z00\nWe have not room for other lobbies at the moment. Try later!";
+                LOG_WARN("lobby.create_failed", NULL, p->username, "Create lobby failed: max lobbies reached");
+                conn_send(conn, error_messagge, sizeof(error_messagge));
+                break;
+            }
+            conn_send_lobby_created(conn, &(lobby->id));
+            lobby_unref(lobby);
+            break;
+        }
+        case OP_JOIN_LOBBY : {
+            if (!p) {
+                char * msg = "Z03\nYou must authenticate first!";
+                LOG_WARN("lobby.join_failed", NULL, NULL, "Join lobby failed: unauthenticated");
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            const LobbyId* lobby_id = &(request->lobby_id);
+            matchmaker_cancel(p->id);
+            if(player_in_lobby(p)){
+                char error_messagge[] = "Z01\nYou are already in a lobby";
+                LOG_WARN("lobby.join_failed", NULL, p->username, "Join lobby failed: already in a lobby");
+                conn_send(conn, error_messagge, sizeof(error_messagge));
                 break;
             }
-            case OP_SPEAK: {
-                if (!p) {
-                    char * msg = "Z03\nYou must authenticate first!";
-                    printf("[WARN] Speak failed: unauthenticated\n");
-                    send(client_socket, msg, strlen(msg), 0);
-                    break;
-                }
-                if (!p->lobby) {
-                    char error_messagge[] = "Z01\nYou are not in a lobby";
-                    printf("[WARN] Speak failed: not in a lobby\n");
-                    pthread_mutex_lock(&(p->socket_mutex));
-                    send(client_socket, error_messagge, sizeof(error_messagge), 0);
-                    pthread_mutex_unlock(&(p->socket_mutex));
-                    break;
-                }
-                if (p->lobby->match->terminated) {
-                    char error_messagge[] = "Z01\nThe match is terminated";
-                    printf("[WARN] Speak failed: match terminated\n");
-                    pthread_mutex_lock(&(p->socket_mutex));
-                    send(client_socket, error_messagge, sizeof(error_messagge), 0);
-                    pthread_mutex_unlock(&(p->socket_mutex));
-                    break;
-                }
-                GList* player_node = g_list_nth(p->lobby->players, p->lobby->match->turn);
-                if (p->id != ((Player*) player_node->data)->id) {
-                    char error_messagge[] = "Z01\nIs not your turn";
-                    printf("[WARN] Speak failed: not player's turn\n");
-                    pthread_mutex_lock(&(p->socket_mutex));
-                    send(client_socket, error_messagge, sizeof(error_messagge), 0);
-                    pthread_mutex_unlock(&(p->socket_mutex));
-                    break;
-                }
 
-                char word_len[3];
-                strncpy(word_len, buffer+4, 2);
-                word_len[2] = '\0';
-                int len = atoi(word_len);
-                printf("[INFO] Inserted word length is %d\n", len);
-
-                if (len >= MAX_LENGTH) {
-                    char error_messagge[] = "Z01\nThe maximum length is 30";
-                    printf("[WARN] Speak failed: word too long\n");
-                    pthread_mutex_lock(&(p->socket_mutex));
-                    send(client_socket, error_messagge, sizeof(error_messagge), 0);
-                    pthread_mutex_unlock(&(p->socket_mutex));
-                    break;
-                }
-                char* word = malloc(len*sizeof(char)+1);
-                strncpy(word, buffer+7, len);
-                word[len] = '\0';
-                
-                printf("[INFO] The parsed word is: %s\n", word);
-                char* translated_phrase = malloc(MAX_PLAYERS*(MAX_LENGTH + 1));
-
-                GList* nextNode = player_node->next;
-                Player* nextPlayer = NULL;
-                if (nextNode) {
-                    nextPlayer = (Player*) nextNode->data;
+            Lobby *lobby = (Lobby *) registry_lookup(lobbies, lobby_id);
+            if(!lobby){
+                char error_messagge[] = "Z01\nLobby not found";
+                LOG_WARN("lobby.join_failed", NULL, p->username, "Join lobby failed: lobby not found");
+                conn_send(conn, error_messagge, sizeof(error_messagge));
+                break;
+            }
+            // bound right away, so a second join before the strand runs this one is refused
+            if (player_enter(p, lobby)) {
+                lobby_post(lobby, lobby_on_join, p, 0, NULL, NULL);
+            } else {
+                char error_messagge[] = "Z01\nYou are already in a lobby";
+                LOG_WARN("lobby.join_failed", NULL, p->username, "Join lobby failed: already in a lobby");
+                conn_send(conn, error_messagge, sizeof(error_messagge));
+            }
+            lobby_unref(lobby);
+            break;
+        }
+        case OP_GET_LOBBIES: {
+            if (!p) {
+                char * msg = "Z03\nYou must authenticate first!";
+                LOG_WARN("lobby.list_failed", NULL, NULL, "Get lobbies failed: unauthenticated");
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            bool versioned = request->versioned;
+            guint version;
+            GBytes* snapshot = lobby_snapshot_get(conn_binary(conn), &version);
+            if (versioned && request->version == version) {
+                if (conn_binary(conn)) {
+                    GString* binary = wire_begin(wire_code("A14"), 4);
+                    wire_put_u32(binary, version);
+                    conn_send_binary(conn, binary);
                 } else {
-                    nextPlayer = p;
+                    char msg[32];
+                    snprintf(msg, sizeof(msg), "A14 %u", version);
+                    conn_send(conn, msg, strlen(msg));
                 }
-
-                if (p->lobby->match->turn == 0) {
-                    p->lobby->match->word = g_slist_append(p->lobby->match->word, word);
-                    if (translate(p->lobby->translator, word, p->language, nextPlayer->language, translated_phrase, MAX_PLAYERS*(MAX_LENGTH+1)) == 0) {
-                        p->lobby->match->word = g_slist_append(p->lobby->match->word, translated_phrase);
-                    } else {
-                        p->lobby->match->word = g_slist_append(p->lobby->match->word, word);
-                        free(translated_phrase);
-                    }
+                g_bytes_unref(snapshot);
+                break;
+            }
+            GBytes* parts[2];
+            parts[0] = lobby_list_header(conn, versioned, version, snapshot);
+            parts[1] = snapshot;
+            LOG_SAMPLED(LOG_LEVEL_INFO, "lobby.list", NULL, p->username, "Sending lobby list v%u to %s", version, p->username);
+            conn_sendv(conn, parts, 2);
+            g_bytes_unref(parts[0]);
+            g_bytes_unref(snapshot);
+            break;
+        }
+        case OP_SUBSCRIBE_LOBBIES: {
+            if (!p) {
+                char * msg = "Z03\nYou must authenticate first!";
+                LOG_WARN("lobby.subscribe_failed", NULL, NULL, "Subscribe failed: unauthenticated");
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            if (request->value != 0) {
+                LOG_INFO("lobby.subscribe", NULL, p->username, "%s subscribed to the lobby list", p->username);
+                lobby_subscribe(conn);
+            } else {
+                LOG_INFO("lobby.unsubscribe", NULL, p->username, "%s unsubscribed from the lobby list", p->username);
+                lobby_unsubscribe(conn);
+            }
+            break;
+        }
+        case OP_FIND_MATCH: {
+            if (!p) {
+                char * msg = "Z03\nYou must authenticate first!";
+                LOG_WARN("match.find_failed", NULL, NULL, "Find match failed: unauthenticated");
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            int size = request->value;
+            if (size == 0) {
+                if (matchmaker_cancel(p->id)) {
+                    char * msg = "A18\nYou left matchmaking";
+                    LOG_INFO("match.find_cancel", NULL, p->username, "%s left matchmaking", p->username);
+                    conn_send(conn, msg, strlen(msg));
                 } else {
-                    GSList* prev_node = g_slist_last(p->lobby->match->word);
-                    char* current_phrase = malloc(MAX_LENGTH*MAX_PLAYERS);
-                    printf("[INFO] The concatenation is %s %s\n", (char*) prev_node->data, word);
-                    snprintf(current_phrase, MAX_LENGTH*MAX_PLAYERS, "%s %s", (char*) prev_node->data, word);
-                    free(prev_node->data);
-                    prev_node->data = current_phrase;
-                    printf("[INFO] The current phrase is %s\n", (char*) prev_node->data);
-                    if (nextNode) {
-                        if (translate(p->lobby->translator, (char*) prev_node->data, p->language, nextPlayer->language, translated_phrase, MAX_PLAYERS*(MAX_LENGTH+1)) == 0) {
-                            p->lobby->match->word = g_slist_append(p->lobby->match->word, translated_phrase);
-                        } else {
-                            p->lobby->match->word = g_slist_append(p->lobby->match->word, (char*) prev_node->data);
-                            free(translated_phrase);
-                        }
-                    }
-                }
-                p->lobby->match->turn++;
-                if(p->lobby->match->turn >= g_list_length(p->lobby->players)) {
-                    p->lobby->match->terminated = true;
-                    printf("[INFO] Match terminated in lobby %s\n", p->lobby->id);
-                }
-                TurnContext context = {nextPlayer, p->lobby->match->terminated, p->lobby->match->word};
-                g_list_foreach(p->lobby->players, match_turn_broadcast, &context);
-                if (p->lobby->match->terminated) {
-                    pthread_mutex_lock(&(p->lobby->players_mutex));
-                    while (g_list_length(p->lobby->players) < p->lobby->max_players && !g_queue_is_empty(p->lobby->queue)) {
-                        Player* queue_player = (Player*) g_queue_pop_head(p->lobby->queue);
-                        p->lobby->players = g_list_append(p->lobby->players, queue_player);
-                        char success_message[] = "A01\nWelcome to the lobby";
-                        printf("[INFO] Player %s joined from queue after match\n", queue_player->username);
-                        pthread_mutex_lock(&(queue_player->socket_mutex));
-                        send(queue_player->socket, success_message, sizeof(success_message), 0);
-                        pthread_mutex_unlock(&(queue_player->socket_mutex));
-                    }
-                    pthread_mutex_unlock(&(p->lobby->players_mutex));
+                    char * msg = "Z01\nYou are not looking for a match";
+                    LOG_WARN("match.find_failed", NULL, p->username, "Leave matchmaking failed: %s is not waiting", p->username);
+                    conn_send(conn, msg, strlen(msg));
                 }
                 break;
             }
-            default: {
-                if (!p) {
-                    char * msg = "Z03\nYou must authenticate first!";
-                    printf("[WARN] Unknown request: unauthenticated\n");
-                    send(client_socket, msg, strlen(msg), 0);
-                    break;
-                }
-                char default_message[] = "Z00\nUnknown request";
-                printf("[WARN] Unknown request from %s\n", p->username);
-                pthread_mutex_lock(&(p->socket_mutex));
-                send(client_socket, default_message, sizeof(default_message), 0);
-                pthread_mutex_unlock(&(p->socket_mutex));
+            if (size < MIN_PLAYERS || size > MAX_PLAYERS) {
+                char * msg = "Z01\nUsage: 106 <lobby size, 4-10>";
+                LOG_WARN("match.find_failed", NULL, p->username, "Find match failed: bad lobby size %d", size);
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            if (player_in_lobby(p)) {
+                char * msg = "Z01\nYou are already in a lobby";
+                LOG_WARN("match.find_failed", NULL, p->username, "Find match failed: already in a lobby");
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            int waiting = matchmaker_enqueue(p->id, p->language, size);
+            if (waiting < 0) {
+                char * msg = "Z02\nYou are already looking for a match";
+                LOG_WARN("match.find_failed", NULL, p->username, "Find match failed: %s is already waiting", p->username);
+                conn_send(conn, msg, strlen(msg));
+                break;
             }
+            LOG_INFO("match.find", NULL, p->username, "%s is looking for a match of %d (%s), %d waiting", p->username, size, p->language, waiting);
+            if (conn_binary(conn)) {
+                GString* binary = wire_begin(wire_code("A17"), 4);
+                wire_put_u32(binary, waiting);
+                conn_send_binary(conn, binary);
+            } else {
+                char msg[64];
+                snprintf(msg, sizeof(msg), "A17 %d\nLooking for a match", waiting);
+                conn_send(conn, msg, strlen(msg));
+            }
+            break;
         }
-    }
+        case OP_FIND_LOBBIES: {
+            if (!p) {
+                char * msg = "Z03\nYou must authenticate first!";
+                LOG_WARN("lobby.find_failed", NULL, NULL, "Find lobbies failed: unauthenticated");
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            if (!request->valid) {
+                char * msg = "Z01\nUsage: 104 <cursor> <limit> [free] [open] [lang=<xx>] [queue=<n>]";
+                LOG_WARN("lobby.find_failed", NULL, p->username, "Find lobbies failed: bad request format");
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            bool binary = conn_binary(conn);
+            GString* page = g_string_new(NULL);
+            guint64 next = lobby_index_query(&(request->filter), request->cursor, MIN(request->limit, MAX_PAGE), binary, page);
+            GBytes* parts[2];
+            parts[1] = g_string_free_to_bytes(page);
+            if (binary) {
+                // binary: the u64 next cursor, then the entries
+                GString* header = wire_begin(wire_code("A15"), 8);
+                wire_put_u64(header, next);
+                parts[0] = wire_end(header, g_bytes_get_size(parts[1]));
+            } else {
+                char header[32];
+                parts[0] = g_bytes_new(header, snprintf(header, sizeof(header), "A15 %" G_GUINT64_FORMAT "\n", next));
+            }
+            conn_sendv(conn, parts, 2);
+            g_bytes_unref(parts[0]);
+            g_bytes_unref(parts[1]);
+            break;
+        }
+        case OP_LEAVE_LOBBY: {
+            if (!p) {
+                char * msg = "Z03\nYou must authenticate first!";
+                LOG_WARN("lobby.leave_failed", NULL, NULL, "Leave lobby failed: unauthenticated");
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            Lobby* lobby = player_lobby(p);
+            if (!lobby) {
+                char error_messagge[] = "Z01\nYou are not in a lobby";
+                LOG_WARN("lobby.leave_failed", NULL, p->username, "Leave lobby failed: not in a lobby");
+                conn_send(conn, error_messagge, sizeof(error_messagge));
+                break;
+            }
+            lobby_post(lobby, lobby_on_leave, p, 0, NULL, NULL);
+            lobby_unref(lobby);
+            break;
+        }
+        case OP_START_MATCH: {
+            if (!p) {
+                char * msg = "Z03\nYou must authenticate first!";
+                LOG_WARN("match.start_failed", NULL, NULL, "Start match failed: unauthenticated");
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            Lobby* lobby = player_lobby(p);
+            if (!lobby) {
+                char error_messagge[] = "Z01\nYou are not the host";
+                LOG_WARN("match.start_failed", NULL, p->username, "Start match failed: not host");
+                conn_send(conn, error_messagge, sizeof(error_messagge));
+                break;
+            }
+            lobby_post(lobby, lobby_on_start, p, request->value, NULL, NULL);
+            lobby_unref(lobby);
+            break;
+        }
+        case OP_SPEAK: {
+            if (!p) {
+                char * msg = "Z03\nYou must authenticate first!";
+                LOG_WARN("match.speak_failed", NULL, NULL, "Speak failed: unauthenticated");
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            Lobby* lobby = player_lobby(p);
+            if (!lobby) {
+                char error_messagge[] = "Z01\nYou are not in a lobby";
+                LOG_WARN("match.speak_failed", NULL, p->username, "Speak failed: not in a lobby");
+                conn_send(conn, error_messagge, sizeof(error_messagge));
+                break;
+            }
 
-    close(client_socket);
-    if (p) {
-        printf("[INFO] Player %s (%s) disconnected.\n", p->username, p->id);
-        if (p->lobby) {
-            if (p->isHost) {
-                printf("[INFO] Host %s disconnected, deleting lobby %s\n", p->username, p->lobby->id);
-                g_list_foreach(p->lobby->players, lobby_broadcast_disconnection, p);
-                g_queue_foreach(p->lobby->queue, lobby_broadcast_disconnection, p);
-                pthread_mutex_lock(&lobbies_mutex);
-                g_hash_table_remove(lobbies, p->lobby->id);
-                pthread_mutex_unlock(&lobbies_mutex);
-                p->lobby = NULL;
-                p->isHost = false;
+            LOG_DEBUG("match.word", NULL, p->username, "Inserted word length is %d", request->word_len);
+            if (request->word_len >= MAX_LENGTH) {
+                char error_messagge[] = "Z01\nThe maximum length is 30";
+                LOG_WARN("match.speak_failed", NULL, p->username, "Speak failed: word too long");
+                conn_send(conn, error_messagge, sizeof(error_messagge));
+                lobby_unref(lobby);
+                break;
+            }
+            LOG_DEBUG("match.word", NULL, p->username, "The parsed word is: %s", request->word);
+            // turn checks and the phrase live on the lobby strand
+            lobby_post(lobby, lobby_on_speak, p, 0, request->word, NULL);
+            lobby_unref(lobby);
+            break;
+        }
+        case OP_PROTOCOL: {
+            // always answered in the format the client used to ask. Only once and
+            // before any auth request: after that, auth workers, lobby strands and
+            // pushes encode for this connection too and would race the switch.
+            int version = request->value;
+            if (!conn->negotiable) {
+                char * msg = "Z01\nProtocol can only be set once, before login";
+                LOG_WARN("protocol.failed", NULL, player_name(p), "Protocol negotiation failed: socket %d already negotiated or authenticating", conn->socket);
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            if (version < PROTOCOL_LEGACY) {
+                char * msg = "Z01\nUsage: 300 <version>";
+                LOG_WARN("protocol.failed", NULL, player_name(p), "Protocol negotiation failed: bad request format");
+                conn_send(conn, msg, strlen(msg));
+                break;
+            }
+            if (version > PROTOCOL_BINARY) {
+                version = PROTOCOL_BINARY;
+            }
+            if (conn_binary(conn)) {
+                GString* binary = wire_begin(wire_code("B00"), 2);
+                wire_put_u16(binary, version);
+                conn_send_binary(conn, binary);
             } else {
-                if (g_queue_find(p->lobby->queue, p)){
-                    pthread_mutex_lock(&(p->lobby->players_mutex));
-                    g_queue_pop_head(p->lobby->queue);
-                    pthread_mutex_unlock(&(p->lobby->players_mutex));
-                    p->lobby = NULL;
-                }
-                else
-                {
-                    printf("[INFO] Player %s disconnected from lobby %s\n", p->username, p->lobby->id);
-                    g_list_foreach(p->lobby->players, lobby_broadcast_disconnection, p);
-                    p->lobby->match->terminated = true;
-                    pthread_mutex_lock(&(p->lobby->players_mutex));
-                    p->lobby->players = g_list_remove(p->lobby->players, p);
-                    if (!g_queue_is_empty(p->lobby->queue)){
-                        Player *queue_player = g_queue_pop_head(p->lobby->queue);
-                        p->lobby->players = g_list_append(p->lobby->players, queue_player);
-                        char success_message[] = "A01\nWelcome to the lobby";
-                        printf("[INFO] Player %s joined from queue after disconnect\n", queue_player->username);
-                        pthread_mutex_lock(&(queue_player->socket_mutex));
-                        send(queue_player->socket, success_message, sizeof(success_message), 0);
-                        pthread_mutex_unlock(&(queue_player->socket_mutex));
-                    }
-                    pthread_mutex_unlock(&(p->lobby->players_mutex));
-                    p->lobby = NULL;
-                }
+                char msg[16];
+                snprintf(msg, sizeof(msg), "B00\n%d", version);
+                conn_send(conn, msg, strlen(msg));
+            }
+            conn->protocol = version;
+            conn->negotiable = false;
+            LOG_INFO("protocol.switch", NULL, player_name(p), "Socket %d switched to protocol version %d", conn->socket, version);
+            break;
+        }
+        default: {
+            if (!p) {
+                char * msg = "Z03\nYou must authenticate first!";
+                LOG_WARN("request.unknown", NULL, NULL, "Unknown request: unauthenticated");
+                conn_send(conn, msg, strlen(msg));
+                break;
             }
+            char default_message[] = "Z00\nUnknown request";
+            LOG_WARN("request.unknown", NULL, p->username, "Unknown request from %s", p->username);
+            conn_send(conn, default_message, sizeof(default_message));
+        }
+    }
+    metrics_observe(request_metric(request->op), g_get_monotonic_time() - started);
+}
+
+// A text request, legacy or framed
+void handle_command(Connection* conn, char* buffer, int bytes)
+{
+    Player *p = conn_player(conn);
+    buffer[bytes] = '\0';
+    if(p){
+        LOG_SAMPLED(LOG_LEVEL_INFO, "request", NULL, p->username, "Player %s (%" G_GINT64_MODIFIER "x): %s", p->username, p->id, buffer);
+    }
+    Request request;
+    request_parse_text(buffer, &request);
+    handle_request(conn, &request);
+}
+
+void handle_binary(Connection* conn, guint16 op, const guint8* payload, guint32 len)
+{
+    Player *p = conn_player(conn);
+    if(p){
+        LOG_SAMPLED(LOG_LEVEL_INFO, "request", NULL, p->username, "Player %s (%" G_GINT64_MODIFIER "x): op %d, %u bytes", p->username, p->id, op, len);
+    }
+    Request request;
+    request_parse_binary(op, payload, len, &request);
+    handle_request(conn, &request);
+}
+
+void handle_disconnect(Connection* conn)
+{
+    __atomic_store_n(&(conn->closed), true, __ATOMIC_RELEASE);
+    // nothing is written to the socket after this, so its number can be reused
+    outbox_close(conn->outbox);
+    close(conn->socket);
+    trace_close(conn->trace_id);
+    pthread_mutex_lock(&global_players_mutex);
+    Player *p = conn->player;
+    pthread_mutex_unlock(&global_players_mutex);
+    lobby_unsubscribe(conn);
+    if (p) {
+        LOG_INFO("player.disconnect", NULL, p->username, "Player %s (%" G_GINT64_MODIFIER "x) disconnected.", p->username, p->id);
+        // no lobby or matchmaker pass binds p after this, and the one p is in learns it last
+        pthread_mutex_lock(&(p->mutex));
+        p->gone = true;
+        Lobby* lobby = p->lobby ? lobby_ref(p->lobby) : NULL;
+        pthread_mutex_unlock(&(p->mutex));
+        matchmaker_cancel(p->id);
+        if (lobby) {
+            lobby_post(lobby, lobby_on_leave, p, 1, NULL, NULL);
+            lobby_unref(lobby);
         }
         pthread_mutex_lock(&global_players_mutex);
-        g_hash_table_remove(players, p->id);
+        player_unregister(p);
         pthread_mutex_unlock(&global_players_mutex);
     }
 
+    connection_unref(conn);
+}
+
+// Feeds the bytes of one read to the command handler. Legacy connections get one
+// command per read; framed and binary ones are buffered until whole frames are
+// available, so coalesced reads run several commands and split ones wait for
+// the rest. Returns false when the connection has to be closed.
+bool connection_input(Connection* conn, const char* data, int bytes)
+{
+    char buffer[MAX_FRAME + 1];
+    if (conn->trace_id) trace_input(conn->trace_id, data, bytes, outbox_queued(conn->outbox));
+    if (conn->protocol < PROTOCOL_FRAMED) {
+        memcpy(buffer, data, bytes);
+        handle_command(conn, buffer, bytes);
+        return true;
+    }
+    g_byte_array_append(conn->inbuf, (const guint8*) data, bytes);
+    guint offset = 0;
+    while (offset < conn->inbuf->len && conn->protocol >= PROTOCOL_FRAMED) {
+        const char* start = (const char*) conn->inbuf->data + offset;
+        guint available = conn->inbuf->len - offset;
+        if (conn_binary(conn)) {
+            if (available < WIRE_HEADER) {
+                break;
+            }
+            guint16 op;
+            guint32 len;
+            wire_header_read(start, &op, &len);
+            if (len > MAX_FRAME) {
+                LOG_WARN("protocol.malformed", NULL, NULL, "Socket %d sent an oversized frame", conn->socket);
+                return false;
+            }
+            if (available < WIRE_HEADER + len) {
+                break;
+            }
+            offset += WIRE_HEADER + len;
+            handle_binary(conn, op, (const guint8*) start + WIRE_HEADER, len);
+            continue;
+        }
+        const char* newline = memchr(start, '\n', MIN(available, 8));
+        if (!newline) {
+            if (available >= 8) {
+                LOG_WARN("protocol.malformed", NULL, NULL, "Socket %d sent a malformed frame header", conn->socket);
+                return false;
+            }
+            break;
+        }
+        char* end;
+        long len = strtol(start, &end, 10);
+        if (end != newline || len < 0 || len > MAX_FRAME) {
+            LOG_WARN("protocol.malformed", NULL, NULL, "Socket %d sent a malformed or oversized frame", conn->socket);
+            return false;
+        }
+        guint header_len = newline - start + 1;
+        if (available < header_len + len) {
+            break;
+        }
+        memcpy(buffer, newline + 1, len);
+        offset += header_len + len;
+        handle_command(conn, buffer, len);
+    }
+    g_byte_array_remove_range(conn->inbuf, 0, offset);
+    return true;
+}
+
+void *handle_client(void *arg)
+{
+    Connection* conn = (Connection*) arg;
+    char buffer[1024];
+    LOG_INFO("client.connect", NULL, NULL, "New client connected (socket %d)", conn->socket);
+    while (1)
+    {
+        int bytes = recv(conn->socket, buffer, sizeof(buffer) - 1, 0);
+        if (bytes <= 0 || !connection_input(conn, buffer, bytes))
+            break;
+    }
+    handle_disconnect(conn);
     pthread_exit(NULL);
 }
 
+void connection_want_write(void* handle, bool want) {
+    reactor_want_write((ReactorConn*) handle, want);
+}
+
+void* connection_accept(int socket, ReactorConn* handle) {
+    LOG_INFO("client.connect", NULL, NULL, "New client connected (socket %d)", socket);
+    Connection* conn = connection_new(socket);
+    // a full socket is waited for by its reactor, not by the flusher
+    outbox_watch(conn->outbox, connection_want_write, handle);
+    return conn;
+}
+
+bool connection_read(void* data, char* buffer, int bytes) {
+    return connection_input((Connection*) data, buffer, bytes);
+}
+
+void connection_write(void* data) {
+    outbox_flush(((Connection*) data)->outbox);
+}
+
+void connection_close(void* data) {
+    handle_disconnect((Connection*) data);
+}
+
+// Gauges that are cheaper to read at scrape time than to track on every change
+void metrics_collect(void) {
+    pthread_mutex_lock(&global_players_mutex);
+    metrics_gauge_set(players_metric, g_hash_table_size(players));
+    pthread_mutex_unlock(&global_players_mutex);
+    metrics_gauge_set(lobbies_metric, registry_size(lobbies));
+    metrics_gauge_set(matchmaking_metric, matchmaker_waiting());
+    PoolStats pool;
+    pool_stats(players_pool, &pool);
+    metrics_gauge_set(players_pool_metric, pool.bytes);
+    pool_stats(lobbies_pool, &pool);
+    metrics_gauge_set(lobbies_pool_metric, pool.bytes);
+    AuthStats auth;
+    auth_stats(&auth);
+    metrics_gauge_set(auth_queue_metric, auth.queued);
+    TranslatorPoolStats translator;
+    translator_pool_stats(&translator);
+    metrics_gauge_set(translator_backlog_metric, translator.backlog);
+}
+
 int main()
 {
-    if (db_init() != 0) {
+    const char* log_sample = getenv("LOG_SAMPLE");
+    const char* log_ring = getenv("LOG_RING");
+    if (logger_start(getenv("LOG_LEVEL"), getenv("LOG_FORMAT"), log_sample ? atoi(log_sample) : 10,
+                     log_ring ? atoi(log_ring) : 0) != 0) {
+        fprintf(stderr, "[FATAL] Failed to start the logger\n");
+        exit(EXIT_FAILURE);
+    }
+    metrics_register();
+    // records every connection's input and every translation, for replay.out
+    const char* trace_path = getenv("TRACE_FILE");
+    if (trace_path && trace_path[0] != '\0' && trace_start(trace_path) != 0) {
+        fprintf(stderr, "[FATAL] Failed to start recording the trace\n");
+        exit(EXIT_FAILURE);
+    }
+    const char* db_connections = getenv("DB_CONNECTIONS");
+    if (db_init(db_path, db_connections ? atoi(db_connections) : 4) != 0) {
         fprintf(stderr, "[FATAL] Failed to initialize DB\n");
         exit(EXIT_FAILURE);
     }
-    players = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, delete_player);
-    lobbies = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, delete_lobby);
+    const char* auth_workers = getenv("AUTH_WORKERS");
+    const char* auth_queue = getenv("AUTH_QUEUE");
+    const char* auth_iterations = getenv("AUTH_ITERATIONS");
+    if (auth_start(auth_workers ? atoi(auth_workers) : 2, auth_queue ? atoi(auth_queue) : 64,
+                   auth_iterations ? atoi(auth_iterations) : 100000) != 0) {
+        fprintf(stderr, "[FATAL] Failed to start the auth workers\n");
+        exit(EXIT_FAILURE);
+    }
+    const char* cache_mb = getenv("TRANSLATION_CACHE_MB");
+    cache_init((size_t) (cache_mb ? atoi(cache_mb) : 16) * 1024 * 1024, 16);
+    // an empty TRANSLATION_CACHE_DB keeps the cache in memory only
+    const char* store_path = getenv("TRANSLATION_CACHE_DB");
+    if (!store_path) store_path = "translations.db";
+    if (store_path[0] != '\0') {
+        if (cache_store_open(store_path) != 0) {
+            fprintf(stderr, "[WARN] Translation store unavailable, caching in memory only\n");
+        } else {
+            const char* preload = getenv("TRANSLATION_CACHE_PRELOAD");
+            int loaded = cache_store_preload(preload ? atoi(preload) : 10000);
+            LOG_INFO("cache.preload", NULL, NULL, "Preloaded %d translations from %s", loaded, store_path);
+        }
+    }
+    const char* url = getenv("TRANSLATOR_URL");
+    const char* connections = getenv("TRANSLATOR_CONNECTIONS");
+    const char* translator_workers = getenv("TRANSLATOR_WORKERS");
+    // TRANSLATOR_HTTP2=1 for a backend that speaks HTTP/2 over plain http
+    const char* http2 = getenv("TRANSLATOR_HTTP2");
+    if (translator_pool_init(url ? url : translator_url, connections ? atoi(connections) : 8, http2 && atoi(http2)) != 0 ||
+        translator_start(translator_workers ? atoi(translator_workers) : 2) != 0) {
+        fprintf(stderr, "[FATAL] Failed to start the translator workers\n");
+        exit(EXIT_FAILURE);
+    }
+    players_pool = pool_new(sizeof(Player), 256);
+    lobbies_pool = pool_new(sizeof(Lobby), 64);
+    players = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, delete_player);
+    players_by_username = g_hash_table_new(g_str_hash, g_str_equal);
+    const char* lobby_limit = getenv("MAX_LOBBIES");
+    if (lobby_limit) max_lobbies = atoi(lobby_limit);
+    lobbies = registry_new(LOBBY_SHARDS, max_lobbies, lobby_id_hash, lobby_id_equal, lobby_ref_data, delete_lobby);
+    lobby_index_init();
+    // lobby strands run on this pool, one worker per core unless told otherwise
+    const char* lobby_workers = getenv("LOBBY_WORKERS");
+    if (strand_pool_start(lobby_workers ? atoi(lobby_workers) : sysconf(_SC_NPROCESSORS_ONLN)) != 0) {
+        fprintf(stderr, "[FATAL] Failed to start the lobby workers\n");
+        exit(EXIT_FAILURE);
+    }
+    const char* outbox_high = getenv("OUTBOX_HIGH_KB");
+    const char* outbox_low = getenv("OUTBOX_LOW_KB");
+    const char* outbox_slow = getenv("OUTBOX_SLOW_MS");
+    if (outbox_start(outbox_high ? atoi(outbox_high) : 256, outbox_low ? atoi(outbox_low) : 64,
+                     outbox_slow ? atoi(outbox_slow) : 5000) != 0) {
+        fprintf(stderr, "[FATAL] Failed to start the outbox flusher\n");
+        exit(EXIT_FAILURE);
+    }
+    const char* push_interval = getenv("LOBBY_PUSH_INTERVAL_MS");
+    if (push_interval) lobby_push_interval_ms = atoi(push_interval);
+    pthread_t push_tid;
+    if (pthread_create(&push_tid, NULL, lobby_push_worker, NULL) != 0) {
+        fprintf(stderr, "[FATAL] Failed to start the lobby list push worker\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(push_tid);
+    const char* matchmaker_interval = getenv("MATCHMAKER_INTERVAL_MS");
+    if (matchmaker_start(MIN_PLAYERS, matchmaker_interval ? atoi(matchmaker_interval) : 100, matchmaker_fill, NULL) != 0) {
+        fprintf(stderr, "[FATAL] Failed to start the matchmaker\n");
+        exit(EXIT_FAILURE);
+    }
+    // METRICS_PORT=0 turns the endpoint off; it only listens locally unless told otherwise
+    const char* metrics_port = getenv("METRICS_PORT");
+    const char* metrics_address = getenv("METRICS_ADDRESS");
+    int metrics_port_number = metrics_port ? atoi(metrics_port) : 8081;
+    if (metrics_port_number > 0 &&
+        metrics_start(metrics_address ? metrics_address : "127.0.0.1", metrics_port_number, metrics_collect) != 0) {
+        fprintf(stderr, "[WARN] Metrics endpoint unavailable\n");
+    }
 
-    int server_fd, new_socket, *client_socket;
+    int server_fd, new_socket;
     struct sockaddr_in address;
     int addrlen = sizeof(address);
 
@@ -899,18 +2535,37 @@ int main()
         perror("[FATAL] bind failed");
         exit(EXIT_FAILURE);
     }
-    listen(server_fd, 3);
+    listen(server_fd, SOMAXCONN);
+
+    LOG_INFO("server.listen", NULL, NULL, "Server listening on port %d", PORT);
 
-    printf("[INFO] Server listening on port %d\n", PORT);
+    // REACTOR_THREADS > 0 switches from one thread per client to the epoll event loop
+    const char* reactors = getenv("REACTOR_THREADS");
+    int reactor_threads = reactors ? atoi(reactors) : 0;
+    if (reactor_threads > 0) {
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+        ReactorCallbacks callbacks = {connection_accept, connection_read, connection_write, connection_close};
+        LOG_INFO("server.reactor", NULL, NULL, "Event loop mode with %d reactor threads", reactor_threads);
+        if (reactor_run(server_fd, reactor_threads, &callbacks) != 0) {
+            fprintf(stderr, "[FATAL] Failed to start the event loop\n");
+            exit(EXIT_FAILURE);
+        }
+        close(server_fd);
+        return 0;
+    }
 
     while (1)
     {
         new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen);
-        client_socket = malloc(sizeof(int));
-        *client_socket = new_socket;
+        if (new_socket < 0)
+            continue;
 
         pthread_t tid;
-        pthread_create(&tid, NULL, handle_client, client_socket);
+        pthread_create(&tid, NULL, handle_client, connection_new(new_socket));
         pthread_detach(tid);
     }
 
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <glib-2.0/glib.h>
+#include "strand.h"
+
+#define STRAND_BATCH 32 // tasks a worker runs before letting other strands in
+
+typedef struct {
+    strand_fn fn;
+    void* arg;
+} StrandTask;
+
+struct Strand {
+    void* owner;
+    strand_ref_fn ref;
+    strand_unref_fn unref;
+    pthread_mutex_t mutex;
+    GQueue mailbox; // of StrandTask
+    bool scheduled; // in the ready queue or running on a worker
+};
+
+static GAsyncQueue* ready = NULL; // strands with tasks, waiting for a worker
+
+static void* strand_worker(void* arg) {
+    while (1) {
+        Strand* strand = (Strand*) g_async_queue_pop(ready);
+        bool more = true;
+        for (int i = 0; i < STRAND_BATCH && more; i++) {
+            pthread_mutex_lock(&(strand->mutex));
+            StrandTask* task = (StrandTask*) g_queue_pop_head(&(strand->mailbox));
+            if (!task) {
+                strand->scheduled = false;
+                more = false;
+            }
+            pthread_mutex_unlock(&(strand->mutex));
+            if (task) {
+                task->fn(strand->owner, task->arg);
+                g_free(task);
+            }
+        }
+        if (more) {
+            // still busy, go to the back of the line
+            g_async_queue_push(ready, strand);
+        } else {
+            // last touch of the strand, the owner may be gone after this
+            strand->unref(strand->owner);
+        }
+    }
+    return NULL;
+}
+
+int strand_pool_start(int workers) {
+    ready = g_async_queue_new();
+    for (int i = 0; i < workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, strand_worker, NULL) != 0) {
+            fprintf(stderr, "failed to start strand worker %d\n", i);
+            return 1;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+Strand* strand_new(void* owner, strand_ref_fn ref, strand_unref_fn unref) {
+    Strand* strand = g_new0(Strand, 1);
+    strand->owner = owner;
+    strand->ref = ref;
+    strand->unref = unref;
+    pthread_mutex_init(&(strand->mutex), NULL);
+    g_queue_init(&(strand->mailbox));
+    return strand;
+}
+
+void strand_post(Strand* strand, strand_fn fn, void* arg) {
+    StrandTask* task = g_new(StrandTask, 1);
+    task->fn = fn;
+    task->arg = arg;
+    pthread_mutex_lock(&(strand->mutex));
+    g_queue_push_tail(&(strand->mailbox), task);
+    bool schedule = !strand->scheduled;
+    if (schedule) {
+        strand->scheduled = true;
+        strand->ref(strand->owner);
+    }
+    pthread_mutex_unlock(&(strand->mutex));
+    if (schedule) {
+        g_async_queue_push(ready, strand);
+    }
+}
+
+void strand_free(Strand* strand) {
+    pthread_mutex_destroy(&(strand->mutex));
+    g_free(strand);
+}
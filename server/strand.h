@@ -0,0 +1,27 @@
+#ifndef STRAND_H
+#define STRAND_H
+
+// Serialized execution on a shared worker pool. Every strand has a mailbox of
+// tasks that run one at a time in posting order, never two at once, so the
+// state owned by a strand needs no lock. Different strands run in parallel
+// on the pool workers. A strand with queued tasks holds a reference to its
+// owner, so the owner outlives every task posted to it.
+
+typedef struct Strand Strand;
+
+typedef void* (*strand_ref_fn)(void* owner);
+typedef void (*strand_unref_fn)(void* owner);
+typedef void (*strand_fn)(void* owner, void* arg);
+
+// Returns 0 once the workers run.
+int strand_pool_start(int workers);
+
+Strand* strand_new(void* owner, strand_ref_fn ref, strand_unref_fn unref);
+
+// Queues fn(owner, arg) behind the tasks already posted to the strand.
+void strand_post(Strand* strand, strand_fn fn, void* arg);
+
+// For the owner's destructor: the mailbox is empty by then.
+void strand_free(Strand* strand);
+
+#endif
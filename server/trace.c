@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <glib-2.0/glib.h>
+#include "logger.h"
+#include "trace.h"
+
+#define TRACE_FLUSH_MS 100
+#define TRACE_MAX_PENDING (64 * 1024 * 1024)
+
+static FILE* file = NULL;
+static gint64 started = 0;
+static guint32 next_conn = 0;
+static GByteArray* pending = NULL;
+static unsigned long dropped = 0;
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void trace_append(guint32 type, guint32 conn, guint32 aux, const char* const* parts, const int* lengths, int count) {
+    TraceHeader header = {type, conn, g_get_monotonic_time() - started, aux, 0};
+    for (int i = 0; i < count; i++) header.len += lengths[i];
+    pthread_mutex_lock(&pending_mutex);
+    if (pending->len + sizeof(header) + header.len > TRACE_MAX_PENDING) {
+        dropped++;
+    } else {
+        g_byte_array_append(pending, (const guint8*) &header, sizeof(header));
+        for (int i = 0; i < count; i++) g_byte_array_append(pending, (const guint8*) parts[i], lengths[i]);
+    }
+    pthread_mutex_unlock(&pending_mutex);
+}
+
+static void* trace_writer(void* arg) {
+    GByteArray* batch = g_byte_array_new();
+    unsigned long reported = 0;
+    while (1) {
+        usleep(TRACE_FLUSH_MS * 1000);
+        pthread_mutex_lock(&pending_mutex);
+        GByteArray* full = pending;
+        pending = batch;
+        unsigned long lost = dropped;
+        pthread_mutex_unlock(&pending_mutex);
+        batch = full;
+        if (batch->len > 0) {
+            if (fwrite(batch->data, 1, batch->len, file) != batch->len) {
+                LOG_ERROR("trace.write", NULL, NULL, "Failed to write %u bytes of trace", batch->len);
+            }
+            fflush(file);
+            g_byte_array_set_size(batch, 0);
+        }
+        if (lost > reported) {
+            LOG_WARN("trace.dropped", NULL, NULL, "%lu trace records dropped on a full buffer", lost - reported);
+            reported = lost;
+        }
+    }
+    return NULL;
+}
+
+int trace_start(const char* path) {
+    file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "failed to open the trace %s\n", path);
+        return 1;
+    }
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), file);
+    pending = g_byte_array_sized_new(1024 * 1024);
+    started = g_get_monotonic_time();
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, trace_writer, NULL) != 0) {
+        fprintf(stderr, "failed to start the trace writer\n");
+        fclose(file);
+        file = NULL;
+        return 1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+guint32 trace_connection(void) {
+    if (!file) return 0;
+    guint32 conn = __atomic_add_fetch(&next_conn, 1, __ATOMIC_RELAXED);
+    trace_append(TRACE_OPEN, conn, 0, NULL, NULL, 0);
+    return conn;
+}
+
+void trace_input(guint32 conn, const char* data, int bytes, guint64 written) {
+    if (!conn) return;
+    trace_append(TRACE_INPUT, conn, (guint32) written, &data, &bytes, 1);
+}
+
+void trace_close(guint32 conn) {
+    if (!conn) return;
+    trace_append(TRACE_CLOSE, conn, 0, NULL, NULL, 0);
+}
+
+void trace_lobby(guint32 conn, const char* lobby_id) {
+    if (!conn) return;
+    int len = strlen(lobby_id);
+    trace_append(TRACE_LOBBY, conn, 0, &lobby_id, &len, 1);
+}
+
+void trace_translation(const char* origin, const char* source, const char* target, const char* text,
+                       int status, const char* translated, gint64 micros) {
+    if (!file) return;
+    const char* parts[] = {origin, source, target, text, translated};
+    int lengths[G_N_ELEMENTS(parts)];
+    for (int i = 0; i < (int) G_N_ELEMENTS(parts); i++) lengths[i] = strlen(parts[i]) + 1;
+    trace_append(TRACE_TRANSLATION, status, MIN(micros, G_MAXUINT32), parts, lengths, G_N_ELEMENTS(parts));
+}
+
+bool trace_check(FILE* in) {
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    return fread(magic, 1, sizeof(magic), in) == sizeof(magic) && memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0;
+}
+
+bool trace_read(FILE* in, TraceRecord* record) {
+    if (fread(&(record->header), sizeof(record->header), 1, in) != 1) return false;
+    record->data = g_malloc(record->header.len + 1);
+    record->data[record->header.len] = '\0';
+    if (record->header.len > 0 && fread(record->data, record->header.len, 1, in) != 1) {
+        g_free(record->data);
+        return false;
+    }
+    return true;
+}
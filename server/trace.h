@@ -0,0 +1,59 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <glib-2.0/glib.h>
+
+// Binary trace of a server's traffic, for replaying it against another build.
+// It holds the bytes every connection sent, as read, the lobby ids handed out
+// (so a replay can map them to the ids of the new run) and every translation
+// with its answer and how long it took. Recording appends to a buffer under a
+// lock and a writer thread flushes it every 100 ms; past 64 MB of unflushed
+// records new ones are dropped and counted.
+//
+// The file is "TTRACE1\n" then records, each a TraceHeader followed by len
+// bytes of payload, in the byte order of the recording host.
+
+#define TRACE_MAGIC "TTRACE1\n"
+
+#define TRACE_OPEN 1        // a connection was accepted
+#define TRACE_INPUT 2       // payload: the bytes of one read
+#define TRACE_CLOSE 3       // the connection was closed
+#define TRACE_LOBBY 4       // payload: the id of a lobby the connection was told it hosts (A00)
+#define TRACE_TRANSLATION 5 // payload: origin, source, target, text and answer, each NUL terminated
+
+typedef struct {
+    guint32 type;
+    guint32 conn; // connection id from 1; the status of a translation
+    gint64 time;  // microseconds since the recording started
+    guint32 aux;  // bytes sent to the connection before an input, the low 32 bits;
+                  // microseconds a translation took
+    guint32 len;  // bytes of payload
+} TraceHeader;
+
+typedef struct {
+    TraceHeader header;
+    char* data; // payload plus a NUL, g_free it
+} TraceRecord;
+
+// Starts recording to path. Returns 0 once the writer runs.
+int trace_start(const char* path);
+
+// Each does nothing unless recording. trace_connection records an open and
+// returns the id for the other calls, or 0. written is what the server had sent
+// on the connection when it read the input, which tells a replay what the
+// client had seen before sending it.
+guint32 trace_connection(void);
+void trace_input(guint32 conn, const char* data, int bytes, guint64 written);
+void trace_close(guint32 conn);
+void trace_lobby(guint32 conn, const char* lobby_id);
+void trace_translation(const char* origin, const char* source, const char* target, const char* text,
+                       int status, const char* translated, gint64 micros);
+
+// Reading, for the tools. trace_check consumes the magic; trace_read returns
+// false at the end of the file or on a truncated record.
+bool trace_check(FILE* file);
+bool trace_read(FILE* file, TraceRecord* record);
+
+#endif
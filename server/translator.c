@@ -1,4 +1,14 @@
+#include <stdbool.h>
+#include <pthread.h>
+#include <glib-2.0/glib.h>
 #include "translator.h"
+#include "cache.h"
+#include "cache_store.h"
+#include "logger.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define MAX_TRANSLATION 1024
 
 struct string {
     char* ptr;
@@ -25,55 +35,494 @@ size_t writefunc(void* ptr, size_t size, size_t nmemb, struct string* s) {
 }
 
 void translator_init(Translator* t, const char* url) {
-    curl_global_init(CURL_GLOBAL_DEFAULT);
     t->curl = curl_easy_init();
     t->headers = NULL;
     t->headers = curl_slist_append(t->headers, "Content-Type: application/x-www-form-urlencoded");
     strncpy(t->url, url, sizeof(t->url)-1);
     t->url[sizeof(t->url)-1] = '\0';
+    t->http_version = CURL_HTTP_VERSION_2TLS;
 }
 
-int translate(Translator *t, const char *text, const char *source, const char *target, char *out, size_t out_size) {
-    if (!t->curl) return 1;
-    struct string response;
-    char postfields[1024];
-    CURLcode res;
-
-    snprintf(postfields, sizeof(postfields),
+// Callable from any thread, curl_easy_escape ignores its handle
+static void build_postfields(const char *text, const char *source, const char *target, char *postfields, size_t size) {
+    char *escaped = curl_easy_escape(NULL, text, 0);
+    snprintf(postfields, size,
         "q=%s&source=%s&target=%s&format=text",
-        text, source, target);
+        escaped ? escaped : text, source, target);
+    curl_free(escaped);
+}
 
-    init_string(&response);
+static void parse_translation(const char *response, char *out, size_t out_size) {
+    const char *key = "\"translatedText\":\"";
+    const char *start = strstr(response, key);
+    if (start) {
+        start += strlen(key);
+        const char *end = strchr(start, '"');
+        size_t len = end ? (size_t)(end - start) : strlen(start);
+        if (len >= out_size) len = out_size - 1;
+        memcpy(out, start, len);
+        out[len] = '\0';
+    } else {
+        size_t len = strlen(response);
+        if (len >= out_size) len = out_size - 1;
+        memcpy(out, response, len);
+        out[len] = '\0';
+    }
+}
 
+static void translator_prepare(Translator *t, const char *postfields, struct string *response) {
     curl_easy_setopt(t->curl, CURLOPT_URL, t->url);
     curl_easy_setopt(t->curl, CURLOPT_HTTPHEADER, t->headers);
     curl_easy_setopt(t->curl, CURLOPT_POST, 1L);
     curl_easy_setopt(t->curl, CURLOPT_POSTFIELDS, postfields);
     curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, writefunc);
-    curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, &response);
+    curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, response);
+    curl_easy_setopt(t->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    // requests share a connection over HTTP/2, keep-alive HTTP/1.1 otherwise
+    curl_easy_setopt(t->curl, CURLOPT_HTTP_VERSION, t->http_version);
+    curl_easy_setopt(t->curl, CURLOPT_PIPEWAIT, 1L);
+}
+
+// Language codes come from clients, so only these get series of their own and
+// any other code counts as "other", which bounds the series at 6 x 6 x 4
+static const char *metered_languages[] = {"en", "it", "es", "fr", "de", "other"};
+static const char *origins[] = {"cache", "store", "backend", "error"};
+#define METERED_LANGUAGES G_N_ELEMENTS(metered_languages)
+#define ORIGINS G_N_ELEMENTS(origins)
+
+// Series ids + 2, registered on first use: 0 until then, 1 when the registry was full
+static int translation_series[METERED_LANGUAGES][METERED_LANGUAGES][ORIGINS];
+
+static int language_index(const char *code) {
+    int i = 0;
+    while (i < (int) METERED_LANGUAGES - 1 && strcmp(metered_languages[i], code) != 0) i++;
+    return i;
+}
+
+static int origin_index(const char *origin) {
+    int i = 0;
+    while (i < (int) ORIGINS - 1 && strcmp(origins[i], origin) != 0) i++;
+    return i;
+}
+
+// origin is cache, store, backend or error. Only the first translation of a
+// pair and origin takes the registry lock, later ones read the id without one.
+static void translation_observe(const char *source, const char *target, const char *origin, gint64 started) {
+    int from = language_index(source), to = language_index(target), result = origin_index(origin);
+    int *slot = &translation_series[from][to][result];
+    int series = __atomic_load_n(slot, __ATOMIC_RELAXED) - 2;
+    if (series == -2) {
+        char labels[64];
+        snprintf(labels, sizeof(labels), "source=\"%s\",target=\"%s\",result=\"%s\"",
+                 metered_languages[from], metered_languages[to], origins[result]);
+        series = metrics_histogram("telephone_translate_duration_seconds",
+                                   "Time from asking for a translation to the answer, by language pair and origin", labels);
+        __atomic_store_n(slot, series + 2, __ATOMIC_RELAXED);
+    }
+    metrics_observe(series, g_get_monotonic_time() - started);
+}
+
+// *origin tells where the answer came from, for the metrics
+static int translate_lookup(Translator *t, const char *text, const char *source, const char *target,
+                            char *out, size_t out_size, const char **origin) {
+    *origin = "cache";
+    if (cache_get(text, source, target, out, out_size)) return 0;
+    *origin = "store";
+    if (cache_store_get(text, source, target, out, out_size)) {
+        cache_put(text, source, target, out);
+        cache_store_hit(text, source, target);
+        return 0;
+    }
+    *origin = "error";
+    if (!t->curl) return 1;
+    struct string response;
+    char postfields[1024];
+    CURLcode res;
+
+    build_postfields(text, source, target, postfields, sizeof(postfields));
+
+    init_string(&response);
+
+    translator_prepare(t, postfields, &response);
 
     res = curl_easy_perform(t->curl);
     if(res != CURLE_OK) {
-        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+        LOG_ERROR("translate.failed", NULL, NULL, "Translation %s -> %s failed: %s", source, target, curl_easy_strerror(res));
         free(response.ptr);
         return 1;
-    } else {
-        const char *key = "\"translatedText\":\"";
-        char *start = strstr(response.ptr, key);
-        if (start) {
-            start += strlen(key);
-            char *end = strchr(start, '"');
-            size_t len = end ? (size_t)(end - start) : strlen(start);
-            if (len >= out_size) len = out_size - 1;
-            memcpy(out, start, len);
-            out[len] = '\0';
+    }
+    parse_translation(response.ptr, out, out_size);
+    cache_put(text, source, target, out);
+    cache_store_put(text, source, target, out);
+    free(response.ptr);
+    *origin = "backend";
+    return 0;
+}
+
+int translate(Translator *t, const char *text, const char *source, const char *target, char *out, size_t out_size) {
+    gint64 started = g_get_monotonic_time();
+    const char *origin;
+    int status = translate_lookup(t, text, source, target, out, out_size, &origin);
+    translation_observe(source, target, origin, started);
+    return status;
+}
+
+/* ** POOL ** */
+
+static Translator *pool = NULL;
+static GQueue pool_free = G_QUEUE_INIT;
+static TranslatorPoolStats pool_stats;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+static void workers_wakeup(void);
+
+int translator_pool_init(const char *url, int size, bool http2) {
+    if (size < 1) size = 1;
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    pool = calloc(size, sizeof(Translator));
+    for (int i = 0; i < size; i++) {
+        translator_init(&pool[i], url);
+        if (!pool[i].curl) return 1;
+        if (http2) pool[i].http_version = CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE;
+        g_queue_push_tail(&pool_free, &pool[i]);
+    }
+    pool_stats.size = size;
+    return 0;
+}
+
+static void pool_account_borrow(void) {
+    pool_stats.borrows++;
+    pool_stats.in_use++;
+    if (pool_stats.in_use > pool_stats.peak_in_use) {
+        pool_stats.peak_in_use = pool_stats.in_use;
+    }
+}
+
+Translator *translator_borrow(void) {
+    pthread_mutex_lock(&pool_mutex);
+    if (g_queue_is_empty(&pool_free)) {
+        gint64 start = g_get_monotonic_time();
+        pool_stats.waits++;
+        while (g_queue_is_empty(&pool_free)) {
+            pthread_cond_wait(&pool_cond, &pool_mutex);
+        }
+        pool_stats.wait_us += g_get_monotonic_time() - start;
+    }
+    Translator *t = g_queue_pop_head(&pool_free);
+    pool_account_borrow();
+    pthread_mutex_unlock(&pool_mutex);
+    return t;
+}
+
+// Non-blocking borrow for the workers
+static Translator *translator_try_borrow(void) {
+    pthread_mutex_lock(&pool_mutex);
+    Translator *t = g_queue_pop_head(&pool_free);
+    if (t) {
+        pool_account_borrow();
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return t;
+}
+
+void translator_return(Translator *t) {
+    pthread_mutex_lock(&pool_mutex);
+    g_queue_push_tail(&pool_free, t);
+    pool_stats.in_use--;
+    bool backlog = pool_stats.backlog > 0;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+    if (backlog) {
+        workers_wakeup();
+    }
+}
+
+void translator_pool_stats(TranslatorPoolStats *stats) {
+    pthread_mutex_lock(&pool_mutex);
+    *stats = pool_stats;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/* ** ASYNC PIPELINE ** */
+
+typedef struct {
+    Translator *translator;
+    struct string response;
+    char postfields[1024];
+    char *text;
+    char source[8];
+    char target[8];
+    translate_cb cb;
+    void *userdata;
+    gint64 queued_at;
+    bool waited; // found the pool saturated at least once
+} TranslateJob;
+
+typedef struct {
+    CURLM *multi;
+    GAsyncQueue *jobs;
+    GQueue backlog; // jobs waiting for a free translator
+    pthread_t tid;
+} TranslatorWorker;
+
+static TranslatorWorker *workers = NULL;
+static int worker_count = 0;
+static unsigned int next_worker = 0;
+static GAsyncQueue *lookups = NULL; // jobs for the store lookup thread, NULL without a store
+
+static void workers_wakeup(void) {
+    for (int i = 0; i < worker_count; i++) {
+        curl_multi_wakeup(workers[i].multi);
+    }
+}
+
+static void job_complete(TranslateJob *job, int status, const char *translated, const char *origin) {
+    translation_observe(job->source, job->target, origin, job->queued_at);
+    trace_translation(origin, job->source, job->target, job->text, status, translated,
+                      g_get_monotonic_time() - job->queued_at);
+    job->cb(status, translated, job->userdata);
+    free(job->response.ptr);
+    g_free(job->text);
+    g_free(job);
+}
+
+// Only answers of the backend are written to the store
+static void job_finish(TranslateJob *job, int status) {
+    char translated[MAX_TRANSLATION] = {0};
+    if (status == 0) {
+        parse_translation(job->response.ptr, translated, sizeof(translated));
+        cache_put(job->text, job->source, job->target, translated);
+        cache_store_put(job->text, job->source, job->target, translated);
+    }
+    job_complete(job, status, translated, status == 0 ? "backend" : "error");
+}
+
+static void backlog_update(int delta, unsigned long waits, gint64 wait_us) {
+    pthread_mutex_lock(&pool_mutex);
+    pool_stats.backlog += delta;
+    pool_stats.waits += waits;
+    pool_stats.wait_us += wait_us;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+static void worker_start_jobs(TranslatorWorker *w) {
+    TranslateJob *job;
+    while ((job = g_async_queue_try_pop(w->jobs)) != NULL) {
+        g_queue_push_tail(&w->backlog, job);
+        backlog_update(1, 0, 0);
+    }
+    while (!g_queue_is_empty(&w->backlog)) {
+        Translator *t = translator_try_borrow();
+        if (!t) {
+            job = g_queue_peek_head(&w->backlog);
+            if (!job->waited) {
+                job->waited = true;
+                backlog_update(0, 1, 0);
+            }
+            break;
+        }
+        job = g_queue_pop_head(&w->backlog);
+        backlog_update(-1, 0, job->waited ? g_get_monotonic_time() - job->queued_at : 0);
+        job->translator = t;
+        translator_prepare(t, job->postfields, &job->response);
+        curl_easy_setopt(t->curl, CURLOPT_PRIVATE, job);
+        curl_multi_add_handle(w->multi, t->curl);
+    }
+}
+
+static void *translator_worker(void *arg) {
+    TranslatorWorker *w = (TranslatorWorker *) arg;
+    int running = 0;
+    while (1) {
+        worker_start_jobs(w);
+        curl_multi_perform(w->multi, &running);
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(w->multi, &left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            CURL *curl = msg->easy_handle;
+            CURLcode res = msg->data.result;
+            TranslateJob *job;
+            curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **) &job);
+            curl_multi_remove_handle(w->multi, curl);
+            if (res != CURLE_OK) {
+                LOG_ERROR("translate.failed", NULL, NULL, "Translation %s -> %s failed: %s",
+                          job->source, job->target, curl_easy_strerror(res));
+            }
+            translator_return(job->translator);
+            job_finish(job, res == CURLE_OK ? 0 : 1);
+        }
+        // woken up early by curl_multi_wakeup when a job is queued or a translator frees up
+        curl_multi_poll(w->multi, NULL, 0, 1000, NULL);
+    }
+    return NULL;
+}
+
+static void job_dispatch(TranslateJob *job) {
+    TranslatorWorker *w = &workers[__atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED) % worker_count];
+    g_async_queue_push(w->jobs, job);
+    curl_multi_wakeup(w->multi);
+}
+
+// Misses of the memory cache look in the store here before going to the
+// backend, so neither reactor threads nor the transfers of a curl worker
+// ever wait on a disk read.
+static void *store_lookup_worker(void *arg) {
+    (void) arg;
+    while (1) {
+        TranslateJob *job = g_async_queue_pop(lookups);
+        char stored[MAX_TRANSLATION];
+        if (cache_store_get(job->text, job->source, job->target, stored, sizeof(stored))) {
+            // already on disk, the store only counts the hit
+            cache_put(job->text, job->source, job->target, stored);
+            cache_store_hit(job->text, job->source, job->target);
+            job_complete(job, 0, stored, "store");
         } else {
-            size_t len = strlen(response.ptr);
-            if (len >= out_size) len = out_size - 1;
-            memcpy(out, response.ptr, len);
-            out[len] = '\0';
+            job_dispatch(job);
         }
     }
-    free(response.ptr);
+    return NULL;
+}
+
+int translator_start(int count) {
+    if (count < 1) count = 1;
+    workers = calloc(count, sizeof(TranslatorWorker));
+    // every worker may keep its share of the pool connected to the backend
+    long connections = pool_stats.size / count > 0 ? pool_stats.size / count : 1;
+    for (int i = 0; i < count; i++) {
+        workers[i].multi = curl_multi_init();
+        workers[i].jobs = g_async_queue_new();
+        g_queue_init(&workers[i].backlog);
+        if (!workers[i].multi) {
+            fprintf(stderr, "failed to start translator worker %d\n", i);
+            return 1;
+        }
+        curl_multi_setopt(workers[i].multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        curl_multi_setopt(workers[i].multi, CURLMOPT_MAX_HOST_CONNECTIONS, connections);
+        curl_multi_setopt(workers[i].multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, connections);
+        curl_multi_setopt(workers[i].multi, CURLMOPT_MAXCONNECTS, connections);
+    }
+    worker_count = count;
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&workers[i].tid, NULL, translator_worker, &workers[i]) != 0) {
+            fprintf(stderr, "failed to start translator worker %d\n", i);
+            return 1;
+        }
+        pthread_detach(workers[i].tid);
+    }
+    if (cache_store_is_open()) {
+        lookups = g_async_queue_new();
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, store_lookup_worker, NULL) != 0) {
+            fprintf(stderr, "failed to start the translation store lookups\n");
+            return 1;
+        }
+        pthread_detach(tid);
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+static void job_submit(const char *text, const char *source, const char *target, translate_cb cb, void *userdata) {
+    TranslateJob *job = g_new0(TranslateJob, 1);
+    job->cb = cb;
+    job->userdata = userdata;
+    job->queued_at = g_get_monotonic_time();
+    job->text = g_strdup(text);
+    g_strlcpy(job->source, source, sizeof(job->source));
+    g_strlcpy(job->target, target, sizeof(job->target));
+    init_string(&job->response);
+    build_postfields(text, source, target, job->postfields, sizeof(job->postfields));
+
+    if (lookups) {
+        g_async_queue_push(lookups, job);
+    } else {
+        job_dispatch(job);
+    }
+}
+
+/* ** IN-FLIGHT REQUESTS ** */
+
+// Identical requests made while one is in flight wait for its answer instead of
+// reaching the backend again.
+typedef struct {
+    translate_cb cb;
+    void *userdata;
+} Waiter;
+
+typedef struct {
+    char *key;
+    char *text;
+    char source[8];
+    char target[8];
+    GSList *waiters;
+} InFlight;
+
+static GHashTable *inflight = NULL;
+static pthread_mutex_t inflight_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long coalesced = 0;
+
+static void inflight_done(int status, const char *translated, void *userdata) {
+    InFlight *f = (InFlight *) userdata;
+    pthread_mutex_lock(&inflight_mutex);
+    g_hash_table_remove(inflight, f->key);
+    pthread_mutex_unlock(&inflight_mutex);
+    for (GSList *node = f->waiters; node != NULL; node = node->next) {
+        Waiter *waiter = (Waiter *) node->data;
+        waiter->cb(status, translated, waiter->userdata);
+    }
+    g_slist_free_full(f->waiters, g_free);
+    g_free(f->key);
+    g_free(f->text);
+    g_free(f);
+}
+
+unsigned long translator_coalesced(void) {
+    pthread_mutex_lock(&inflight_mutex);
+    unsigned long n = coalesced;
+    pthread_mutex_unlock(&inflight_mutex);
+    return n;
+}
+
+void translate_async(const char *text, const char *source, const char *target, translate_cb cb, void *userdata) {
+    if (worker_count == 0 || !pool) {
+        cb(1, "", userdata);
+        return;
+    }
+    gint64 started = g_get_monotonic_time();
+    char cached[MAX_TRANSLATION];
+    if (cache_get(text, source, target, cached, sizeof(cached))) {
+        cache_store_hit(text, source, target);
+        translation_observe(source, target, "cache", started);
+        trace_translation("cache", source, target, text, 0, cached, g_get_monotonic_time() - started);
+        cb(0, cached, userdata);
+        return;
+    }
+
+    Waiter *waiter = g_new(Waiter, 1);
+    waiter->cb = cb;
+    waiter->userdata = userdata;
+    char *key = cache_key(text, source, target);
+    pthread_mutex_lock(&inflight_mutex);
+    if (!inflight) {
+        inflight = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    InFlight *f = g_hash_table_lookup(inflight, key);
+    if (f) {
+        f->waiters = g_slist_prepend(f->waiters, waiter);
+        coalesced++;
+        pthread_mutex_unlock(&inflight_mutex);
+        g_free(key);
+        return;
+    }
+    f = g_new0(InFlight, 1);
+    f->key = key;
+    f->text = g_strdup(text);
+    g_strlcpy(f->source, source, sizeof(f->source));
+    g_strlcpy(f->target, target, sizeof(f->target));
+    f->waiters = g_slist_prepend(NULL, waiter);
+    g_hash_table_insert(inflight, f->key, f);
+    pthread_mutex_unlock(&inflight_mutex);
+
+    job_submit(text, source, target, inflight_done, f);
+}
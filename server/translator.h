@@ -3,17 +3,65 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <curl/curl.h>
 
+// One keep-alive connection to LibreTranslate. Translators live in a process-wide
+// pool: borrow one, call translate, give it back.
 typedef struct {
     CURL *curl;
     struct curl_slist *headers;
     char url[256];
+    long http_version; // CURL_HTTP_VERSION_*
 } Translator;
 
+typedef struct {
+    int size;                       // translators in the pool
+    int in_use;                     // currently borrowed (sync callers and in-flight async jobs)
+    int peak_in_use;
+    unsigned long borrows;
+    unsigned long waits;            // borrows that found the pool empty
+    unsigned long long wait_us;     // time spent waiting for a free translator
+    int backlog;                    // async jobs queued until a translator frees up
+} TranslatorPoolStats;
+
+// Completion of an asynchronous translation: status is 0 on success (as for translate)
+// and translated is only valid during the call. Runs on a translator worker thread.
+typedef void (*translate_cb)(int status, const char *translated, void *userdata);
+
+// Creates the pool of size translators for url, call once before anything else.
+// HTTP/2 is negotiated on https URLs. http2 also speaks it to a plain http
+// backend, without asking first, so only set it for a backend known to
+// support cleartext HTTP/2; LibreTranslate itself does not.
+int translator_pool_init(const char *url, int size, bool http2);
+
+void translator_pool_stats(TranslatorPoolStats *stats);
+
+// Starts the workers serving translate_async, each one drives a curl multi handle
+// so many requests are in flight at once without a thread per request.
+int translator_start(int workers);
+
+// Queues the translation and returns immediately, cb is called exactly once.
+// In-flight jobs borrow from the pool, the rest wait in the worker's backlog.
+// Cache hits call cb right away on the calling thread, and a request identical to
+// one still in flight shares its backend call.
+void translate_async(const char *text, const char *source, const char *target, translate_cb cb, void *userdata);
+
+// Requests answered by sharing an identical in-flight backend call.
+unsigned long translator_coalesced(void);
+
+// Blocking API, kept for tools and scripts linking translator.c. The server
+// itself only calls translate_async, which never waits on the backend.
+
 void translator_init(Translator *t, const char *url);
 
+// Looks in the caches, then asks the backend and waits for its answer.
 int translate(Translator *t, const char *text, const char *source, const char *target, char *out, size_t out_size);
 
-#endif
\ No newline at end of file
+// Blocks while every translator is borrowed.
+Translator *translator_borrow(void);
+
+void translator_return(Translator *t);
+
+#endif
@@ -0,0 +1,135 @@
+#include <string.h>
+#include <uuid/uuid.h>
+#include <glib-2.0/glib.h>
+#include "wire.h"
+
+guint16 wire_code(const char* status) {
+    return (guint16) (((guint8) status[0] << 8) | ((status[1] - '0') * 10 + (status[2] - '0')));
+}
+
+GString* wire_begin(guint16 code, gsize reserve) {
+    GString* message = g_string_sized_new(WIRE_HEADER + reserve);
+    wire_put_u16(message, code);
+    wire_put_u32(message, 0);
+    return message;
+}
+
+GBytes* wire_end(GString* message, gsize trailing) {
+    guint32 len = GUINT32_TO_BE((guint32) (message->len - WIRE_HEADER + trailing));
+    memcpy(message->str + 2, &len, sizeof(len));
+    return g_string_free_to_bytes(message);
+}
+
+void wire_put_u8(GString* out, guint8 value) {
+    g_string_append_c(out, (char) value);
+}
+
+void wire_put_u16(GString* out, guint16 value) {
+    value = GUINT16_TO_BE(value);
+    g_string_append_len(out, (const char*) &value, sizeof(value));
+}
+
+void wire_put_u32(GString* out, guint32 value) {
+    value = GUINT32_TO_BE(value);
+    g_string_append_len(out, (const char*) &value, sizeof(value));
+}
+
+void wire_put_u64(GString* out, guint64 value) {
+    value = GUINT64_TO_BE(value);
+    g_string_append_len(out, (const char*) &value, sizeof(value));
+}
+
+void wire_put_str8(GString* out, const char* text) {
+    gsize len = MIN(strlen(text), G_MAXUINT8);
+    wire_put_u8(out, len);
+    g_string_append_len(out, text, len);
+}
+
+void wire_put_str16(GString* out, const char* text) {
+    gsize len = MIN(strlen(text), G_MAXUINT16);
+    wire_put_u16(out, len);
+    g_string_append_len(out, text, len);
+}
+
+void wire_put_uuid(GString* out, const char* id) {
+    uuid_t raw;
+    if (uuid_parse(id, raw) != 0) uuid_clear(raw);
+    g_string_append_len(out, (const char*) raw, sizeof(raw));
+}
+
+void wire_put_bytes(GString* out, const void* data, gsize n) {
+    g_string_append_len(out, (const char*) data, n);
+}
+
+void wire_header_read(const void* data, guint16* code, guint32* len) {
+    guint16 c;
+    guint32 l;
+    memcpy(&c, data, sizeof(c));
+    memcpy(&l, (const guint8*) data + 2, sizeof(l));
+    *code = GUINT16_FROM_BE(c);
+    *len = GUINT32_FROM_BE(l);
+}
+
+void wire_reader_init(WireReader* reader, const void* data, gsize len) {
+    reader->data = data;
+    reader->len = len;
+    reader->pos = 0;
+    reader->ok = true;
+}
+
+void wire_get_bytes(WireReader* reader, void* out, gsize n) {
+    if (reader->len - reader->pos < n) {
+        reader->ok = false;
+        reader->pos = reader->len;
+        memset(out, 0, n);
+        return;
+    }
+    memcpy(out, reader->data + reader->pos, n);
+    reader->pos += n;
+}
+
+guint8 wire_get_u8(WireReader* reader) {
+    guint8 value;
+    wire_get_bytes(reader, &value, sizeof(value));
+    return value;
+}
+
+guint16 wire_get_u16(WireReader* reader) {
+    guint16 value;
+    wire_get_bytes(reader, &value, sizeof(value));
+    return GUINT16_FROM_BE(value);
+}
+
+guint32 wire_get_u32(WireReader* reader) {
+    guint32 value;
+    wire_get_bytes(reader, &value, sizeof(value));
+    return GUINT32_FROM_BE(value);
+}
+
+guint64 wire_get_u64(WireReader* reader) {
+    guint64 value;
+    wire_get_bytes(reader, &value, sizeof(value));
+    return GUINT64_FROM_BE(value);
+}
+
+void wire_get_str8(WireReader* reader, char* out, gsize size) {
+    gsize len = wire_get_u8(reader);
+    if (len >= size || reader->len - reader->pos < len) {
+        reader->ok = false;
+        reader->pos = reader->len;
+        out[0] = '\0';
+        return;
+    }
+    wire_get_bytes(reader, out, len);
+    out[len] = '\0';
+}
+
+void wire_get_uuid(WireReader* reader, char* out) {
+    uuid_t raw;
+    wire_get_bytes(reader, raw, sizeof(raw));
+    uuid_unparse(raw, out);
+}
+
+gsize wire_remaining(const WireReader* reader) {
+    return reader->len - reader->pos;
+}
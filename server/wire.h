@@ -0,0 +1,57 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdbool.h>
+#include <glib-2.0/glib.h>
+
+// Codec of the binary protocol (version 3). Every message in both directions
+// is a fixed header, a u16 code and the u32 length of the payload, followed by
+// the payload. Requests carry their opcode; responses carry their status code
+// as the letter in the high byte and the number in the low one, so "A05" is
+// 0x4105. Integers are big-endian, strings are a u8 or u16 length followed by
+// the bytes, and lobby ids are the 16 raw bytes of the UUID.
+
+#define WIRE_HEADER 6
+
+// "A05" -> 0x4105
+guint16 wire_code(const char* status);
+
+// A message is built in a GString: wire_begin writes a header to fill in, the
+// wire_put_* calls append the payload, and wire_end sets the length, counting
+// trailing bytes queued after it as parts of their own, and takes over the string.
+GString* wire_begin(guint16 code, gsize reserve);
+GBytes* wire_end(GString* message, gsize trailing);
+
+void wire_put_u8(GString* out, guint8 value);
+void wire_put_u16(GString* out, guint16 value);
+void wire_put_u32(GString* out, guint32 value);
+void wire_put_u64(GString* out, guint64 value);
+void wire_put_str8(GString* out, const char* text);  // cut at 255 bytes
+void wire_put_str16(GString* out, const char* text); // cut at 65535 bytes
+void wire_put_uuid(GString* out, const char* id);    // zeros for a malformed id
+void wire_put_bytes(GString* out, const void* data, gsize n);
+
+// Reads the header at data, which holds at least WIRE_HEADER bytes
+void wire_header_read(const void* data, guint16* code, guint32* len);
+
+// Reads a payload. A read past the end or of a string that does not fit
+// clears ok and yields zeros or an empty string, so a decoder reads every
+// field and checks ok once.
+typedef struct {
+    const guint8* data;
+    gsize len;
+    gsize pos;
+    bool ok;
+} WireReader;
+
+void wire_reader_init(WireReader* reader, const void* data, gsize len);
+guint8 wire_get_u8(WireReader* reader);
+guint16 wire_get_u16(WireReader* reader);
+guint32 wire_get_u32(WireReader* reader);
+guint64 wire_get_u64(WireReader* reader);
+void wire_get_bytes(WireReader* reader, void* out, gsize n);
+void wire_get_str8(WireReader* reader, char* out, gsize size);
+void wire_get_uuid(WireReader* reader, char* out); // 37 bytes, the textual form
+gsize wire_remaining(const WireReader* reader);
+
+#endif